@@ -0,0 +1,111 @@
+/* Times the same commands arriving as text lines and as binary frames: a
+   number of `set key <k> <v>` commands with a handler that does almost
+   nothing, read from a file, once with read_line, split_words and
+   imcli_dispatch, and once with imcli_read_frame and imcli_dispatch_frame.
+
+       cc -O2 -std=c11 -o frames_bench bench/frames.c
+
+   and run it with an optional command count, default 2000000. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../imcli.h"
+
+#define STB_DS_IMPLEMENTATION
+#include "../stb_ds.h"
+
+static long total_length = 0;
+
+static bool set_key_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)session;
+    (void)userdata;
+    /* Look at the arguments, so the work can't be skipped. */
+    for (int i = 0; i < arrlen(*args); i++) total_length += arrlen((*args)[i]);
+    return true;
+}
+
+static double now(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    long count = argc > 1 ? atol(argv[1]) : 2000000;
+
+    struct imcli_registry registry = {0};
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "set key",
+        .help_message = "set key <key> <value>\n",
+        .handler = set_key_command,
+    });
+
+    FILE *text = tmpfile();
+    FILE *frames = tmpfile();
+    if (!text || !frames) return 1;
+
+    char_buffer frame = NULL;
+    for (long i = 0; i < count; i++) {
+        char key[32];
+        char value[32];
+        snprintf(key, sizeof(key), "key%ld", i);
+        snprintf(value, sizeof(value), "value%ld", i);
+        fprintf(text, "set key %s %s\n", key, value);
+
+        char *args[] = {key, value};
+        arrsetlen(frame, 0);
+        imcli_encode_frame(&frame, 0, 2, args);
+        fwrite(frame, 1, arrlen(frame), frames);
+    }
+    arrfree(frame);
+    rewind(text);
+    rewind(frames);
+
+    struct imcli_session session = imcli_session_new(text, NULL);
+    long text_count = 0;
+    double start = now();
+    while (true) {
+        char_buffer line = read_line(&session);
+        bool at_end = feof(text);
+        string_buffer words = split_words(line);
+        if (arrlen(words) > 0) {
+            imcli_dispatch(&session, &registry, &words);
+            text_count++;
+        }
+        sbfree(&words);
+        if (at_end) break;
+    }
+    double text_time = now() - start;
+    imcli_session_free(&session);
+
+    session = imcli_session_new(frames, NULL);
+    long frame_count = 0;
+    start = now();
+    uint32_t command;
+    string_buffer words;
+    while (imcli_read_frame(&session, &command, &words) == 1) {
+        imcli_dispatch_frame(&session, &registry, command, &words);
+        sbfree(&words);
+        frame_count++;
+    }
+    double frame_time = now() - start;
+    imcli_session_free(&session);
+
+    /* Make sure both ran everything. */
+    if (text_count != count || frame_count != count) return 1;
+
+    printf("%ld commands: text %.2f M/s, frames %.2f M/s\n", count,
+        count / text_time / 1e6, count / frame_time / 1e6);
+
+    fclose(text);
+    fclose(frames);
+    imcli_registry_free(&registry);
+    return 0;
+}
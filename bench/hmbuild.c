@@ -0,0 +1,73 @@
+/* Times building a big string hashmap three ways: one shput at a time, with
+   shbuild, and with shbuild hashing its keys on several threads.
+
+   Build it twice, once with threads and once without:
+
+       cc -O2 -std=c11 -o hmbuild bench/hmbuild.c
+       cc -O2 -std=c11 -DSTBDS_THREADS -o hmbuild_threads bench/hmbuild.c -lpthread
+
+   and run each with an optional item count, default 2000000. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STB_DS_IMPLEMENTATION
+#include "../stb_ds.h"
+
+struct entry {
+    char *key;
+    int value;
+};
+
+static double now(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+
+    /* Keys long enough that hashing them is a real part of the work, like
+       symbol names or paths. */
+    const size_t key_size = 48;
+    struct entry *items = malloc(count * sizeof(*items));
+    char *keys = malloc(count * key_size);
+    if (!items || !keys) return 1;
+    for (size_t i = 0; i < count; i++) {
+        items[i].key = &keys[i * key_size];
+        snprintf(items[i].key, key_size, "module/%zu/symbol_%zu_name", i % 977,
+            i);
+        items[i].value = (int)i;
+    }
+
+    struct entry *map = NULL;
+    double start = now();
+    for (size_t i = 0; i < count; i++) shput(map, items[i].key, items[i].value);
+    double put_time = now() - start;
+    shfree(map);
+
+    map = NULL;
+    start = now();
+    shbuild(map, items, count);
+    double build_time = now() - start;
+
+    /* Make sure it actually built something. */
+    if ((size_t)shlen(map) != count) return 1;
+    if (shget(map, items[count / 2].key) != (int)(count / 2)) return 1;
+    shfree(map);
+
+#ifdef STBDS_THREADS
+    char *how = "shbuild, threads";
+#else
+    char *how = "shbuild";
+#endif
+    printf("%zu items: shput %.3fs, %s %.3fs\n", count, put_time, how,
+        build_time);
+
+    free(keys);
+    free(items);
+    return 0;
+}
@@ -0,0 +1,146 @@
+/* Load generator for imcli_server_run: forks a server on a Unix socket, then
+   keeps a number of client connections busy, each sending a command and
+   waiting for its answer before sending the next, and reports commands per
+   second and the 99th percentile round trip as connections are added.
+
+       cc -O2 -std=c11 -o server_bench bench/server.c
+
+   and run it with an optional command count per step, default 200000. */
+
+#define _POSIX_C_SOURCE 200809L
+#define IMCLI_SERVER
+
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "../imcli.h"
+
+#define STB_DS_IMPLEMENTATION
+#include "../stb_ds.h"
+
+static bool ping_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)args;
+    (void)userdata;
+    imcli_printf(session, "pong\n");
+    return true;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int connect_to(char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Runs count commands spread over connection_count connections, one command
+   in flight per connection. */
+static bool run_step(char *path, int connection_count, int count) {
+    struct pollfd *fds = calloc(connection_count, sizeof(*fds));
+    double *sent_at = calloc(connection_count, sizeof(*sent_at));
+    double *latencies = malloc(count * sizeof(*latencies));
+    if (!fds || !sent_at || !latencies) return false;
+
+    for (int i = 0; i < connection_count; i++) {
+        fds[i].fd = connect_to(path);
+        fds[i].events = POLLIN;
+        if (fds[i].fd < 0) return false;
+    }
+
+    double start = now();
+    int started = 0;
+    int finished = 0;
+    for (int i = 0; i < connection_count && started < count; i++) {
+        sent_at[i] = now();
+        if (write(fds[i].fd, "ping\n", 5) != 5) return false;
+        started++;
+    }
+
+    while (finished < count) {
+        if (poll(fds, connection_count, -1) < 0) return false;
+
+        for (int i = 0; i < connection_count; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+
+            /* Answers are small enough to arrive whole. */
+            char answer[16];
+            if (read(fds[i].fd, answer, sizeof(answer)) != 5) return false;
+            latencies[finished++] = now() - sent_at[i];
+
+            if (started < count) {
+                sent_at[i] = now();
+                if (write(fds[i].fd, "ping\n", 5) != 5) return false;
+                started++;
+            }
+        }
+    }
+    double elapsed = now() - start;
+
+    qsort(latencies, count, sizeof(*latencies), compare_doubles);
+    printf("%4d connections: %9.0f commands/s, p99 %7.1fus\n",
+        connection_count, count / elapsed, latencies[count * 99 / 100] * 1e6);
+
+    for (int i = 0; i < connection_count; i++) close(fds[i].fd);
+    free(fds);
+    free(sent_at);
+    free(latencies);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 200000;
+    char *path = "/tmp/imcli_server_bench.sock";
+
+    struct imcli_registry registry = {0};
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "ping",
+        .help_message = "ping\n",
+        .handler = ping_command,
+        .flags = IMCLI_NO_ARGS,
+    });
+
+    int listen_fd = imcli_server_listen(path);
+    if (listen_fd < 0) return 1;
+
+    pid_t server = fork();
+    if (server == 0) {
+        imcli_server_run(&registry, listen_fd, NULL);
+        _exit(1);
+    }
+    close(listen_fd);
+
+    bool ok = true;
+    int steps[] = {1, 4, 16, 64, 256};
+    for (int i = 0; ok && i < (int)(sizeof(steps) / sizeof(steps[0])); i++) {
+        ok = run_step(path, steps[i], count);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(path);
+    imcli_registry_free(&registry);
+    return ok ? 0 : 1;
+}
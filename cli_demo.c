@@ -2,79 +2,184 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <string.h>
 
 #include "imcli.h"
 
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 
-int main(int cli_arg_count, char **cli_args) {
-    while (true) {
-        string_buffer words = prompt(">");
+bool echo_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    if (session->json) {
+        imcli_record_begin(session);
+        imcli_record_words(session, "echo", *args);
+        imcli_record_end(session);
+        return true;
+    }
+
+    char_buffer rest = join_words(*args);
+    imcli_printf(session, "%s\n", rest);
+    arrfree(rest);
+    return true;
+}
+
+bool multiple_word_test_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    if (session->json) {
+        imcli_record_begin(session);
+        imcli_record_int(session, "argument_count", arrlen(*args));
+        imcli_record_end(session);
+        return true;
+    }
+
+    imcli_printf(
+        session,
+        "Multiple word test was run with %d arguments.\n",
+        (int)arrlen(*args)
+    );
+    return true;
+}
 
-        bool help = match_keyword(&words, "help", NULL);
+bool greet_answer(
+    struct imcli_session *session,
+    string_buffer *words,
+    void *state
+) {
+    /* The session ended before anyone answered. */
+    if (!words) return false;
 
-        bool any_matched = false;
+    char_buffer name = join_words(*words);
+    imcli_message(session, "greeting", "Hello, %s!\n", name);
+    arrfree(name);
+    return true;
+}
+
+bool greet_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    imcli_message(session, "question", "What is your name?\n");
+    imcli_await_words(session, greet_answer, NULL);
+    return true;
+}
+
+bool exit_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    return false;
+}
 
-        if (match_or_explain_keyword_detailed(
-            &words,
-            "echo",
-            "echo: Prints input back to the screen.\n",
+/* The commands only depend on the session they are given, not on where its
+   words came from, so the same registry can be driven by a prompt loop, or by
+   lines fed in from a socket with imcli_feed/imcli_take_line. */
+struct imcli_registry make_registry(void) {
+    struct imcli_registry registry = {0};
 
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "echo",
+        .help_message = "echo: Prints input back to the screen.\n",
+        .detailed_help_message =
             "Usage: echo [argument] [...]\n"
             "Print arguments to the screen. Words with multiple spaces or tabs\n"
             "between them will be printed with a single space between them instead.\n",
-            help,
-            &any_matched
-        )) {
-            char_buffer rest = join_words(words);
-            printf("%s\n", rest);
-            arrfree(rest);
-        }
-
-        if (match_or_explain_keyword(
-            &words,
-            "multiple word test",
+        .handler = echo_command,
+        .flags = IMCLI_PARALLEL_SAFE,
+    });
+
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "multiple word test",
+        .help_message =
             "multiple word test: Dummy command to test keyword parsing.\n",
-            help,
-            &any_matched
-        )) {
-            printf(
-                "Multiple word test was run with %d arguments.\n",
-                (int)arrlen(words)
-            );
-        }
-
-        if (match_or_explain_keyword_simple(
-            &words,
-            "exit",
-            "exit: Stop taking input and close the program.\n",
-            help,
-            &any_matched
-        )) {
-            exit(0);
-        }
-
-        /* This will never return true, since the only line that will trigger
-           it is `help help`. We just want help to have a help message. */
-        match_or_explain_keyword_detailed(
-            &words,
-            "help",
-            "help: Lists commands and explains their usage.\n",
-
-            "Usage: help [command]\n"
-            "Print a detailed message about how to use the given command. If no command\n"
-            "is specified, then a summary of all available commands is given instead.\n",
-            help,
-            &any_matched
-        );
-
-        if (!any_matched && arrlen(words) > 0) {
-            printf("Unknown command '%s'. Type 'help' for a list of "
-                "commands.\n", words[0]);
-        }
+        .handler = multiple_word_test_command,
+        .flags = IMCLI_PARALLEL_SAFE,
+    });
+
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "greet",
+        .help_message = "greet: Asks for your name, and says hello.\n",
+        .handler = greet_command,
+        .flags = IMCLI_NO_ARGS,
+    });
+
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "exit",
+        .help_message = "exit: Stop taking input and close the program.\n",
+        .handler = exit_command,
+        .flags = IMCLI_NO_ARGS,
+    });
+
+    return registry;
+}
+
+int main(int cli_arg_count, char **cli_args) {
+    struct imcli_registry registry = make_registry();
+
+    struct imcli_aliases aliases = {0};
+    imcli_register_alias_commands(&registry, &aliases);
+    imcli_register_variable_commands(&registry);
+
+    /* `cli_demo --json ...` writes JSON records instead of text. */
+    bool json = cli_arg_count > 1 && strcmp(cli_args[1], "--json") == 0;
+    if (json) {
+        cli_arg_count -= 1;
+        cli_args += 1;
+    }
+
+    /* `cli_demo echo foo` runs just that one command, without a prompt, and
+       exits with 1 if it was unknown or given the wrong arguments, so that
+       scripts can tell. */
+    if (cli_arg_count > 1) {
+        struct imcli_session session = imcli_session_new(NULL, stdout);
+        session.json = json;
+
+        imcli_exec(&session, &registry, cli_arg_count - 1, &cli_args[1]);
+        int status = session.error_count > 0 ? 1 : 0;
+
+        imcli_aliases_free(&aliases);
+        imcli_registry_free(&registry);
+        imcli_session_free(&session);
+        return status;
+    }
+
+    struct imcli_session session = imcli_session_new(stdin, stdout);
+    session.json = json;
+#ifdef IMCLI_FD_SINKS
+    /* Each command's output, and the prompt after it, go out in one write. */
+    imcli_session_set_sink(&session, imcli_sink_fd(1));
+#endif
+#ifdef IMCLI_THREADS
+    /* Built with IMCLI_THREADS, `echo foo &` runs in the background, and
+       `jobs` and `wait` look at and collect what it printed. */
+    struct imcli_jobs jobs = {0};
+    imcli_register_job_commands(&registry, &jobs);
+    session.jobs = &jobs;
+#endif
+
+    while (true) {
+        string_buffer words = prompt(&session, ">");
+
+        bool keep_going = imcli_dispatch_line(&session, &registry, &words);
 
         sbfree(&words);
+
+        if (!keep_going) break;
     }
-}
 
+#ifdef IMCLI_THREADS
+    imcli_jobs_free(&jobs);
+#endif
+    imcli_aliases_free(&aliases);
+    imcli_registry_free(&registry);
+    imcli_session_free(&session);
+    return 0;
+}
@@ -4,9 +4,115 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+/* The parts of imcli that start threads of their own are only compiled when
+   IMCLI_THREADS is defined, since they need C11 threads and atomics. */
+#ifdef IMCLI_THREADS
+#include <threads.h>
+#include <stdatomic.h>
+
+/* Lets stb_ds hash the keys of big hmbuild/shbuild calls on several threads,
+   for programs that preload large tables before their first prompt. */
+#ifndef STBDS_THREADS
+#define STBDS_THREADS
+#endif
+
+/* On Linux, threads injecting commands can wake a prompt that is waiting on
+   its input. Elsewhere, or when compiling for strict ISO C with no POSIX
+   functions, injected commands are picked up at the next prompt instead. */
+#if defined(__linux__) && defined(_POSIX_C_SOURCE)
+#define IMCLI_WAKEUP_FD
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+#endif
+
+/* Serving sessions from forked worker processes needs POSIX, so it is only
+   compiled when IMCLI_PREFORK is defined. Strict ISO C modes hide functions
+   like fdopen unless a POSIX version is asked for. */
+#ifdef IMCLI_PREFORK
+#if defined(__STRICT_ANSI__) && !defined(_POSIX_C_SOURCE)
+#error "IMCLI_PREFORK needs _POSIX_C_SOURCE defined before any system header"
+#endif
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#endif
+
+/* Sharing a registry image between processes by name needs POSIX shared
+   memory, so it is only compiled when IMCLI_SHARED_MEMORY is defined. As with
+   IMCLI_PREFORK, strict ISO C modes need a POSIX version asked for, or
+   functions like ftruncate are hidden. */
+#ifdef IMCLI_SHARED_MEMORY
+#if defined(__STRICT_ANSI__) && !defined(_POSIX_C_SOURCE)
+#error "IMCLI_SHARED_MEMORY needs _POSIX_C_SOURCE defined before any system header"
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Published images get their magic written last, with these around it, so
+   that a process attaching part way through either sees no magic, or sees
+   the whole image. */
+#if defined(__GNUC__) || defined(__clang__)
+#define IMCLI_RELEASE_FENCE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define IMCLI_ACQUIRE_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#include <stdatomic.h>
+#define IMCLI_RELEASE_FENCE() atomic_thread_fence(memory_order_release)
+#define IMCLI_ACQUIRE_FENCE() atomic_thread_fence(memory_order_acquire)
+#endif
+#endif
+
+/* Serving many connections from one thread with epoll needs Linux, so it is
+   only compiled when IMCLI_SERVER is defined; see imcli_server_run. */
+#ifdef IMCLI_SERVER
+#if !defined(__linux__)
+#error "IMCLI_SERVER needs Linux"
+#elif defined(__STRICT_ANSI__) && !defined(_POSIX_C_SOURCE)
+#error "IMCLI_SERVER needs _POSIX_C_SOURCE defined before any system header"
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+/* Sessions can write straight to a file descriptor or socket on systems that
+   have them, rather than going through stdio; see imcli_sink_fd. */
+#if defined(__unix__) || defined(__APPLE__)
+#define IMCLI_FD_SINKS
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+#include <time.h>
+
+/* C++20 coroutines can wait for a session's next line with co_await; see
+   imcli_task. */
+#if defined(__cplusplus) && __cplusplus >= 202002L
+#include <coroutine>
+#include <exception>
+#endif
 
 #include "stb_ds.h"
 
+/* Everything is defined right here in the header, so it all gets internal
+   linkage; that way any number of files can include it. */
+#ifndef IMCLI_DEF
+#define IMCLI_DEF static inline
+#endif
+
 /* A growable buffer with text in it. */
 typedef char *char_buffer;
 
@@ -18,7 +124,617 @@ struct string_offset {
 
 typedef char_buffer *string_buffer;
 
-char_buffer join_strings(string_buffer words, char *delim) {
+/* Everything one prompt loop needs: where its input comes from, where its
+   output goes, and buffers that get reused from one line to the next. Nothing
+   here is shared between sessions, so separate threads can each run their own
+   session at the same time. */
+struct imcli_inject_queue;
+struct imcli_jobs;
+struct imcli_session;
+
+/* Picks up a command part way through, with the next line of words; see
+   imcli_await_words. words is NULL if the session ends first, in which case
+   this should just clean up its state. */
+typedef bool (*imcli_continuation)(
+    struct imcli_session *session,
+    string_buffer *words,
+    void *state
+);
+
+/* Appends a variable's current value to out; see imcli_bind_variable. */
+typedef void (*imcli_variable_fn)(
+    struct imcli_session *session,
+    char_buffer *out,
+    void *userdata
+);
+
+struct imcli_variable_value {
+    /* Used when there is no callback. */
+    char_buffer text;
+    imcli_variable_fn callback;
+    void *userdata;
+};
+
+struct imcli_variable {
+    stbds_string_view key;
+    struct imcli_variable_value value;
+};
+
+/* One piece of a word that uses variables: a run of the line itself, or a
+   variable's value, pointed at right where it is stored rather than copied.
+   What a callback variable works out goes in the session's variable_text,
+   which can move as it grows, so those pieces have a NULL text, and start
+   at an offset into that instead. */
+struct imcli_word_piece {
+    const char *text;
+    int start;
+    int count;
+};
+
+/* Somewhere other than a FILE for a session's output to go. Output is held
+   in the session until flush_size bytes are waiting, or flush_seconds have
+   passed since the last flush, if that isn't 0, and then handed to write all
+   at once. Sessions also flush before they wait for input, so each command's
+   output usually goes out in a single write. */
+struct imcli_sink {
+    /* Writes all of data, or returns false if it couldn't. */
+    bool (*write)(void *context, const char *data, size_t size);
+    void *context;
+    size_t flush_size;
+    int flush_seconds;
+};
+
+/* How much output a sink holds onto, unless told otherwise. */
+#ifndef IMCLI_SINK_FLUSH_SIZE
+#define IMCLI_SINK_FLUSH_SIZE 65536
+#endif
+
+struct imcli_session {
+    FILE *input;
+    /* Where output goes, unless the session has a sink. */
+    FILE *output;
+    struct imcli_sink sink;
+    /* Output waiting to be written to the sink. */
+    char_buffer sink_buffer;
+    time_t last_flush;
+
+    /* Commands submitted by other threads, if any; see imcli_inject. */
+    struct imcli_inject_queue *injected;
+    /* Where lines ending in `&` start background jobs, with IMCLI_THREADS;
+       see imcli_dispatch_line. Without any, `&` is just a word. */
+    struct imcli_jobs *jobs;
+
+    /* The most recent line returned by read_line or imcli_take_line. */
+    char_buffer line;
+
+    /* Bytes given to imcli_feed that haven't been taken as lines yet, starting
+       at pending_start. Everything before pending_scanned has already been
+       checked for a newline, so each byte only gets scanned once. */
+    char_buffer pending;
+    int pending_start;
+    int pending_scanned;
+
+    /* Set while a command is waiting for more input, instead of blocking on
+       a nested prompt. */
+    imcli_continuation continuation;
+    void *continuation_state;
+
+    /* A `<<TERM` block that a compiled script or a batch already has in
+       memory, for the line being run to read instead of the input; see
+       imcli_dispatch_payload. */
+    const char *script_payload;
+    size_t script_payload_size;
+
+    /* Values for `$name` in lines this session reads, or NULL if there are
+       none. Keyed by counted strings, so names can be looked up right where
+       they are in the line. */
+    struct imcli_variable *variables;
+    /* Reused while splitting words that use variables; see
+       imcli_split_words_with_variables. */
+    struct imcli_word_piece *word_pieces;
+    char_buffer variable_text;
+
+    /* Write JSON records, one per line, instead of text meant for people;
+       see imcli_record_begin. */
+    bool json;
+    /* The record being built, reused for every record. */
+    char_buffer record;
+    /* Where imcli_message builds its records, so that it can be called while
+       a handler is part way through one of its own. */
+    char_buffer message_record;
+    /* The text of the message imcli_message is building, reused for every
+       message. */
+    char_buffer message_text;
+
+    /* How many errors imcli_message has reported, like unknown commands or
+       unwanted arguments, so that a program running one command can turn
+       them into an exit status. */
+    int error_count;
+};
+
+IMCLI_DEF struct imcli_session imcli_session_new(FILE *input, FILE *output) {
+    struct imcli_session session = {0};
+    session.input = input;
+    session.output = output;
+    return session;
+}
+
+/* Writes everything the session is holding onto, or just flushes its output
+   file if it has no sink. */
+IMCLI_DEF void imcli_flush(struct imcli_session *session) {
+    if (!session->sink.write) {
+        if (session->output) fflush(session->output);
+        return;
+    }
+
+    if (arrlen(session->sink_buffer) > 0) {
+        /* If the sink has gone away, there is nothing to do with the output
+           but drop it. */
+        session->sink.write(
+            session->sink.context,
+            session->sink_buffer,
+            arrlen(session->sink_buffer)
+        );
+        arrsetlen(session->sink_buffer, 0);
+    }
+    session->last_flush = time(NULL);
+}
+
+/* Sends the session's output to sink from now on, rather than its output
+   file. Anything already written is flushed where it was going first. */
+IMCLI_DEF void imcli_session_set_sink(
+    struct imcli_session *session,
+    struct imcli_sink sink
+) {
+    imcli_flush(session);
+    if (sink.flush_size == 0) sink.flush_size = IMCLI_SINK_FLUSH_SIZE;
+    session->sink = sink;
+    session->last_flush = time(NULL);
+}
+
+/* Flushes the session's sink if it is holding enough output, or has held it
+   long enough. */
+IMCLI_DEF void imcli_flush_if_due(struct imcli_session *session) {
+    bool full = (size_t)arrlen(session->sink_buffer) >= session->sink.flush_size;
+    bool stale = session->sink.flush_seconds > 0
+        && time(NULL) - session->last_flush >= session->sink.flush_seconds;
+    if (full || stale) imcli_flush(session);
+}
+
+/* Adds to the session's output. This is what handlers should write with,
+   rather than writing to session->output, so that their output gets
+   buffered along with everything else when the session has a sink. */
+IMCLI_DEF void imcli_write(
+    struct imcli_session *session,
+    const char *data,
+    size_t size
+) {
+    if (!session->sink.write) {
+        if (session->output) fwrite(data, 1, size, session->output);
+        return;
+    }
+
+    if (size) memcpy(arraddnptr(session->sink_buffer, size), data, size);
+    imcli_flush_if_due(session);
+}
+
+IMCLI_DEF void imcli_vprintf(
+    struct imcli_session *session,
+    const char *format,
+    va_list args
+) {
+    if (!session->sink.write) {
+        if (session->output) vfprintf(session->output, format, args);
+        return;
+    }
+    /* else format it straight into the buffer */
+
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (len < 0) return;
+
+    /* Room for the terminator vsnprintf adds, which is then dropped. */
+    int start = arrlen(session->sink_buffer);
+    arraddnptr(session->sink_buffer, len + 1);
+    vsnprintf(&session->sink_buffer[start], len + 1, format, args);
+    arrsetlen(session->sink_buffer, start + len);
+
+    imcli_flush_if_due(session);
+}
+
+IMCLI_DEF void imcli_printf(struct imcli_session *session, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    imcli_vprintf(session, format, args);
+    va_end(args);
+}
+
+/* A sink that appends everything to a buffer, e.g. to build a response to
+   send somewhere else. Nothing is held back, since it is all in memory
+   anyway. */
+IMCLI_DEF bool imcli_memory_sink_write(
+    void *context,
+    const char *data,
+    size_t size
+) {
+    char_buffer *out = (char_buffer *)context;
+    memcpy(arraddnptr(*out, size), data, size);
+    return true;
+}
+
+IMCLI_DEF struct imcli_sink imcli_sink_memory(char_buffer *out) {
+    struct imcli_sink sink = {
+        .write = imcli_memory_sink_write,
+        .context = out,
+        .flush_size = 1,
+    };
+    return sink;
+}
+
+#ifdef IMCLI_FD_SINKS
+
+/* The descriptor is kept in the context pointer itself. */
+IMCLI_DEF int imcli_sink_context_fd(void *context) {
+    return (int)(intptr_t)context;
+}
+
+IMCLI_DEF bool imcli_fd_sink_write(void *context, const char *data, size_t size) {
+    int fd = imcli_sink_context_fd(context);
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/* Like send, except that a client hanging up is a failed write, rather than
+   a SIGPIPE. */
+IMCLI_DEF ssize_t imcli_socket_send(int fd, const char *data, size_t size) {
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    return send(fd, data, size, flags);
+}
+
+IMCLI_DEF bool imcli_socket_sink_write(
+    void *context,
+    const char *data,
+    size_t size
+) {
+    int fd = imcli_sink_context_fd(context);
+    while (size > 0) {
+        ssize_t sent = imcli_socket_send(fd, data, size);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+/* Writes to a file descriptor, e.g. 1 for standard output, without going
+   through stdio. The descriptor is left open when the session ends. */
+IMCLI_DEF struct imcli_sink imcli_sink_fd(int fd) {
+    struct imcli_sink sink = {
+        .write = imcli_fd_sink_write,
+        .context = (void *)(intptr_t)fd,
+    };
+    return sink;
+}
+
+/* Like imcli_sink_fd, but for a connected socket. */
+IMCLI_DEF struct imcli_sink imcli_sink_socket(int fd) {
+    struct imcli_sink sink = {
+        .write = imcli_socket_sink_write,
+        .context = (void *)(intptr_t)fd,
+    };
+    return sink;
+}
+
+#endif
+
+/* Frees the session's buffers, once anything it was holding onto has been
+   written. The files are left open, since the session doesn't know where
+   they came from. */
+IMCLI_DEF void imcli_session_free(struct imcli_session *session) {
+    if (session->continuation) {
+        imcli_continuation continuation = session->continuation;
+        session->continuation = NULL;
+        continuation(session, NULL, session->continuation_state);
+    }
+
+    imcli_flush(session);
+    arrfree(session->sink_buffer);
+
+    arrfree(session->line);
+    arrfree(session->pending);
+
+    for (int i = 0; i < shlen(session->variables); i++) {
+        arrfree(session->variables[i].value.text);
+    }
+    shfree(session->variables);
+    arrfree(session->word_pieces);
+    arrfree(session->variable_text);
+
+    arrfree(session->record);
+    arrfree(session->message_record);
+    arrfree(session->message_text);
+}
+
+/* What each byte turns into inside a JSON string: 0 for itself, or the
+   letter after the backslash, with 'u' meaning \u00XX. */
+static const char imcli_json_escapes[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, '\\', 0, 0, 0,
+};
+
+/* True if none of the 8 bytes in x need escaping, checking them all at once:
+   each test sets the top bit of any byte that is below 0x20, or equal to a
+   quote or a backslash. Bytes from 0x80 up are UTF-8, and pass through. */
+IMCLI_DEF bool imcli_json_plain8(uint64_t x) {
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+
+    uint64_t control = (x - ones * 0x20) & ~x & highs;
+    uint64_t quote = x ^ (ones * '"');
+    quote = (quote - ones) & ~quote & highs;
+    uint64_t backslash = x ^ (ones * '\\');
+    backslash = (backslash - ones) & ~backslash & highs;
+
+    return (control | quote | backslash) == 0;
+}
+
+/* Appends str as a quoted JSON string. Runs of bytes that don't need escaping
+   are found 8 at a time, and copied in one go. */
+IMCLI_DEF void imcli_json_string(char_buffer *out, const char *str, size_t len) {
+    arrpush(*out, '"');
+
+    size_t run_start = 0;
+    size_t i = 0;
+    while (i < len) {
+        if (i + 8 <= len) {
+            uint64_t eight;
+            memcpy(&eight, &str[i], 8);
+            if (imcli_json_plain8(eight)) {
+                i += 8;
+                continue;
+            }
+        }
+        /* else look at them one at a time */
+
+        char escape = imcli_json_escapes[(unsigned char)str[i]];
+        if (escape) {
+            if (i > run_start) {
+                memcpy(arraddnptr(*out, i - run_start), &str[run_start],
+                    i - run_start);
+            }
+
+            if (escape == 'u') {
+                char hex[7];
+                snprintf(hex, sizeof(hex), "\\u%04x", (unsigned char)str[i]);
+                memcpy(arraddnptr(*out, 6), hex, 6);
+            } else {
+                arrpush(*out, '\\');
+                arrpush(*out, escape);
+            }
+
+            run_start = i + 1;
+        }
+        i += 1;
+    }
+
+    if (len > run_start) {
+        memcpy(arraddnptr(*out, len - run_start), &str[run_start],
+            len - run_start);
+    }
+
+    arrpush(*out, '"');
+}
+
+/* Starts a JSON record. Fields get added with the imcli_record_* functions,
+   and imcli_record_end writes the whole record to the session's output as
+   one line, in one write. Records can be written whether or not session->json
+   is set; handlers that support both check it to decide. */
+IMCLI_DEF void imcli_record_begin(struct imcli_session *session) {
+    arrsetlen(session->record, 0);
+    arrpush(session->record, '{');
+}
+
+IMCLI_DEF void imcli_record_key(struct imcli_session *session, const char *key) {
+    if (arrlast(session->record) != '{') arrpush(session->record, ',');
+    imcli_json_string(&session->record, key, strlen(key));
+    arrpush(session->record, ':');
+}
+
+IMCLI_DEF void imcli_record_stringn(
+    struct imcli_session *session,
+    const char *key,
+    const char *value,
+    size_t len
+) {
+    imcli_record_key(session, key);
+    imcli_json_string(&session->record, value, len);
+}
+
+IMCLI_DEF void imcli_record_string(
+    struct imcli_session *session,
+    const char *key,
+    const char *value
+) {
+    imcli_record_stringn(session, key, value, strlen(value));
+}
+
+IMCLI_DEF void imcli_record_int(
+    struct imcli_session *session,
+    const char *key,
+    long long value
+) {
+    imcli_record_key(session, key);
+
+    char digits[24];
+    int len = snprintf(digits, sizeof(digits), "%lld", value);
+    memcpy(arraddnptr(session->record, len), digits, len);
+}
+
+IMCLI_DEF void imcli_record_bool(
+    struct imcli_session *session,
+    const char *key,
+    bool value
+) {
+    imcli_record_key(session, key);
+
+    const char *text = value ? "true" : "false";
+    memcpy(arraddnptr(session->record, strlen(text)), text, strlen(text));
+}
+
+/* Adds a list of words as an array of strings. */
+IMCLI_DEF void imcli_record_words(
+    struct imcli_session *session,
+    const char *key,
+    string_buffer words
+) {
+    imcli_record_key(session, key);
+
+    arrpush(session->record, '[');
+    for (int i = 0; i < arrlen(words); i++) {
+        if (i > 0) arrpush(session->record, ',');
+        imcli_json_string(&session->record, words[i], arrlen(words[i]));
+    }
+    arrpush(session->record, ']');
+}
+
+IMCLI_DEF void imcli_record_end(struct imcli_session *session) {
+    arrpush(session->record, '}');
+    arrpush(session->record, '\n');
+
+    imcli_write(session, session->record, arrlen(session->record));
+    arrsetlen(session->record, 0);
+}
+
+/* What a message is about, so that JSON records carry it as fields of its
+   own, rather than only inside the text. Anything left zeroed is left out. */
+struct imcli_message_fields {
+    /* A job's number. */
+    long long id;
+    /* The alias, variable, command or word the message is about. */
+    const char *name;
+    /* What an alias or variable stands for, or what a job is running. */
+    const char *value;
+    /* Where a job is up to: "started", "running" or "done". */
+    const char *state;
+};
+
+/* Fields for a message about one name, which is what most of them are. */
+IMCLI_DEF struct imcli_message_fields imcli_about(const char *name) {
+    struct imcli_message_fields fields = {0};
+    fields.name = name;
+    return fields;
+}
+
+IMCLI_DEF void imcli_vmessage(
+    struct imcli_session *session,
+    const char *type,
+    struct imcli_message_fields fields,
+    const char *format,
+    va_list args
+) {
+    if (strcmp(type, "error") == 0) session->error_count += 1;
+
+    if (!session->json) {
+        imcli_vprintf(session, format, args);
+        return;
+    }
+    /* else format it first */
+
+    /* Messages are short, so this almost always fits in the space the last
+       one left, and only gets formatted once. */
+    int capacity = (int)arrcap(session->message_text);
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(session->message_text, capacity, format, copy);
+    va_end(copy);
+    if (len < 0) return;
+
+    if (len >= capacity) {
+        arrsetcap(session->message_text, len + 1);
+        vsnprintf(session->message_text, len + 1, format, args);
+    }
+    arrsetlen(session->message_text, len);
+    char_buffer text = session->message_text;
+
+    while (len > 0 && text[len - 1] == '\n') len -= 1;
+
+    /* Leave any record a handler is building alone. */
+    char_buffer record = session->record;
+    session->record = session->message_record;
+
+    imcli_record_begin(session);
+    imcli_record_string(session, "type", type);
+    if (fields.id) imcli_record_int(session, "id", fields.id);
+    if (fields.name) imcli_record_string(session, "name", fields.name);
+    if (fields.value) imcli_record_string(session, "value", fields.value);
+    if (fields.state) imcli_record_string(session, "state", fields.state);
+    imcli_record_stringn(session, "message", text, len);
+    imcli_record_end(session);
+
+    session->message_record = session->record;
+    session->record = record;
+}
+
+/* Writes a message from imcli itself, like help or an error. As text it is
+   written as it is; in JSON mode it becomes a record with the given type,
+   and the message, without its trailing newline. Messages with the type
+   "error" are counted in session->error_count. */
+IMCLI_DEF void imcli_message(
+    struct imcli_session *session,
+    const char *type,
+    const char *format,
+    ...
+) {
+    struct imcli_message_fields fields = {0};
+
+    va_list args;
+    va_start(args, format);
+    imcli_vmessage(session, type, fields, format, args);
+    va_end(args);
+}
+
+/* Like imcli_message, with fields that JSON records carry separately. */
+IMCLI_DEF void imcli_message_about(
+    struct imcli_session *session,
+    const char *type,
+    struct imcli_message_fields fields,
+    const char *format,
+    ...
+) {
+    va_list args;
+    va_start(args, format);
+    imcli_vmessage(session, type, fields, format, args);
+    va_end(args);
+}
+
+IMCLI_DEF char_buffer join_strings(string_buffer words, const char *delim) {
     int delim_len = strlen(delim);
 
     char_buffer out = NULL;
@@ -42,11 +758,11 @@ char_buffer join_strings(string_buffer words, char *delim) {
     return out;
 }
 
-char_buffer join_words(string_buffer words) {
+IMCLI_DEF char_buffer join_words(string_buffer words) {
     return join_strings(words, " ");
 }
 
-void sbfree(string_buffer *it) {
+IMCLI_DEF void sbfree(string_buffer *it) {
     int string_count = arrlen(*it);
     for (int i = 0; i < string_count; i++) arrfree((*it)[i]);
 
@@ -54,14 +770,14 @@ void sbfree(string_buffer *it) {
     *it = NULL;
 }
 
-char_buffer read_line(void) {
-    char_buffer result = NULL;
-    int read_count = 0;
-    bool done = false;
+IMCLI_DEF char_buffer read_line(struct imcli_session *session) {
+    char_buffer result = session->line;
+    arrsetlen(result, 0);
 
-    /* Read from stdin, likely blocking until the user presses enter/return,
-       and return the result as a single buffer, with no trailing newline
-       character. */
+    /* Read from the session's input, likely blocking until the user presses
+       enter/return, and return the result as a single buffer, with no trailing
+       newline character. The buffer belongs to the session, and gets reused by
+       the next call, so copy anything that needs to last longer than that. */
     while (true) {
         int prev_len = arrlen(result);
 
@@ -69,10 +785,10 @@ char_buffer read_line(void) {
         char *segment = arraddnptr(result, segment_size);
 
         int added_count;
-        /* Get text from stdin, up to and including a single newline character;
-           this may return null if a file or pipe is being used as stdin, and
-           there are no characters left in the file. */
-        if (fgets(segment, segment_size, stdin)) {
+        /* Get text from the input, up to and including a single newline
+           character; this may return null if a file or pipe is being used as
+           input, and there are no characters left in the file. */
+        if (fgets(segment, segment_size, session->input)) {
             added_count = strlen(segment);
         } else {
             added_count = 0;
@@ -82,7 +798,7 @@ char_buffer read_line(void) {
 
         /* Test if we got a newline character, which is how we tell that we
            actually have the whole line. */
-        if (feof(stdin) || arrlast(result) == '\n') break;
+        if (feof(session->input) || arrlast(result) == '\n') break;
     }
 
     /* Make sure we remove the newline from the returned result, since we just
@@ -99,11 +815,137 @@ char_buffer read_line(void) {
        operation applied to result could invalidate it as a c-string. */
     arrpop(result);
 
+    session->line = result;
     return result;
 }
 
-void find_next_word(
-    char *data,
+/* Gives the session some input that arrived from somewhere it can't block on
+   itself, like a non-blocking socket in an event loop. The bytes don't need to
+   line up with lines; imcli_take_line puts them back together. Sessions used
+   this way can be created with a NULL input file. */
+IMCLI_DEF void imcli_feed(struct imcli_session *session, char *data, int count) {
+    /* Once most of the buffer is lines that were already taken, drop them, so
+       that a long-running connection doesn't keep growing it. */
+    if (session->pending_start > arrlen(session->pending) / 2) {
+        arrdeln(session->pending, 0, session->pending_start);
+        session->pending_scanned -= session->pending_start;
+        session->pending_start = 0;
+    }
+
+    char *spot = arraddnptr(session->pending, count);
+    memcpy(spot, data, count);
+}
+
+/* If a whole line has been fed to the session, moves it into session->line,
+   the same way read_line would have, and returns true. Otherwise it returns
+   false, and the partial line waits for more input. */
+IMCLI_DEF bool imcli_take_line(struct imcli_session *session) {
+    int pending_len = arrlen(session->pending);
+
+    int end = session->pending_scanned;
+    while (end < pending_len && session->pending[end] != '\n') end++;
+
+    session->pending_scanned = end;
+    if (end == pending_len) return false;
+    /* else we found a newline */
+
+    int start = session->pending_start;
+
+    arrsetlen(session->line, 0);
+    if (end > start) {
+        char *spot = arraddnptr(session->line, end - start);
+        memcpy(spot, &session->pending[start], end - start);
+    }
+    arrpush(session->line, '\0');
+    arrpop(session->line);
+
+    session->pending_start = end + 1;
+    session->pending_scanned = end + 1;
+
+    /* The common case is that everything fed so far has now been taken, in
+       which case we can start the buffer over for free. */
+    if (session->pending_start == pending_len) {
+        arrsetlen(session->pending, 0);
+        session->pending_start = 0;
+        session->pending_scanned = 0;
+    }
+
+    return true;
+}
+
+/* Reads the line after the current one, for something that reads past it,
+   like a payload: a whole line fed to the session, if there is one, and
+   otherwise a line from its input, with any fed bytes that didn't make a
+   whole line yet in front. Sets *at_end once there is nothing more to
+   read. */
+IMCLI_DEF char_buffer imcli_next_line(
+    struct imcli_session *session,
+    bool *at_end
+) {
+    if (imcli_take_line(session)) {
+        *at_end = false;
+        return session->line;
+    }
+
+    int start = session->pending_start;
+    int partial = arrlen(session->pending) - start;
+
+    if (!session->input) {
+        arrsetlen(session->line, 0);
+        *at_end = true;
+    } else {
+        read_line(session);
+        *at_end = feof(session->input) || ferror(session->input);
+    }
+
+    if (partial > 0) {
+        arrinsn(session->line, 0, partial);
+        memcpy(session->line, &session->pending[start], partial);
+    }
+    arrpush(session->line, '\0');
+    arrpop(session->line);
+
+    arrsetlen(session->pending, 0);
+    session->pending_start = 0;
+    session->pending_scanned = 0;
+
+    return session->line;
+}
+
+#ifndef IMCLI_STREAM_CHUNK
+#define IMCLI_STREAM_CHUNK 4096
+#endif
+
+/* Reads more of the session's input into its pending bytes, a line or a
+   chunk of one at a time, for something that takes them as it goes rather
+   than a line at a time, so a huge line is never held all at once. Returns
+   false once the input has run out. */
+IMCLI_DEF bool imcli_fill_pending(struct imcli_session *session) {
+    if (!session->input) return false;
+
+    char chunk[IMCLI_STREAM_CHUNK];
+    if (!fgets(chunk, sizeof(chunk), session->input)) return false;
+
+    imcli_feed(session, chunk, strlen(chunk));
+    return true;
+}
+
+/* Takes bytes from the front of the session's pending input, once they've
+   been used some other way than imcli_take_line. */
+IMCLI_DEF void imcli_skip_pending(struct imcli_session *session, int count) {
+    session->pending_start += count;
+    if (session->pending_scanned < session->pending_start) {
+        session->pending_scanned = session->pending_start;
+    }
+    if (session->pending_start == arrlen(session->pending)) {
+        arrsetlen(session->pending, 0);
+        session->pending_start = 0;
+        session->pending_scanned = 0;
+    }
+}
+
+IMCLI_DEF void find_next_word(
+    const char *data,
     int str_len,
     int search_from,
     int *start_out,
@@ -134,9 +976,8 @@ void find_next_word(
     if (length_out) *length_out = length;
 }
 
-string_buffer split_words(char_buffer line) {
-    int line_len = arrlen(line);
-
+/* Splits any run of text, not just a char_buffer. */
+IMCLI_DEF string_buffer split_words_n(const char *line, int line_len) {
     string_buffer result = NULL;
     char_buffer next = NULL;
 
@@ -168,50 +1009,522 @@ string_buffer split_words(char_buffer line) {
     return result;
 }
 
-string_buffer prompt_allow_empty(char *prompt_text) {
-    printf("%s", prompt_text);
+IMCLI_DEF string_buffer split_words(char_buffer line) {
+    return split_words_n(line, arrlen(line));
+}
 
-    char_buffer line = read_line();
+IMCLI_DEF void imcli_put_variable(
+    struct imcli_session *session,
+    char *name,
+    struct imcli_variable_value value
+) {
+    if (!session->variables) sh_new_strdup(session->variables);
 
-    string_buffer result = split_words(line);
-    arrfree(line);
+    struct imcli_variable *existing = shngetp_null(
+        session->variables,
+        name,
+        strlen(name)
+    );
+    if (existing) arrfree(existing->value.text);
 
-    return result;
+    shnput(session->variables, name, strlen(name), value);
 }
 
-string_buffer prompt(char *prompt_text) {
-    while (true) {
-        string_buffer words = prompt_allow_empty(prompt_text);
-
-        if (arrlen(words) != 0) return words;
-        /* else */
+/* Makes `$name` stand for the given text in lines the session reads. */
+IMCLI_DEF void imcli_set_variable(
+    struct imcli_session *session,
+    char *name,
+    char *text
+) {
+    struct imcli_variable_value value = {0};
+    int len = strlen(text);
+    if (len) memcpy(arraddnptr(value.text, len), text, len);
+    arrpush(value.text, '\0');
+    arrpop(value.text);
 
-        /* Probably does nothing. */
-        arrfree(words);
-    }
+    imcli_put_variable(session, name, value);
 }
 
-bool compare_charbuff_str_slice(char_buffer buff, char *str, int len) {
-    return len == arrlen(buff) && strncmp(buff, str, len) == 0;
+/* Makes `$name` stand for whatever the callback appends, worked out again
+   each time, but only in lines that actually use it. */
+IMCLI_DEF void imcli_bind_variable(
+    struct imcli_session *session,
+    char *name,
+    imcli_variable_fn callback,
+    void *userdata
+) {
+    struct imcli_variable_value value = {0};
+    value.callback = callback;
+    value.userdata = userdata;
+
+    imcli_put_variable(session, name, value);
 }
 
-bool match_keyword(
-    string_buffer *words,
-    char *keywords,
-    bool *any_matched_out
-) {
-    /* Check if something has already matched. */
-    bool any_matched = any_matched_out ? *any_matched_out : false;
+/* Returns false if there was no such variable. */
+IMCLI_DEF bool imcli_unset_variable(struct imcli_session *session, char *name) {
+    if (!session->variables) return false;
 
-    if (any_matched) return false;
+    struct imcli_variable *existing = shngetp_null(
+        session->variables,
+        name,
+        strlen(name)
+    );
+    if (!existing) return false;
 
-    /* Check that all the keywords do match. */
-    int keyword_count = 0;
+    arrfree(existing->value.text);
+    shndel(session->variables, name, strlen(name));
 
-    int str_len = strlen(keywords);
+    return true;
+}
 
-    int word_start = 0;
-    int word_len = 0;
+IMCLI_DEF void imcli_append_variable(
+    struct imcli_session *session,
+    char_buffer *out,
+    char *name,
+    int name_len
+) {
+    struct imcli_variable *variable = shngetp_null(
+        session->variables,
+        name,
+        name_len
+    );
+    /* Unknown variables are just empty. */
+    if (!variable) return;
+
+    if (variable->value.callback) {
+        variable->value.callback(session, out, variable->value.userdata);
+    } else {
+        int len = arrlen(variable->value.text);
+        if (len) memcpy(arraddnptr(*out, len), variable->value.text, len);
+    }
+}
+
+IMCLI_DEF bool imcli_is_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9') || c == '_';
+}
+
+IMCLI_DEF void imcli_add_word_piece(
+    struct imcli_session *session,
+    const char *text,
+    int start,
+    int count
+) {
+    if (count == 0) return;
+
+    struct imcli_word_piece piece;
+    piece.text = text;
+    piece.start = start;
+    piece.count = count;
+    arrpush(session->word_pieces, piece);
+}
+
+/* Adds the pieces of a word with `$name` in it to session->word_pieces: the
+   text around each variable, and each variable's value. Callback variables
+   are only run here, for words that actually use them. */
+IMCLI_DEF void imcli_variable_pieces(
+    struct imcli_session *session,
+    const char *word,
+    int len
+) {
+    int literal_start = 0;
+    int i = 0;
+    while (i < len) {
+        if (word[i] != '$' || i + 1 >= len || !imcli_is_name_char(word[i + 1])) {
+            i += 1;
+            continue;
+        }
+        /* else it's a variable */
+
+        imcli_add_word_piece(session, word, literal_start, i - literal_start);
+
+        int name_start = i + 1;
+        int name_end = name_start;
+        while (name_end < len && imcli_is_name_char(word[name_end])) {
+            name_end++;
+        }
+
+        struct imcli_variable *variable = shngetp_null(
+            session->variables,
+            &word[name_start],
+            name_end - name_start
+        );
+        /* Unknown variables are just empty. */
+        if (variable && variable->value.callback) {
+            int start = arrlen(session->variable_text);
+            variable->value.callback(
+                session,
+                &session->variable_text,
+                variable->value.userdata
+            );
+            imcli_add_word_piece(
+                session,
+                NULL,
+                start,
+                arrlen(session->variable_text) - start
+            );
+        } else if (variable) {
+            imcli_add_word_piece(
+                session,
+                variable->value.text,
+                0,
+                arrlen(variable->value.text)
+            );
+        }
+
+        i = name_end;
+        literal_start = i;
+    }
+
+    imcli_add_word_piece(session, word, literal_start, len - literal_start);
+}
+
+/* Builds a word out of session->word_pieces, copying each piece once, into
+   a buffer made the right size up front, and clears the pieces. Returns NULL
+   if they add up to nothing. */
+IMCLI_DEF char_buffer imcli_join_word_pieces(struct imcli_session *session) {
+    int piece_count = arrlen(session->word_pieces);
+
+    int len = 0;
+    for (int i = 0; i < piece_count; i++) len += session->word_pieces[i].count;
+
+    char_buffer word = NULL;
+    if (len > 0) {
+        arrsetcap(word, len + 1);
+        for (int i = 0; i < piece_count; i++) {
+            struct imcli_word_piece piece = session->word_pieces[i];
+            const char *text = piece.text ? piece.text : session->variable_text;
+            memcpy(arraddnptr(word, piece.count), &text[piece.start],
+                piece.count);
+        }
+        arrpush(word, '\0');
+        arrpop(word);
+    }
+
+    arrsetlen(session->word_pieces, 0);
+    return word;
+}
+
+/* Replaces `$name` in a word that was already split, like one read by
+   imcli_stream_next. Returns false, having emptied the word, if it was only
+   empty variables, and so isn't a word at all. */
+IMCLI_DEF bool imcli_substitute_word(
+    struct imcli_session *session,
+    char_buffer *word
+) {
+    if (!session->variables || !memchr(*word, '$', arrlen(*word))) return true;
+
+    imcli_variable_pieces(session, *word, arrlen(*word));
+    char_buffer substituted = imcli_join_word_pieces(session);
+    arrsetlen(session->variable_text, 0);
+
+    if (!substituted) {
+        arrsetlen(*word, 0);
+        return false;
+    }
+
+    arrfree(*word);
+    *word = substituted;
+    return true;
+}
+
+/* Like split_words_n, but replaces `$name` with the value of the session's
+   variable called name. Values are never split into more words themselves.
+   Each word is checked for a `$` on its own, and one without is copied
+   straight from the line; a word with one is put together from pieces of
+   the line and views of the values, where they are stored, and only copied
+   once, into the finished word, since handlers get words they can keep. */
+IMCLI_DEF string_buffer imcli_split_words_with_variables(
+    struct imcli_session *session,
+    const char *line,
+    int line_len
+) {
+    if (!session->variables) return split_words_n(line, line_len);
+
+    string_buffer result = NULL;
+
+    int start = 0;
+    int len = 0;
+    while (start + len < line_len) {
+        find_next_word(line, line_len, start + len, &start, &len);
+        if (len == 0) break;
+
+        const char *text = &line[start];
+        if (!memchr(text, '$', len)) {
+            char_buffer word = NULL;
+            arrsetcap(word, len + 1);
+            memcpy(arraddnptr(word, len), text, len);
+            arrpush(word, '\0');
+            arrpop(word);
+            arrpush(result, word);
+            continue;
+        }
+        /* else put it together */
+
+        imcli_variable_pieces(session, text, len);
+        char_buffer word = imcli_join_word_pieces(session);
+        if (word) arrpush(result, word);
+    }
+
+    arrsetlen(session->variable_text, 0);
+    return result;
+}
+
+IMCLI_DEF string_buffer imcli_split_line(
+    struct imcli_session *session,
+    char_buffer line
+) {
+    return imcli_split_words_with_variables(session, line, arrlen(line));
+}
+
+#ifdef IMCLI_THREADS
+
+/* One command line waiting in an imcli_inject_queue. */
+struct imcli_injected_line {
+    _Atomic(struct imcli_injected_line *) next;
+    string_buffer words;
+};
+
+/* Lets other threads, like timers or RPC handlers, submit commands to a
+   session, so that they go through the same dispatch as typed input. Any
+   number of threads can call imcli_inject at once, without locks; only the
+   thread running the session takes the commands back out.
+
+   This is an intrusive linked list: producers swap themselves in at head, and
+   the consumer walks from tail, with a stub node so the list is never truly
+   empty. */
+struct imcli_inject_queue {
+    _Atomic(struct imcli_injected_line *) head;
+    struct imcli_injected_line *tail;
+    struct imcli_injected_line stub;
+
+    /* An eventfd that gets written whenever a command is injected, or -1. */
+    int wakeup_fd;
+};
+
+/* Sets up the queue and attaches it to the session. From then on, prompts on
+   that session read straight from the input's file descriptor where they can,
+   so that they can wake up for injected commands, which means nothing should
+   be read through the input FILE before this. */
+IMCLI_DEF void imcli_inject_queue_init(
+    struct imcli_inject_queue *queue,
+    struct imcli_session *session
+) {
+    atomic_init(&queue->stub.next, NULL);
+    queue->stub.words = NULL;
+    atomic_init(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+
+    queue->wakeup_fd = -1;
+#ifdef IMCLI_WAKEUP_FD
+    if (session->input) queue->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+#endif
+
+    session->injected = queue;
+}
+
+IMCLI_DEF void imcli_inject_push(
+    struct imcli_inject_queue *queue,
+    struct imcli_injected_line *node
+) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    struct imcli_injected_line *prev = atomic_exchange_explicit(
+        &queue->head,
+        node,
+        memory_order_acq_rel
+    );
+    /* Between the exchange and this store, the consumer can see that the
+       queue is not empty, but can't reach the new node yet; it just tries
+       again after the wakeup below. */
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/* Submits a command from any thread. The queue takes ownership of the words,
+   which should already be split, the same way prompt would have split them.
+   Returns false if there wasn't the memory to queue them, in which case the
+   words are left with the caller. */
+IMCLI_DEF bool imcli_inject(
+    struct imcli_inject_queue *queue,
+    string_buffer words
+) {
+    struct imcli_injected_line *node = malloc(sizeof(*node));
+    if (!node) return false;
+    node->words = words;
+    imcli_inject_push(queue, node);
+
+#ifdef IMCLI_WAKEUP_FD
+    if (queue->wakeup_fd >= 0) {
+        unsigned long long one = 1;
+        ssize_t written = write(queue->wakeup_fd, &one, sizeof(one));
+        (void)written;
+    }
+#endif
+    return true;
+}
+
+/* Takes the oldest injected command, if there is one. Only the thread running
+   the session should call this. */
+IMCLI_DEF bool imcli_take_injected(
+    struct imcli_inject_queue *queue,
+    string_buffer *words_out
+) {
+    struct imcli_injected_line *tail = queue->tail;
+    struct imcli_injected_line *next = atomic_load_explicit(
+        &tail->next,
+        memory_order_acquire
+    );
+
+    if (tail == &queue->stub) {
+        if (!next) return false;
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (!next) {
+        /* tail is the last node, but we can't take it while head still points
+           at it, so put the stub back behind it first. */
+        if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) {
+            /* A producer is halfway through pushing. */
+            return false;
+        }
+        imcli_inject_push(queue, &queue->stub);
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+        if (!next) return false;
+    }
+
+    queue->tail = next;
+    *words_out = tail->words;
+    free(tail);
+
+    return true;
+}
+
+/* Detaches the queue and frees any commands that were never taken. No other
+   thread should be injecting by now. */
+IMCLI_DEF void imcli_inject_queue_free(
+    struct imcli_inject_queue *queue,
+    struct imcli_session *session
+) {
+    string_buffer words;
+    while (imcli_take_injected(queue, &words)) sbfree(&words);
+
+#ifdef IMCLI_WAKEUP_FD
+    if (queue->wakeup_fd >= 0) close(queue->wakeup_fd);
+#endif
+    queue->wakeup_fd = -1;
+
+    if (session->injected == queue) session->injected = NULL;
+}
+
+/* Waits for a whole line of input or an injected command, whichever comes
+   first. Input is read from the descriptor into the session's pending bytes,
+   rather than through the FILE, since bytes sitting in the FILE's own buffer
+   wouldn't wake up poll. */
+IMCLI_DEF string_buffer imcli_wait_line_or_injected(
+    struct imcli_session *session
+) {
+    struct imcli_inject_queue *queue = session->injected;
+    string_buffer words;
+
+#ifdef IMCLI_WAKEUP_FD
+    if (queue->wakeup_fd >= 0) {
+        int input_fd = fileno(session->input);
+
+        while (true) {
+            if (imcli_take_injected(queue, &words)) return words;
+            if (imcli_take_line(session)) {
+                return imcli_split_line(session, session->line);
+            }
+
+            struct pollfd fds[2] = {
+                {.fd = queue->wakeup_fd, .events = POLLIN},
+                {.fd = input_fd, .events = POLLIN},
+            };
+            if (poll(fds, 2, -1) < 0) continue;
+
+            if (fds[0].revents & POLLIN) {
+                unsigned long long count;
+                ssize_t got = read(queue->wakeup_fd, &count, sizeof(count));
+                (void)got;
+            }
+
+            if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                char chunk[4096];
+                ssize_t got = read(input_fd, chunk, sizeof(chunk));
+                if (got > 0) {
+                    imcli_feed(session, chunk, (int)got);
+                } else {
+                    /* End of input; whatever is left is the last line. */
+                    imcli_feed(session, "\n", 1);
+                    imcli_take_line(session);
+                    return imcli_split_line(session, session->line);
+                }
+            }
+        }
+    }
+#endif
+
+    /* Without a way to wake up, injected commands wait for the current read to
+       finish. */
+    if (imcli_take_injected(queue, &words)) return words;
+    return imcli_split_line(session, read_line(session));
+}
+
+#endif
+
+IMCLI_DEF string_buffer prompt_allow_empty(
+    struct imcli_session *session,
+    const char *prompt_text
+) {
+    /* Prompts are for people, and would only get in the way of records. */
+    if (!session->json) imcli_write(session, prompt_text, strlen(prompt_text));
+    /* The input and output can be any pair of files, so nothing else
+       guarantees the prompt, or what the last command wrote, is visible
+       before we block on the input. */
+    imcli_flush(session);
+
+#ifdef IMCLI_THREADS
+    if (session->injected) return imcli_wait_line_or_injected(session);
+#endif
+
+    char_buffer line = read_line(session);
+
+    return imcli_split_line(session, line);
+}
+
+IMCLI_DEF string_buffer prompt(
+    struct imcli_session *session,
+    const char *prompt_text
+) {
+    while (true) {
+        string_buffer words = prompt_allow_empty(session, prompt_text);
+
+        if (arrlen(words) != 0) return words;
+        /* else */
+
+        /* Probably does nothing. */
+        arrfree(words);
+    }
+}
+
+IMCLI_DEF bool compare_charbuff_str_slice(
+    char_buffer buff,
+    const char *str,
+    int len
+) {
+    return len == arrlen(buff) && strncmp(buff, str, len) == 0;
+}
+
+/* Returns how many of the words the given keywords match, or -1 if they don't
+   all match. The words are left as they are. */
+IMCLI_DEF int count_keyword_matches(string_buffer words, const char *keywords) {
+    int keyword_count = 0;
+
+    int str_len = strlen(keywords);
+
+    int word_start = 0;
+    int word_len = 0;
 
     while (word_start + word_len < str_len) {
         find_next_word(
@@ -224,19 +1537,37 @@ bool match_keyword(
 
         if (word_len == 0) break;
 
-        if (arrlen(*words) <= keyword_count) return false;
+        if (arrlen(words) <= keyword_count) return -1;
 
         bool matched = compare_charbuff_str_slice(
-            (*words)[keyword_count],
+            words[keyword_count],
             &keywords[word_start],
             word_len
         );
 
-        if (!matched) return false;
+        if (!matched) return -1;
 
         keyword_count += 1;
     }
 
+    return keyword_count;
+}
+
+IMCLI_DEF bool match_keyword(
+    string_buffer *words,
+    const char *keywords,
+    bool *any_matched_out
+) {
+    /* Check if something has already matched. */
+    bool any_matched = any_matched_out ? *any_matched_out : false;
+
+    if (any_matched) return false;
+
+    /* Check that all the keywords do match. */
+    int keyword_count = count_keyword_matches(*words, keywords);
+
+    if (keyword_count < 0) return false;
+
     /* Match successful. */
 
     for (int i = 0; i < keyword_count; i++) arrfree((*words)[i]);
@@ -247,11 +1578,12 @@ bool match_keyword(
     return true;
 }
 
-bool match_or_explain_keyword_detailed(
+IMCLI_DEF bool match_or_explain_keyword_detailed(
+    struct imcli_session *session,
     string_buffer *words,
-    char *keyword,
-    char *help_message,
-    char *detailed_help_message,
+    const char *keyword,
+    const char *help_message,
+    const char *detailed_help_message,
     bool help,
     bool *any_matched_out
 ) {
@@ -259,14 +1591,14 @@ bool match_or_explain_keyword_detailed(
     /* print all basic help messages when a command like `help` was written by
        itself. */
     if (help && arrlen(*words) == 0 && !any_matched) {
-        printf("%s", help_message);
+        imcli_message(session, "help", "%s", help_message);
         return false;
     }
     /* otherwise, we have to actually check if this command is the one that was
        written, and either display detailed help, or run the command. */
     if (match_keyword(words, keyword, any_matched_out)) {
         if (help) {
-            printf("%s", detailed_help_message);
+            imcli_message(session, "help", "%s", detailed_help_message);
             return false;
         } else {
             return true;
@@ -276,14 +1608,16 @@ bool match_or_explain_keyword_detailed(
     return false;
 }
 
-bool match_or_explain_keyword(
+IMCLI_DEF bool match_or_explain_keyword(
+    struct imcli_session *session,
     string_buffer *words,
-    char *keyword,
-    char *help_message,
+    const char *keyword,
+    const char *help_message,
     bool help,
     bool *any_matched_out
 ) {
     return match_or_explain_keyword_detailed(
+        session,
         words,
         keyword,
         help_message,
@@ -293,14 +1627,16 @@ bool match_or_explain_keyword(
     );
 }
 
-bool match_or_explain_keyword_simple(
+IMCLI_DEF bool match_or_explain_keyword_simple(
+    struct imcli_session *session,
     string_buffer *words,
-    char *keyword,
-    char *help_message,
+    const char *keyword,
+    const char *help_message,
     bool help,
     bool *any_matched_out
 ) {
     if (!match_or_explain_keyword(
+        session,
         words,
         keyword,
         help_message,
@@ -311,11 +1647,4213 @@ bool match_or_explain_keyword_simple(
     }
     /* else it did match. */
     if (arrlen(*words) > 0) {
-        printf("'%s' does not take any arguments.\n", keyword);
+        imcli_message_about(
+            session,
+            "error",
+            imcli_about(keyword),
+            "'%s' does not take any arguments.\n",
+            keyword
+        );
         return false;
     }
     /* else there are no arguments */
     return true;
 }
 
+/* Command handlers get whatever words came after their keywords. Returning
+   false ends the session, the way `exit` does in cli_demo.c. */
+typedef bool (*imcli_handler)(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+);
+
+/* The command takes no arguments, and complains if it's given any, like
+   match_or_explain_keyword_simple. */
+#define IMCLI_NO_ARGS 0x1
+/* The command only uses its arguments and its session's output, so a batch
+   can run it at the same time as other commands with this flag. It has to
+   write with imcli_write and imcli_printf, since its session has no output
+   file while it runs alongside the others. */
+#define IMCLI_PARALLEL_SAFE 0x2
+/* The command always runs as a background job, as if it had been given a
+   trailing `&`; see imcli_dispatch_line. */
+#define IMCLI_BACKGROUND 0x4
+/* The command never runs as a background job, and a trailing `&` is refused,
+   e.g. because it looks at the list of jobs itself. */
+#define IMCLI_FOREGROUND 0x8
+
+/* Hands a command its arguments one word at a time, as they are read, so that
+   a line with a huge number of arguments never has to be held in memory all
+   at once. Words come either straight from the session's input, or from a
+   line that was already split, when the command is run some other way.
+
+   Words read from the input end at a `;` or `|`, the same as the command's
+   words would in a whole line, leaving the rest of the line for whatever
+   runs the command. */
+struct imcli_word_stream {
+    struct imcli_session *session;
+    /* Words to hand out, when not reading from the input. */
+    string_buffer words;
+    int next_word;
+    bool from_input;
+
+    /* The word most recently handed out; reused for the next one. */
+    char_buffer word;
+    bool line_done;
+    bool input_done;
+    /* The `;` or `|` that ended the words, if one did. */
+    char separator;
+
+    /* When set, output written once a `|` has ended the words is held in
+       piped, for the command after it, and the session's sink is kept in
+       sink, until imcli_stream_unpipe puts it back. */
+    bool pipe_output;
+    bool piping;
+    char_buffer piped;
+    struct imcli_sink sink;
+    char_buffer held;
+    time_t last_flush;
+};
+
+IMCLI_DEF bool imcli_is_space(int c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\0';
+}
+
+/* What stops imcli_stream_scan: the end of a run of spaces, the end of a
+   word, or only the end of the stream's words. */
+enum imcli_stream_scan_for {
+    IMCLI_SCAN_SPACES,
+    IMCLI_SCAN_WORD,
+    IMCLI_SCAN_REST
+};
+
+/* Takes the session's input up to the first byte that stops the scan, a
+   chunk at a time, appending it to the stream's word when scanning a word,
+   and returns that byte without taking it, or EOF. The end of the line, `;`
+   and `|` stop every scan. */
+IMCLI_DEF int imcli_stream_scan(
+    struct imcli_word_stream *stream,
+    enum imcli_stream_scan_for scan
+) {
+    struct imcli_session *session = stream->session;
+
+    while (true) {
+        int start = session->pending_start;
+        int len = arrlen(session->pending);
+        const char *pending = session->pending;
+
+        int end = start;
+        for (; end < len; end++) {
+            char c = pending[end];
+            if (c == '\n' || c == ';' || c == '|') break;
+            if (scan == IMCLI_SCAN_SPACES && !imcli_is_space(c)) break;
+            if (scan == IMCLI_SCAN_WORD && imcli_is_space(c)) break;
+        }
+
+        if (scan == IMCLI_SCAN_WORD && end > start) {
+            memcpy(arraddnptr(stream->word, end - start), &pending[start],
+                end - start);
+        }
+
+        if (end < len) {
+            unsigned char stop = pending[end];
+            imcli_skip_pending(session, end - start);
+            return stop;
+        }
+        /* else the scan goes on into more input */
+
+        imcli_skip_pending(session, end - start);
+        if (!imcli_fill_pending(session)) return EOF;
+    }
+}
+
+/* Takes the byte that stopped a scan, and works out whether it ended the
+   stream's words. */
+IMCLI_DEF void imcli_stream_stop(struct imcli_word_stream *stream, int c) {
+    struct imcli_session *session = stream->session;
+
+    if (c == EOF) {
+        stream->line_done = true;
+        stream->input_done = true;
+        return;
+    }
+    imcli_skip_pending(session, 1);
+
+    if (c == '\n') stream->line_done = true;
+    if (c == ';' || c == '|') {
+        stream->line_done = true;
+        stream->separator = (char)c;
+    }
+
+    if (c == '|' && stream->pipe_output) {
+        /* The same as a pipe in imcli_dispatch_line: anything the sink is
+           holding stays where it is, ahead of the next command's output. */
+        stream->piping = true;
+        stream->sink = session->sink;
+        stream->held = session->sink_buffer;
+        stream->last_flush = session->last_flush;
+        session->sink = imcli_sink_memory(&stream->piped);
+        session->sink_buffer = NULL;
+    }
+}
+
+/* Puts back the session's sink, if a `|` took it, leaving the output meant
+   for the next command in stream->piped. */
+IMCLI_DEF void imcli_stream_unpipe(struct imcli_word_stream *stream) {
+    if (!stream->piping) return;
+
+    struct imcli_session *session = stream->session;
+    imcli_flush(session);
+    arrfree(session->sink_buffer);
+    session->sink = stream->sink;
+    session->sink_buffer = stream->held;
+    session->last_flush = stream->last_flush;
+    stream->piping = false;
+}
+
+/* Returns the next word of the line, or NULL once the line is over. The word
+   is only valid until the next call, so copy anything that needs to last.
+   Words already read into stream->words are handed out before any more of
+   the input is read. Words read from the input have their `$name` variables
+   replaced, the same as in a line split with imcli_split_line. */
+IMCLI_DEF char_buffer imcli_stream_next(struct imcli_word_stream *stream) {
+    if (stream->next_word < arrlen(stream->words)) {
+        return stream->words[stream->next_word++];
+    }
+
+    /* A word that was only empty variables isn't a word, so keep going. */
+    while (true) {
+        if (stream->line_done || !stream->from_input) {
+            stream->line_done = true;
+            return NULL;
+        }
+        /* else read it */
+
+        int c = imcli_stream_scan(stream, IMCLI_SCAN_SPACES);
+        if (c == EOF || c == '\n' || c == ';' || c == '|') {
+            imcli_stream_stop(stream, c);
+            return NULL;
+        }
+
+        arrsetlen(stream->word, 0);
+        c = imcli_stream_scan(stream, IMCLI_SCAN_WORD);
+        /* If this ended the line, the next call returns NULL. */
+        imcli_stream_stop(stream, c);
+
+        arrpush(stream->word, '\0');
+        arrpop(stream->word);
+
+        if (imcli_substitute_word(stream->session, &stream->word)) {
+            return stream->word;
+        }
+    }
+}
+
+/* Drops whatever is left of the stream's words, without replacing their
+   variables, up to the end of the line or a `;` or `|`. */
+IMCLI_DEF void imcli_stream_skip(struct imcli_word_stream *stream) {
+    stream->next_word = arrlen(stream->words);
+    if (stream->line_done || !stream->from_input) {
+        stream->line_done = true;
+        return;
+    }
+
+    imcli_stream_stop(stream, imcli_stream_scan(stream, IMCLI_SCAN_REST));
+}
+
+/* Gets a streaming command's arguments from somewhere. Returning false ends
+   the session, like a normal handler. Words the handler doesn't take are
+   skipped once it returns. */
+typedef bool (*imcli_stream_handler)(
+    struct imcli_session *session,
+    struct imcli_word_stream *stream,
+    void *userdata
+);
+
+#ifndef IMCLI_PAYLOAD_CHUNK
+#define IMCLI_PAYLOAD_CHUNK 65536
+#endif
+
+/* A block of raw lines that follows a command, like a shell heredoc:
+
+       load config <<END
+       ...
+       END
+
+   The lines are read straight from the session's input, after any that were
+   fed to it, up to the line that is exactly the terminator, and handed over
+   in big chunks without being split into words, so bulk data doesn't pay for
+   being treated as commands. */
+struct imcli_payload {
+    struct imcli_session *session;
+    /* NULL when there is no payload to read. */
+    char *terminator;
+    /* The rest of the payload, when it was already in memory, e.g. kept by
+       a compiled script, rather than still to be read. */
+    const char *body;
+    size_t body_size;
+    char_buffer chunk;
+    bool done;
+};
+
+/* Returns the next chunk of the payload, of around IMCLI_PAYLOAD_CHUNK bytes,
+   always ending at the end of a line, and with each line's newline kept. Sets
+   *size_out and returns NULL once the payload is over. The chunk is reused
+   by the next call. */
+IMCLI_DEF char *imcli_payload_next(
+    struct imcli_payload *payload,
+    size_t *size_out
+) {
+    arrsetlen(payload->chunk, 0);
+
+    while (payload->body && !payload->done
+        && arrlen(payload->chunk) < IMCLI_PAYLOAD_CHUNK) {
+        const char *end = (const char *)memchr(
+            payload->body,
+            '\n',
+            payload->body_size
+        );
+        size_t len = end ? (size_t)(end - payload->body) + 1
+            : payload->body_size;
+
+        memcpy(arraddnptr(payload->chunk, len), payload->body, len);
+        payload->body += len;
+        payload->body_size -= len;
+        if (payload->body_size == 0) payload->done = true;
+    }
+
+    while (!payload->done && arrlen(payload->chunk) < IMCLI_PAYLOAD_CHUNK) {
+        bool at_end;
+        char_buffer line = imcli_next_line(payload->session, &at_end);
+
+        if (strcmp(line, payload->terminator) == 0) {
+            payload->done = true;
+            break;
+        }
+
+        int len = arrlen(line);
+        if (len > 0) memcpy(arraddnptr(payload->chunk, len), line, len);
+        if (!at_end) arrpush(payload->chunk, '\n');
+
+        /* A missing terminator just ends the payload with the input. */
+        if (at_end) payload->done = true;
+    }
+
+    *size_out = arrlen(payload->chunk);
+    if (*size_out == 0) return NULL;
+    return payload->chunk;
+}
+
+/* Reads the rest of the payload into one buffer, for handlers that would
+   rather have it all at once. The buffer belongs to the payload, like the
+   chunks do. */
+IMCLI_DEF char *imcli_payload_all(
+    struct imcli_payload *payload,
+    size_t *size_out
+) {
+    char_buffer all = NULL;
+
+    size_t size;
+    char *chunk;
+    while ((chunk = imcli_payload_next(payload, &size))) {
+        memcpy(arraddnptr(all, size), chunk, size);
+    }
+
+    arrfree(payload->chunk);
+    payload->chunk = all;
+
+    *size_out = arrlen(all);
+    return all;
+}
+
+/* Gets a command's arguments, and the payload that came after it, which is
+   empty if the line didn't end with a `<<TERMINATOR` word. */
+typedef bool (*imcli_payload_handler)(
+    struct imcli_session *session,
+    string_buffer *args,
+    struct imcli_payload *payload,
+    void *userdata
+);
+
+/* Runs a whole group of consecutive uses of the same command at once, e.g.
+   to take a lock once, or write everything in one go. arg_sets[i] holds what
+   the i'th use's handler would have been given. */
+typedef bool (*imcli_batch_handler)(
+    struct imcli_session *session,
+    string_buffer *arg_sets,
+    int count,
+    void *userdata
+);
+
+struct imcli_command {
+    const char *keywords;
+    const char *help_message;
+    /* NULL to show help_message for `help <command>` as well. */
+    const char *detailed_help_message;
+    imcli_handler handler;
+    void *userdata;
+    int flags;
+    /* Optional; used instead of handler when a batch or replayed script has
+       several uses of this command in a row. */
+    imcli_batch_handler batch_handler;
+    /* Optional; used instead of handler, which can then be NULL, to get the
+       arguments as a stream. imcli_prompt_streaming starts this as soon as the
+       keywords have been read, before the rest of the line. */
+    imcli_stream_handler stream_handler;
+    /* Optional; used instead of handler when the line ends in a `<<TERM`
+       word, or always, if handler is NULL. See struct imcli_payload. */
+    imcli_payload_handler payload_handler;
+};
+
+/* A list of commands, checked in the order they were registered. This does
+   the same job as a chain of match_or_explain_keyword calls, but can also be
+   looked at without running anything, e.g. by the batch runner. A zeroed
+   registry is empty. */
+struct imcli_aliases;
+
+struct imcli_registry {
+    struct imcli_command *commands;
+
+    /* Aliases to expand before looking for a command, or NULL. */
+    struct imcli_aliases *aliases;
+};
+
+IMCLI_DEF void imcli_register(
+    struct imcli_registry *registry,
+    struct imcli_command command
+) {
+    arrpush(registry->commands, command);
+}
+
+IMCLI_DEF void imcli_registry_free(struct imcli_registry *registry) {
+    arrfree(registry->commands);
+}
+
+#ifndef IMCLI_ALIAS_DEPTH
+#define IMCLI_ALIAS_DEPTH 16
+#endif
+
+struct imcli_alias {
+    char *key;
+    string_buffer value;
+};
+
+/* Names that stand for a list of words, like `alias ll list long`. An alias's
+   words can start with another alias, so the first time an alias is used it
+   gets expanded all the way down, and that expansion is kept until some alias
+   changes. After that, using it costs one hash lookup and copying its words,
+   without splitting anything again. A zeroed imcli_aliases has no aliases. */
+struct imcli_aliases {
+    struct imcli_alias *definitions;
+    struct imcli_alias *expanded;
+};
+
+IMCLI_DEF string_buffer imcli_copy_words(string_buffer words) {
+    string_buffer copy = NULL;
+    arrsetcap(copy, arrlen(words));
+
+    for (int i = 0; i < arrlen(words); i++) {
+        int len = arrlen(words[i]);
+
+        char_buffer word = NULL;
+        arrsetcap(word, len + 1);
+        memcpy(arraddnptr(word, len), words[i], len);
+        arrpush(word, '\0');
+        arrpop(word);
+
+        arrpush(copy, word);
+    }
+
+    return copy;
+}
+
+IMCLI_DEF void imcli_forget_expansions(struct imcli_aliases *aliases) {
+    for (int i = 0; i < shlen(aliases->expanded); i++) {
+        sbfree(&aliases->expanded[i].value);
+    }
+    shfree(aliases->expanded);
+}
+
+/* Makes name stand for the words in body, replacing any alias it already
+   had. */
+IMCLI_DEF void imcli_alias_define(
+    struct imcli_aliases *aliases,
+    char *name,
+    char *body
+) {
+    if (!aliases->definitions) sh_new_strdup(aliases->definitions);
+
+    struct imcli_alias *existing = shgetp_null(aliases->definitions, name);
+    if (existing) sbfree(&existing->value);
+
+    shput(aliases->definitions, name, split_words_n(body, strlen(body)));
+
+    imcli_forget_expansions(aliases);
+}
+
+/* Returns false if there was no such alias. */
+IMCLI_DEF bool imcli_alias_remove(struct imcli_aliases *aliases, char *name) {
+    if (!aliases->definitions) return false;
+
+    struct imcli_alias *existing = shgetp_null(aliases->definitions, name);
+    if (!existing) return false;
+
+    sbfree(&existing->value);
+    shdel(aliases->definitions, name);
+
+    imcli_forget_expansions(aliases);
+    return true;
+}
+
+IMCLI_DEF void imcli_aliases_free(struct imcli_aliases *aliases) {
+    for (int i = 0; i < shlen(aliases->definitions); i++) {
+        sbfree(&aliases->definitions[i].value);
+    }
+    shfree(aliases->definitions);
+
+    imcli_forget_expansions(aliases);
+}
+
+/* Works out what an alias finally stands for, following aliases of aliases
+   until the first word isn't one, or until it loops back on itself. */
+IMCLI_DEF string_buffer imcli_expand_alias(
+    struct imcli_aliases *aliases,
+    char *name
+) {
+    string_buffer result = imcli_copy_words(
+        shget(aliases->definitions, name)
+    );
+
+    for (int depth = 0; depth < IMCLI_ALIAS_DEPTH; depth++) {
+        if (arrlen(result) == 0) break;
+        if (strcmp(result[0], name) == 0) break;
+
+        struct imcli_alias *next = shgetp_null(
+            aliases->definitions,
+            result[0]
+        );
+        if (!next) break;
+
+        int len = arrlen(next->value);
+        arrfree(result[0]);
+        arrdel(result, 0);
+        arrinsn(result, 0, len);
+
+        string_buffer next_words = imcli_copy_words(next->value);
+        memcpy(result, next_words, len * sizeof(*next_words));
+        arrfree(next_words);
+    }
+
+    return result;
+}
+
+/* Replaces the first word with what it stands for, if it is an alias. This
+   writes to the aliases, so only the thread running the session calls it:
+   lines are expanded there before a job or batch worker gets them. */
+IMCLI_DEF void imcli_apply_aliases(
+    struct imcli_aliases *aliases,
+    string_buffer *words
+) {
+    if (arrlen(*words) == 0 || !aliases->definitions) return;
+
+    /* Looking anything up in a NULL map would make one that doesn't copy
+       its keys. */
+    if (!aliases->expanded) sh_new_strdup(aliases->expanded);
+
+    struct imcli_alias *expansion = shgetp_null(aliases->expanded, (*words)[0]);
+    if (!expansion) {
+        if (shgeti(aliases->definitions, (*words)[0]) < 0) return;
+        /* else work it out, once */
+
+        shput(
+            aliases->expanded,
+            (*words)[0],
+            imcli_expand_alias(aliases, (*words)[0])
+        );
+        expansion = shgetp(aliases->expanded, (*words)[0]);
+    }
+
+    int len = arrlen(expansion->value);
+    string_buffer copy = imcli_copy_words(expansion->value);
+
+    arrfree((*words)[0]);
+    arrdel(*words, 0);
+    arrinsn(*words, 0, len);
+    memcpy(*words, copy, len * sizeof(*copy));
+
+    arrfree(copy);
+}
+
+IMCLI_DEF bool imcli_alias_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    struct imcli_aliases *aliases = (struct imcli_aliases *)userdata;
+
+    if (arrlen(*args) == 0) {
+        for (int i = 0; i < shlen(aliases->definitions); i++) {
+            char_buffer body = join_words(aliases->definitions[i].value);
+
+            struct imcli_message_fields fields = imcli_about(
+                aliases->definitions[i].key
+            );
+            fields.value = body;
+            imcli_message_about(
+                session,
+                "alias",
+                fields,
+                "%s: %s\n",
+                aliases->definitions[i].key,
+                body
+            );
+            arrfree(body);
+        }
+        return true;
+    }
+    /* else define one */
+
+    if (arrlen(*args) == 1) {
+        imcli_message_about(session, "error", imcli_about((*args)[0]),
+            "'alias' needs words for '%s' to stand for.\n",
+            (*args)[0]);
+        return true;
+    }
+
+    string_buffer body_words = NULL;
+    for (int i = 1; i < arrlen(*args); i++) arrpush(body_words, (*args)[i]);
+    char_buffer body = join_words(body_words);
+    arrfree(body_words);
+
+    imcli_alias_define(aliases, (*args)[0], body);
+    arrfree(body);
+
+    return true;
+}
+
+IMCLI_DEF bool imcli_unalias_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    struct imcli_aliases *aliases = (struct imcli_aliases *)userdata;
+
+    for (int i = 0; i < arrlen(*args); i++) {
+        if (!imcli_alias_remove(aliases, (*args)[i])) {
+            imcli_message_about(session, "error", imcli_about((*args)[i]),
+                "No alias '%s'.\n", (*args)[i]);
+        }
+    }
+
+    return true;
+}
+
+/* Expands the given aliases whenever the registry is used, and adds the
+   `alias` and `unalias` commands for changing them. Those never run as
+   background jobs, since jobs can't change aliases under the session. */
+IMCLI_DEF void imcli_register_alias_commands(
+    struct imcli_registry *registry,
+    struct imcli_aliases *aliases
+) {
+    registry->aliases = aliases;
+
+    struct imcli_command alias = {
+        .keywords = "alias",
+        .help_message = "alias: Lists aliases, or makes a new one.\n",
+        .detailed_help_message =
+            "Usage: alias [name word [...]]\n"
+            "Make name stand for the given words, wherever it is used as a command.\n"
+            "With no arguments, lists every alias instead.\n",
+        .handler = imcli_alias_command,
+        .userdata = aliases,
+        .flags = IMCLI_FOREGROUND,
+    };
+    imcli_register(registry, alias);
+
+    struct imcli_command unalias = {
+        .keywords = "unalias",
+        .help_message = "unalias: Removes aliases.\n",
+        .handler = imcli_unalias_command,
+        .userdata = aliases,
+        .flags = IMCLI_FOREGROUND,
+    };
+    imcli_register(registry, unalias);
+}
+
+IMCLI_DEF bool imcli_set_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)userdata;
+
+    if (arrlen(*args) == 0) {
+        for (int i = 0; i < shlen(session->variables); i++) {
+            struct imcli_variable *variable = &session->variables[i];
+
+            char_buffer value = NULL;
+            imcli_append_variable(
+                session,
+                &value,
+                variable->key.str,
+                variable->key.len
+            );
+            arrpush(value, '\0');
+
+            char_buffer name = NULL;
+            memcpy(arraddnptr(name, variable->key.len), variable->key.str,
+                variable->key.len);
+            arrpush(name, '\0');
+
+            struct imcli_message_fields fields = imcli_about(name);
+            fields.value = value;
+            imcli_message_about(
+                session,
+                "variable",
+                fields,
+                "%s: %s\n",
+                name,
+                value
+            );
+            arrfree(name);
+            arrfree(value);
+        }
+        return true;
+    }
+    /* else set one */
+
+    string_buffer value_words = NULL;
+    for (int i = 1; i < arrlen(*args); i++) arrpush(value_words, (*args)[i]);
+    char_buffer value = join_words(value_words);
+    arrfree(value_words);
+
+    imcli_set_variable(session, (*args)[0], value);
+    arrfree(value);
+
+    return true;
+}
+
+IMCLI_DEF bool imcli_unset_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)userdata;
+
+    for (int i = 0; i < arrlen(*args); i++) {
+        if (!imcli_unset_variable(session, (*args)[i])) {
+            imcli_message_about(session, "error", imcli_about((*args)[i]),
+                "No variable '%s'.\n", (*args)[i]);
+        }
+    }
+
+    return true;
+}
+
+/* Adds the `set` and `unset` commands, which change variables on whichever
+   session runs them. */
+IMCLI_DEF void imcli_register_variable_commands(
+    struct imcli_registry *registry
+) {
+    struct imcli_command set = {
+        .keywords = "set",
+        .help_message = "set: Lists variables, or sets one.\n",
+        .detailed_help_message =
+            "Usage: set [name [word] [...]]\n"
+            "Make $name stand for the given words in later lines. With no arguments,\n"
+            "lists every variable instead.\n",
+        .handler = imcli_set_command,
+    };
+    imcli_register(registry, set);
+
+    struct imcli_command unset = {
+        .keywords = "unset",
+        .help_message = "unset: Removes variables.\n",
+        .handler = imcli_unset_command,
+    };
+    imcli_register(registry, unset);
+}
+
+/* Finds the command these words would run, without changing them. Returns
+   NULL for help requests and unknown commands. */
+IMCLI_DEF struct imcli_command *imcli_find_command(
+    struct imcli_registry *registry,
+    string_buffer words
+) {
+    if (count_keyword_matches(words, "help") >= 0) return NULL;
+
+    /* The command depends on what the alias expands to. */
+    if (registry->aliases && registry->aliases->definitions && arrlen(words) > 0
+        && shgeti(registry->aliases->definitions, words[0]) >= 0) {
+        return NULL;
+    }
+
+    int command_count = arrlen(registry->commands);
+    for (int i = 0; i < command_count; i++) {
+        struct imcli_command *command = &registry->commands[i];
+        if (count_keyword_matches(words, command->keywords) >= 0) {
+            return command;
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns the command that reads a block after this line, if it ends in a
+   `<<TERM` word and runs a command with a payload handler, or NULL. */
+IMCLI_DEF struct imcli_command *imcli_heredoc_command(
+    struct imcli_registry *registry,
+    string_buffer words
+) {
+    int word_count = arrlen(words);
+    if (word_count == 0) return NULL;
+
+    char_buffer last = words[word_count - 1];
+    if (arrlen(last) <= 2 || last[0] != '<' || last[1] != '<') return NULL;
+
+    struct imcli_command *command = imcli_find_command(registry, words);
+    if (!command || !command->payload_handler) return NULL;
+    /* Those complain about the extra word instead. */
+    if (command->flags & IMCLI_NO_ARGS) return NULL;
+
+    return command;
+}
+
+/* Makes the session's next line go to the given continuation, rather than
+   being run as a command. Commands that need follow-up input, like a
+   confirmation, can ask their question, call this, and return, rather than
+   calling prompt again and blocking. That way one thread can keep any number
+   of fed sessions in the middle of a conversation, since each one only needs
+   its state, not a stack. The continuation can call this again to wait for
+   another line. */
+IMCLI_DEF void imcli_await_words(
+    struct imcli_session *session,
+    imcli_continuation continuation,
+    void *state
+) {
+    session->continuation = continuation;
+    session->continuation_state = state;
+}
+
+#if defined(__cplusplus) && __cplusplus >= 202002L
+
+/* A command written as a C++20 coroutine, that can ask for more lines in the
+   middle with `co_await imcli_next_words(session)`, and ends with
+   `co_return keep_going;`. Each co_await is an imcli_await_words underneath,
+   so the session's thread is never blocked, and the handler just returns
+   imcli_task_run of the coroutine:
+
+       imcli_task confirm(imcli_session *session, string_buffer args) {
+           imcli_printf(session, "Delete %s? ", args[0]);
+           string_buffer answer = co_await imcli_next_words(session);
+           ...
+           sbfree(&answer);
+           sbfree(&args);
+           co_return true;
+       }
+
+       bool delete_command(imcli_session *session, string_buffer *args, void *) {
+           return imcli_task_run(confirm(session, imcli_copy_words(*args)));
+       }
+
+   The handler's arguments are freed when it returns, so the coroutine should
+   be given its own copy. Words from co_await belong to the coroutine, and
+   are NULL if the session ended while it was waiting, in which case it
+   should clean up and co_return. */
+struct imcli_task {
+    struct promise_type {
+        bool keep_going = true;
+        /* The line handed over by the last continuation. */
+        string_buffer words = NULL;
+
+        /* Otherwise the promise would be an aggregate, which some compilers
+           initialize from the coroutine's own arguments. */
+        promise_type() {}
+
+        imcli_task get_return_object() {
+            return imcli_task{
+                std::coroutine_handle<promise_type>::from_promise(*this)
+            };
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(bool value) { keep_going = value; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/* Finishes up after the coroutine has run as far as it can: if it's done,
+   returns what it returned, otherwise it's waiting for a line, and the
+   session keeps going. */
+IMCLI_DEF bool imcli_task_run(imcli_task task) {
+    if (!task.handle.done()) return true;
+
+    bool keep_going = task.handle.promise().keep_going;
+    task.handle.destroy();
+    return keep_going;
+}
+
+/* The continuation behind every co_await: hands the line to the coroutine
+   and runs it to its next co_await, or its end. */
+IMCLI_DEF bool imcli_task_resume(
+    struct imcli_session *session,
+    string_buffer *words,
+    void *state
+) {
+    auto handle =
+        std::coroutine_handle<imcli_task::promise_type>::from_address(state);
+
+    if (words) {
+        handle.promise().words = *words;
+        *words = NULL;
+    }
+    handle.resume();
+
+    /* With no more lines coming, waiting again would never finish. */
+    if (!words && !handle.done()) {
+        session->continuation = NULL;
+        handle.destroy();
+        return false;
+    }
+    return imcli_task_run(imcli_task{handle});
+}
+
+struct imcli_words_awaiter {
+    struct imcli_session *session;
+    std::coroutine_handle<imcli_task::promise_type> handle;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<imcli_task::promise_type> h) {
+        handle = h;
+        imcli_await_words(session, imcli_task_resume, h.address());
+    }
+    string_buffer await_resume() {
+        string_buffer words = handle.promise().words;
+        handle.promise().words = NULL;
+        return words;
+    }
+};
+
+/* Waits for the session's next line; see imcli_task. */
+IMCLI_DEF imcli_words_awaiter imcli_next_words(struct imcli_session *session) {
+    return imcli_words_awaiter{session, {}};
+}
+
+#endif
+
+/* Runs a payload handler, with the payload read from the session's input if
+   the last word asks for one. */
+IMCLI_DEF bool imcli_dispatch_payload(
+    struct imcli_session *session,
+    struct imcli_command *command,
+    string_buffer *words,
+    bool heredoc
+) {
+    struct imcli_payload payload = {0};
+    payload.session = session;
+    payload.done = true;
+
+    char_buffer terminator = NULL;
+    if (heredoc) {
+        terminator = arrpop(*words);
+        if (session->script_payload) {
+            /* The script already read the block. */
+            payload.terminator = &terminator[2];
+            payload.body = session->script_payload;
+            payload.body_size = session->script_payload_size;
+            payload.done = payload.body_size == 0;
+            session->script_payload = NULL;
+        } else if (session->input) {
+            payload.terminator = &terminator[2];
+            payload.done = false;
+        } else {
+            imcli_message_about(session, "error",
+                imcli_about(terminator),
+                "There is no input here to read '%s' from.\n", terminator);
+        }
+    }
+
+    bool keep_going = command->payload_handler(
+        session,
+        words,
+        &payload,
+        command->userdata
+    );
+
+    /* Skip whatever the handler didn't read, including the terminator. */
+    size_t size;
+    while (imcli_payload_next(&payload, &size)) {}
+
+    arrfree(payload.chunk);
+    arrfree(terminator);
+
+    return keep_going;
+}
+
+/* Like imcli_dispatch, for words whose aliases have already been expanded.
+   This doesn't look at the aliases at all, so jobs and batch workers use it on
+   their own threads. */
+IMCLI_DEF bool imcli_dispatch_expanded(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer *words
+) {
+    if (session->continuation) {
+        imcli_continuation continuation = session->continuation;
+        session->continuation = NULL;
+        return continuation(session, words, session->continuation_state);
+    }
+
+    bool help = match_keyword(words, "help", NULL);
+
+    bool any_matched = false;
+
+    int command_count = arrlen(registry->commands);
+    for (int i = 0; i < command_count; i++) {
+        struct imcli_command *command = &registry->commands[i];
+
+        const char *detailed_help_message = command->detailed_help_message;
+        if (!detailed_help_message) {
+            detailed_help_message = command->help_message;
+        }
+
+        bool matched;
+        if (command->flags & IMCLI_NO_ARGS) {
+            matched = match_or_explain_keyword_simple(
+                session,
+                words,
+                command->keywords,
+                command->help_message,
+                help,
+                &any_matched
+            );
+        } else {
+            matched = match_or_explain_keyword_detailed(
+                session,
+                words,
+                command->keywords,
+                command->help_message,
+                detailed_help_message,
+                help,
+                &any_matched
+            );
+        }
+
+        if (matched && command->payload_handler) {
+            int word_count = arrlen(*words);
+            char_buffer last = word_count ? (*words)[word_count - 1] : NULL;
+            bool heredoc = last && arrlen(last) > 2
+                && last[0] == '<' && last[1] == '<';
+
+            if (heredoc || !command->handler) {
+                return imcli_dispatch_payload(
+                    session,
+                    command,
+                    words,
+                    heredoc
+                );
+            }
+        }
+
+        if (matched && !command->handler && command->stream_handler) {
+            /* Only streams; stream what we've already got. */
+            struct imcli_word_stream stream = {0};
+            stream.session = session;
+            stream.words = *words;
+            return command->stream_handler(session, &stream, command->userdata);
+        }
+
+        if (matched) {
+            return command->handler(session, words, command->userdata);
+        }
+    }
+
+    /* This will never return true, since the only line that will trigger
+       it is `help help`. We just want help to have a help message. */
+    match_or_explain_keyword_detailed(
+        session,
+        words,
+        "help",
+        "help: Lists commands and explains their usage.\n",
+
+        "Usage: help [command]\n"
+        "Print a detailed message about how to use the given command. If no command\n"
+        "is specified, then a summary of all available commands is given instead.\n",
+        help,
+        &any_matched
+    );
+
+    if (!any_matched && arrlen(*words) > 0) {
+        imcli_message_about(session, "error", imcli_about((*words)[0]),
+            "Unknown command '%s'. Type 'help' for a list of commands.\n",
+            (*words)[0]);
+    }
+
+    return true;
+}
+
+/* Runs one line of words against the registry, including `help` and the
+   message for unknown commands, or passes it on to a command that is waiting
+   for more input. Returns false once the session should end. */
+IMCLI_DEF bool imcli_dispatch(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer *words
+) {
+    if (registry->aliases && !session->continuation) {
+        imcli_apply_aliases(registry->aliases, words);
+    }
+
+    return imcli_dispatch_expanded(session, registry, words);
+}
+
+/* If the first line runs a command with a batch handler, runs it together
+   with every line straight after it that runs the same command, with one call
+   to the batch handler, and returns how many lines that was. Otherwise
+   returns 0 and runs nothing. The lines are left for the caller to free. */
+IMCLI_DEF int imcli_dispatch_grouped(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer *lines,
+    int line_count,
+    bool *keep_going_out
+) {
+    if (line_count == 0 || session->continuation) return 0;
+
+    struct imcli_command *command = imcli_find_command(registry, lines[0]);
+    if (!command || !command->batch_handler) return 0;
+
+    int count = 0;
+    while (count < line_count) {
+        string_buffer words = lines[count];
+        if (imcli_find_command(registry, words) != command) break;
+
+        /* Leave the complaint about arguments to imcli_dispatch. */
+        int keyword_count = count_keyword_matches(words, command->keywords);
+        if ((command->flags & IMCLI_NO_ARGS)
+            && keyword_count < arrlen(words)) break;
+
+        count += 1;
+    }
+    if (count == 0) return 0;
+
+    for (int i = 0; i < count; i++) {
+        match_keyword(&lines[i], command->keywords, NULL);
+    }
+
+    *keep_going_out = command->batch_handler(
+        session,
+        lines,
+        count,
+        command->userdata
+    );
+
+    return count;
+}
+
+/* Runs a single command that was already split up, like the arguments a
+   program was started with, without reading or splitting anything. The
+   strings are copied, so argv is left alone. Returns what the command
+   returned. */
+IMCLI_DEF bool imcli_exec(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    int argc,
+    char **argv
+) {
+    string_buffer words = NULL;
+    arrsetcap(words, argc);
+
+    for (int i = 0; i < argc; i++) {
+        int len = strlen(argv[i]);
+
+        /* An empty argument, like `""` from a shell, is still an argument. */
+        char_buffer word = NULL;
+        arrsetcap(word, len + 1);
+        if (len > 0) memcpy(arraddnptr(word, len), argv[i], len);
+        arrpush(word, '\0');
+        arrpop(word);
+
+        arrpush(words, word);
+    }
+
+    bool keep_going = imcli_dispatch(session, registry, &words);
+    sbfree(&words);
+
+    return keep_going;
+}
+
+/* Runs a single command from a string, for programs that embed the command
+   set rather than giving it a prompt. */
+IMCLI_DEF bool imcli_exec_string(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    char *line
+) {
+    string_buffer words = imcli_split_words_with_variables(
+        session,
+        line,
+        strlen(line)
+    );
+
+    bool keep_going = imcli_dispatch(session, registry, &words);
+    sbfree(&words);
+
+    return keep_going;
+}
+
+/* Breaks `;` and `|` out of the words they're attached to, so `a; b|c` comes
+   out the same as `a ; b | c`. The words are moved into the result. */
+IMCLI_DEF string_buffer imcli_split_separators(string_buffer words) {
+    string_buffer result = NULL;
+
+    int word_count = arrlen(words);
+    for (int i = 0; i < word_count; i++) {
+        char_buffer word = words[i];
+        int len = arrlen(word);
+
+        if (len == 1 || !strpbrk(word, ";|")) {
+            arrpush(result, word);
+            continue;
+        }
+        /* else cut it up */
+
+        int piece_start = 0;
+        for (int j = 0; j <= len; j++) {
+            bool separator = j < len && (word[j] == ';' || word[j] == '|');
+            if (j < len && !separator) continue;
+
+            if (j > piece_start) {
+                char_buffer piece = NULL;
+                memcpy(arraddnptr(piece, j - piece_start), &word[piece_start],
+                    j - piece_start);
+                arrpush(piece, '\0');
+                arrpop(piece);
+                arrpush(result, piece);
+            }
+            if (separator) {
+                char_buffer piece = NULL;
+                arrpush(piece, word[j]);
+                arrpush(piece, '\0');
+                arrpop(piece);
+                arrpush(result, piece);
+            }
+            piece_start = j + 1;
+        }
+        arrfree(word);
+    }
+
+    arrfree(words);
+    return result;
+}
+
+IMCLI_DEF bool imcli_is_separator(char_buffer word, char separator) {
+    return arrlen(word) == 1 && word[0] == separator;
+}
+
+#ifdef IMCLI_THREADS
+
+/* Background jobs run their lines with this; see imcli_dispatch_line. */
+IMCLI_DEF bool imcli_dispatch_stages(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer *words,
+    bool expanded
+);
+
+/* A line running on a thread of its own. Its output is kept in memory, and
+   only shown once it is collected with `wait`. */
+struct imcli_job {
+    int id;
+    thrd_t thread;
+    struct imcli_registry *registry;
+    /* Split into stages by `;` and `|`, with aliases already expanded. */
+    string_buffer words;
+    /* The line as it was typed, for `jobs` to show. */
+    char_buffer description;
+    char_buffer output;
+    bool json;
+    atomic_bool finished;
+};
+
+/* Every background job that hasn't been collected yet. Only the thread
+   running the session touches this; the jobs themselves only touch their own
+   imcli_job. A zeroed imcli_jobs has no jobs. */
+struct imcli_jobs {
+    struct imcli_job **list;
+    int last_id;
+};
+
+IMCLI_DEF int imcli_job_run(void *data) {
+    struct imcli_job *job = data;
+
+    struct imcli_session job_session = imcli_session_new(NULL, NULL);
+    job_session.json = job->json;
+    imcli_session_set_sink(&job_session, imcli_sink_memory(&job->output));
+
+    /* There's no session for a job to end, so whatever it returns is
+       ignored. */
+    imcli_dispatch_stages(&job_session, job->registry, &job->words, true);
+
+    imcli_session_free(&job_session);
+
+    atomic_store_explicit(&job->finished, true, memory_order_release);
+    return 0;
+}
+
+/* Starts the words running as a background job, taking ownership of them.
+   They can hold `;` and `|` separators, and have their aliases expanded
+   already, since jobs never touch them. The job writes JSON records if json
+   is set. Returns the job's id, or 0 if it couldn't be started, in which case
+   the words are left with the caller. */
+IMCLI_DEF int imcli_start_job(
+    struct imcli_jobs *jobs,
+    struct imcli_registry *registry,
+    string_buffer words,
+    bool json
+) {
+    struct imcli_job *job = malloc(sizeof(*job));
+    if (!job) return 0;
+    job->registry = registry;
+    job->json = json;
+    job->words = words;
+    job->description = join_words(words);
+    job->output = NULL;
+    atomic_init(&job->finished, false);
+
+    if (thrd_create(&job->thread, imcli_job_run, job) != thrd_success) {
+        arrfree(job->description);
+        free(job);
+        return 0;
+    }
+
+    jobs->last_id += 1;
+    job->id = jobs->last_id;
+    arrpush(jobs->list, job);
+
+    return job->id;
+}
+
+/* Waits for the job at the given index to finish, copies its output to the
+   session's output, or throws it away if session is NULL, and forgets about
+   the job. */
+IMCLI_DEF void imcli_collect_job(
+    struct imcli_jobs *jobs,
+    int index,
+    struct imcli_session *session
+) {
+    struct imcli_job *job = jobs->list[index];
+
+    thrd_join(job->thread, NULL);
+
+    if (session) {
+        struct imcli_message_fields fields = {0};
+        fields.id = job->id;
+        fields.value = job->description;
+        fields.state = "done";
+        imcli_message_about(
+            session,
+            "job",
+            fields,
+            "[%d] done: %s\n",
+            job->id,
+            job->description
+        );
+        imcli_write(session, job->output, arrlen(job->output));
+    }
+
+    sbfree(&job->words);
+    arrfree(job->description);
+    arrfree(job->output);
+    free(job);
+
+    arrdel(jobs->list, index);
+}
+
+/* Waits for every job, throwing away their output. */
+IMCLI_DEF void imcli_jobs_free(struct imcli_jobs *jobs) {
+    while (arrlen(jobs->list) > 0) imcli_collect_job(jobs, 0, NULL);
+    arrfree(jobs->list);
+}
+
+IMCLI_DEF bool imcli_jobs_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)args;
+    struct imcli_jobs *jobs = userdata;
+
+    int job_count = arrlen(jobs->list);
+    for (int i = 0; i < job_count; i++) {
+        struct imcli_job *job = jobs->list[i];
+        bool finished = atomic_load_explicit(
+            &job->finished,
+            memory_order_acquire
+        );
+        const char *state = finished ? "done" : "running";
+
+        struct imcli_message_fields fields = {0};
+        fields.id = job->id;
+        fields.value = job->description;
+        fields.state = state;
+        imcli_message_about(
+            session,
+            "job",
+            fields,
+            "[%d] %s: %s\n",
+            job->id,
+            state,
+            job->description
+        );
+    }
+
+    return true;
+}
+
+IMCLI_DEF bool imcli_wait_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    struct imcli_jobs *jobs = userdata;
+
+    if (arrlen(*args) == 0) {
+        while (arrlen(jobs->list) > 0) {
+            imcli_collect_job(jobs, 0, session);
+        }
+        return true;
+    }
+    /* else wait for the jobs that were asked for */
+
+    int arg_count = arrlen(*args);
+    for (int a = 0; a < arg_count; a++) {
+        int id = atoi((*args)[a]);
+
+        int index = -1;
+        for (int i = 0; i < arrlen(jobs->list); i++) {
+            if (jobs->list[i]->id == id) index = i;
+        }
+
+        if (index < 0) {
+            imcli_message_about(session, "error", imcli_about((*args)[a]),
+                "No job '%s'.\n", (*args)[a]);
+        } else {
+            imcli_collect_job(jobs, index, session);
+        }
+    }
+
+    return true;
+}
+
+/* Adds the `jobs` and `wait` commands, for looking at and collecting the
+   given background jobs. */
+IMCLI_DEF void imcli_register_job_commands(
+    struct imcli_registry *registry,
+    struct imcli_jobs *jobs
+) {
+    struct imcli_command jobs_command = {
+        .keywords = "jobs",
+        .help_message = "jobs: Lists background jobs.\n",
+        .handler = imcli_jobs_command,
+        .userdata = jobs,
+        .flags = IMCLI_NO_ARGS | IMCLI_FOREGROUND,
+    };
+    imcli_register(registry, jobs_command);
+
+    struct imcli_command wait_command = {
+        .keywords = "wait",
+        .help_message = "wait: Waits for background jobs and shows their output.\n",
+        .detailed_help_message =
+            "Usage: wait [job] [...]\n"
+            "Wait for the given background jobs to finish, and print everything they\n"
+            "printed. With no arguments, waits for every job.\n",
+        .handler = imcli_wait_command,
+        .userdata = jobs,
+        .flags = IMCLI_FOREGROUND,
+    };
+    imcli_register(registry, wait_command);
+}
+
+
+/* Starts the words as one of the session's background jobs, and says so.
+   Returns false, leaving the words with the caller, if it couldn't. */
+IMCLI_DEF bool imcli_start_line_job(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer *words
+) {
+    int id = imcli_start_job(session->jobs, registry, *words, session->json);
+    if (id == 0) {
+        imcli_message(session, "error", "Couldn't start a background job.\n");
+        return false;
+    }
+    *words = NULL;
+
+    struct imcli_message_fields fields = {0};
+    fields.id = id;
+    fields.state = "started";
+    imcli_message_about(session, "job", fields, "[%d] started\n", id);
+    return true;
+}
+
+/* If the commands from all[start] up to the next `;` or `&` end in `&`,
+   runs them as a background job, taking their words, and returns the index
+   of the `&`. Otherwise returns -1, and leaves them to run in the
+   foreground. Each stage's aliases are expanded here, so that only this
+   thread ever touches them. Commands registered with IMCLI_FOREGROUND, like
+   `jobs` and `wait`, refuse the `&`, since a job thread can't safely look at
+   the job list, and a lone unknown command or help runs straight away, since
+   it is quick, and its output is wanted now. */
+IMCLI_DEF int imcli_dispatch_background(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer all,
+    int start,
+    bool *keep_going
+) {
+    int word_count = arrlen(all);
+    int end = start;
+    while (end < word_count
+        && !imcli_is_separator(all[end], ';')
+        && !imcli_is_separator(all[end], '&')) end++;
+
+    if (end == word_count || !imcli_is_separator(all[end], '&')) return -1;
+    /* else it goes in the background */
+
+    string_buffer words = NULL;
+    struct imcli_command *refused = NULL;
+    struct imcli_command *command = NULL;
+    int stage_count = 0;
+
+    int stage_start = start;
+    for (int i = start; i <= end; i++) {
+        bool pipe = i < end && imcli_is_separator(all[i], '|');
+        if (i < end && !pipe) continue;
+
+        string_buffer stage = NULL;
+        for (int j = stage_start; j < i; j++) arrpush(stage, all[j]);
+        if (registry->aliases) imcli_apply_aliases(registry->aliases, &stage);
+
+        command = imcli_find_command(registry, stage);
+        if (command && (command->flags & IMCLI_FOREGROUND)) refused = command;
+        stage_count += 1;
+
+        for (int j = 0; j < arrlen(stage); j++) arrpush(words, stage[j]);
+        arrfree(stage);
+        if (pipe) arrpush(words, all[i]);
+        stage_start = i + 1;
+    }
+    for (int j = start; j < end; j++) all[j] = NULL;
+
+    if (refused) {
+        imcli_message_about(session, "error",
+            imcli_about(refused->keywords),
+            "'%s' can't run in the background.\n", refused->keywords);
+    } else if (stage_count == 1 && !command) {
+        if (arrlen(words) > 0) {
+            *keep_going = imcli_dispatch_expanded(session, registry, &words);
+        }
+    } else if (!imcli_start_line_job(session, registry, &words)) {
+        *keep_going = imcli_dispatch_stages(session, registry, &words, true);
+    }
+
+    sbfree(&words);
+    return end;
+}
+
+/* Starts a whole line that runs a command registered with IMCLI_BACKGROUND
+   as a background job, as if it had been given a trailing `&`, taking its
+   words, which already have their aliases expanded. Returns false, leaving
+   the words alone, for any other command. */
+IMCLI_DEF bool imcli_start_background_command(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer *words
+) {
+    struct imcli_command *command = imcli_find_command(registry, *words);
+    if (!command || !(command->flags & IMCLI_BACKGROUND)
+        || (command->flags & IMCLI_FOREGROUND)) return false;
+
+    return imcli_start_line_job(session, registry, words);
+}
+
+#endif
+
+/* Runs words already split up by imcli_split_separators, taking them; see
+   imcli_dispatch_line. With expanded set, every stage has had its aliases
+   expanded already. */
+IMCLI_DEF bool imcli_dispatch_stages(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer *words,
+    bool expanded
+) {
+    string_buffer all = *words;
+    *words = NULL;
+
+    bool keep_going = true;
+    string_buffer piped = NULL;
+
+    imcli_continuation waiting = NULL;
+    void *waiting_state = NULL;
+
+    int word_count = arrlen(all);
+    int stage_start = 0;
+#ifdef IMCLI_THREADS
+    /* Whether the stage at stage_start is the first of a list of stages
+       joined by `|`, after the start of the line or a `;` or `&`. */
+    bool list_start = true;
+#endif
+    for (int i = 0; i <= word_count && keep_going; i++) {
+#ifdef IMCLI_THREADS
+        if (list_start && i == stage_start && session->jobs && !expanded) {
+            int end = imcli_dispatch_background(
+                session,
+                registry,
+                all,
+                stage_start,
+                &keep_going
+            );
+            if (end >= 0) {
+                arrfree(all[end]);
+                i = end;
+                stage_start = end + 1;
+                continue;
+            }
+        }
+#endif
+
+        bool end_of_line = i == word_count;
+        bool pipe = !end_of_line && imcli_is_separator(all[i], '|');
+        bool sequence = !end_of_line && imcli_is_separator(all[i], ';');
+        if (!end_of_line && !pipe && !sequence) continue;
+
+        string_buffer stage = NULL;
+        for (int j = stage_start; j < i; j++) arrpush(stage, all[j]);
+        for (int j = 0; j < arrlen(piped); j++) arrpush(stage, piped[j]);
+        arrfree(piped);
+        piped = NULL;
+
+        /* With nothing to pipe into, the output may as well be shown. */
+        bool next_is_command = i + 1 < word_count
+            && !imcli_is_separator(all[i + 1], '|')
+            && !imcli_is_separator(all[i + 1], ';');
+
+        /* Output headed down the pipe goes into memory through a sink,
+           rather than a FILE, which without open_memstream would mean a
+           file on disk. Anything written straight to session->output
+           bypasses it, and is shown rather than piped. */
+        bool capturing = pipe && next_is_command;
+        char_buffer text = NULL;
+
+        if (arrlen(stage) > 0) {
+            /* Anything the session's sink is holding stays where it is,
+               ahead of whatever gets shown after the pipeline. */
+            struct imcli_sink sink = session->sink;
+            char_buffer held = session->sink_buffer;
+            time_t last_flush = session->last_flush;
+            if (capturing) {
+                session->sink = imcli_sink_memory(&text);
+                session->sink_buffer = NULL;
+            }
+
+            if (!expanded && registry->aliases) {
+                imcli_apply_aliases(registry->aliases, &stage);
+            }
+
+            bool started = false;
+#ifdef IMCLI_THREADS
+            if (list_start && !pipe && session->jobs && !expanded) {
+                started = imcli_start_background_command(
+                    session,
+                    registry,
+                    &stage
+                );
+            }
+#endif
+            if (!started) {
+                keep_going = imcli_dispatch_expanded(session, registry, &stage);
+            }
+
+            if (capturing) {
+                imcli_flush(session);
+                arrfree(session->sink_buffer);
+                session->sink = sink;
+                session->sink_buffer = held;
+                session->last_flush = last_flush;
+            }
+        }
+
+        /* A command waiting for an answer gets it from the next line, not
+           from the rest of this one. */
+        if (session->continuation) {
+            if (waiting) waiting(session, NULL, waiting_state);
+            waiting = session->continuation;
+            waiting_state = session->continuation_state;
+            session->continuation = NULL;
+        }
+
+        if (capturing) {
+            piped = split_words_n(text, arrlen(text));
+            arrfree(text);
+        }
+
+        sbfree(&stage);
+        if (!end_of_line) arrfree(all[i]);
+        stage_start = i + 1;
+#ifdef IMCLI_THREADS
+        list_start = !pipe;
+#endif
+    }
+
+    /* Words left over after a command ended the session. */
+    for (int j = stage_start; j < word_count; j++) arrfree(all[j]);
+    sbfree(&piped);
+    arrfree(all);
+
+    session->continuation = waiting;
+    session->continuation_state = waiting_state;
+
+    return keep_going;
+}
+
+/* Runs a line that can hold more than one command: `a ; b` runs a then b, and
+   `a | b` runs a, and then b with a's output split into words and added to
+   the end of b's arguments, all in memory, without any extra processes.
+
+   With IMCLI_THREADS, and somewhere to keep jobs in session->jobs, commands
+   up to a separate `&` word run as a background job, so `a | b &` runs the
+   whole pipe in the background, and `a ; b &` runs a, then starts b. A
+   command registered with IMCLI_BACKGROUND starts as a job even without the
+   `&`, unless its output is headed down a pipe. Checking for `&` only looks
+   at the line itself, so prompts don't get slower as jobs pile up.
+
+   Takes the words, leaving *words empty. Returns false as soon as a command
+   ends the session. */
+IMCLI_DEF bool imcli_dispatch_line(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer *words
+) {
+    /* An answer to a question goes through untouched. */
+    if (session->continuation) return imcli_dispatch(session, registry, words);
+
+    string_buffer all = imcli_split_separators(*words);
+    *words = NULL;
+
+    return imcli_dispatch_stages(session, registry, &all, false);
+}
+
+#ifdef IMCLI_THREADS
+
+/* Like imcli_dispatch_line, for a session whose jobs aren't kept in
+   session->jobs, e.g. because it is shared with other lists of jobs. */
+IMCLI_DEF bool imcli_dispatch_jobs(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    struct imcli_jobs *jobs,
+    string_buffer *words
+) {
+    struct imcli_jobs *previous = session->jobs;
+    session->jobs = jobs;
+    bool keep_going = imcli_dispatch_line(session, registry, words);
+    session->jobs = previous;
+    return keep_going;
+}
+
+#endif
+
+/* Returns true if every word matches the start of the keywords, and there
+   are still keywords left over, so more words could match the rest. */
+IMCLI_DEF bool imcli_keywords_continue(
+    string_buffer words,
+    const char *keywords
+) {
+    int str_len = strlen(keywords);
+
+    int word_start = 0;
+    int word_len = 0;
+    for (int i = 0; i <= arrlen(words); i++) {
+        find_next_word(
+            keywords,
+            str_len,
+            word_start + word_len,
+            &word_start,
+            &word_len
+        );
+        if (word_len == 0) return false;
+        if (i == arrlen(words)) return true;
+
+        if (!compare_charbuff_str_slice(words[i], &keywords[word_start],
+            word_len)) return false;
+    }
+
+    return false;
+}
+
+/* Returns the streaming command that the line starting with these words is
+   sure to run: the one imcli_find_command picks, as long as no command with
+   more keywords matches, or could match once more words arrive. A streaming
+   `load` has to wait for the next word, if there is a `load config`. Sets
+   *settled once no more words could change the answer, so there's no need to
+   ask again. */
+IMCLI_DEF struct imcli_command *imcli_find_streaming_command(
+    struct imcli_registry *registry,
+    string_buffer words,
+    bool *settled
+) {
+    struct imcli_command *found = imcli_find_command(registry, words);
+    int keyword_count = found ? count_keyword_matches(words, found->keywords) : 0;
+
+    bool longer = false;
+    bool continues = false;
+    int command_count = arrlen(registry->commands);
+    for (int i = 0; i < command_count; i++) {
+        const char *keywords = registry->commands[i].keywords;
+        if (imcli_keywords_continue(words, keywords)) continues = true;
+        if (count_keyword_matches(words, keywords) > keyword_count) {
+            longer = true;
+        }
+    }
+
+    /* Without a command whose keywords go on past these words, any more
+       words can only be arguments. */
+    *settled = !continues;
+
+    if (!found || !found->stream_handler || longer || continues) return NULL;
+    return found;
+}
+
+/* Prompts for and runs one line, like prompt and imcli_dispatch_line, except
+   that the line is read a word at a time, straight out of the session's
+   pending input. As soon as the words so far can only run a command with a
+   stream_handler, that handler starts, and reads the rest of its arguments
+   through its stream, so memory use doesn't depend on how long the line is.
+   A `;` or `|` ends its arguments, and the rest of the line runs after it,
+   with whatever the handler wrote after reaching a `|` piped into the next
+   command. Once the words so far can't run a streaming command, the rest of
+   the line is read and split as a whole, and the line is dispatched like
+   imcli_dispatch_line. Returns false once the session should end, including
+   when the input runs out. */
+IMCLI_DEF bool imcli_prompt_streaming(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    const char *prompt_text
+) {
+    if (!session->json) imcli_write(session, prompt_text, strlen(prompt_text));
+    imcli_flush(session);
+
+    struct imcli_word_stream stream = {0};
+    stream.session = session;
+    stream.from_input = true;
+
+    string_buffer prefix = NULL;
+    bool keep_going = true;
+
+    /* An answer to a question is never a command. */
+    bool settled = session->continuation != NULL;
+    char_buffer word = NULL;
+    while (!settled && (word = imcli_stream_next(&stream))) {
+        char_buffer copy = NULL;
+        memcpy(arraddnptr(copy, arrlen(word) + 1), word, arrlen(word) + 1);
+        arrpop(copy);
+        arrpush(prefix, copy);
+
+        struct imcli_command *command = imcli_find_streaming_command(
+            registry,
+            prefix,
+            &settled
+        );
+        if (!command) continue;
+        /* else it streams */
+
+        /* Any words read past the keywords come first. */
+        stream.words = prefix;
+        stream.next_word = count_keyword_matches(prefix, command->keywords);
+        stream.pipe_output = true;
+
+        keep_going = command->stream_handler(
+            session,
+            &stream,
+            command->userdata
+        );
+        imcli_stream_skip(&stream);
+        imcli_stream_unpipe(&stream);
+
+        sbfree(&prefix);
+        break;
+    }
+
+    if (session->continuation) {
+        /* The whole line goes to the command that asked for it. */
+        char_buffer line = imcli_next_line(session, &stream.input_done);
+
+        string_buffer words = imcli_split_line(session, line);
+        if (arrlen(words) > 0 || !stream.input_done) {
+            keep_going = imcli_dispatch(session, registry, &words);
+        }
+        sbfree(&words);
+    } else if (keep_going) {
+        /* The words read so far already had their variables replaced, and
+           the rest of the line, if there is any, is split the same way as
+           any other line's. */
+        string_buffer words = prefix;
+        prefix = NULL;
+        if (stream.separator) {
+            char_buffer separator = NULL;
+            arrpush(separator, stream.separator);
+            arrpush(separator, '\0');
+            arrpop(separator);
+            if (arrlen(words) > 0) arrpush(words, separator);
+            else arrfree(separator);
+        }
+
+        if (!stream.line_done || stream.separator) {
+            char_buffer line = imcli_next_line(session, &stream.input_done);
+            string_buffer rest = imcli_split_words_with_variables(
+                session,
+                line,
+                arrlen(line)
+            );
+            for (int i = 0; i < arrlen(rest); i++) arrpush(words, rest[i]);
+            arrfree(rest);
+        }
+
+        if (stream.piped) {
+            /* The streaming command's output goes on the end of the next
+               command's arguments, unless there is no next command. */
+            words = imcli_split_separators(words);
+            int stage_end = 0;
+            while (stage_end < arrlen(words)
+                && !imcli_is_separator(words[stage_end], '|')
+                && !imcli_is_separator(words[stage_end], ';')) stage_end++;
+
+            if (stage_end == 0) {
+                imcli_write(session, stream.piped, arrlen(stream.piped));
+            } else {
+                string_buffer piped = split_words_n(
+                    stream.piped,
+                    arrlen(stream.piped)
+                );
+                int piped_count = arrlen(piped);
+                if (piped_count) {
+                    arrinsn(words, stage_end, piped_count);
+                    memcpy(&words[stage_end], piped,
+                        piped_count * sizeof(char_buffer));
+                }
+                arrfree(piped);
+            }
+        }
+
+        if (arrlen(words) > 0) {
+            keep_going = imcli_dispatch_line(session, registry, &words);
+        }
+        sbfree(&words);
+    }
+
+    sbfree(&prefix);
+    arrfree(stream.word);
+    arrfree(stream.piped);
+
+    return keep_going && !stream.input_done;
+}
+
+#ifdef IMCLI_THREADS
+
+/* How many split lines the reader can get ahead by. This has to be a power of
+   two, so that counting lines with an unsigned int that wraps around keeps
+   landing on the same slots. */
+#ifndef IMCLI_PIPELINE_SLOTS
+#define IMCLI_PIPELINE_SLOTS 256
+#endif
+
+_Static_assert(
+    IMCLI_PIPELINE_SLOTS > 0
+        && (IMCLI_PIPELINE_SLOTS & (IMCLI_PIPELINE_SLOTS - 1)) == 0,
+    "IMCLI_PIPELINE_SLOTS must be a power of two"
+);
+
+/* How many times each side yields while waiting for the other, before it goes
+   to sleep until woken. */
+#ifndef IMCLI_PIPELINE_SPINS
+#define IMCLI_PIPELINE_SPINS 128
+#endif
+
+/* A line the reader has read. Lines with a `$` in them are only split once
+   the dispatcher takes them, on its own thread, with the session's variables
+   as the lines before them left them. */
+struct imcli_pipeline_slot {
+    string_buffer words;
+    char_buffer line;
+};
+
+/* Reads and splits lines on a thread of its own, ahead of whatever is running
+   the commands, so that executing one command overlaps with reading the next
+   ones. This is meant for batch input like scripts and replayed logs; no
+   prompt is printed. Either side that has to wait for the other spins for a
+   little while, since the wait is usually short, and then sleeps, so a
+   dispatcher waiting on an idle terminal doesn't keep a core busy.
+
+   Lines come out in exactly the order they were read, and only the dispatching
+   thread writes output, so output order doesn't change either.
+
+   Since the reader is ahead of the commands, nothing a command runs can read
+   the input itself: not a nested prompt, not a `<<TERM` payload, whose lines
+   the reader would already have taken as commands, and not a streaming
+   command, which would only get its line once the reader had read all of it.
+   imcli_pipeline_start refuses registries with payload or stream handlers.
+   Commands that wait for another line with imcli_await_words are fine, as
+   long as every line taken from the pipeline is dispatched, since the next
+   one goes to them. */
+struct imcli_pipeline {
+    struct imcli_session *session;
+    thrd_t reader;
+
+    /* Lines that have been split but not taken yet. Only the reader moves
+       head, and only the dispatcher moves tail, so neither needs a lock. */
+    struct imcli_pipeline_slot slots[IMCLI_PIPELINE_SLOTS];
+    atomic_uint head;
+    atomic_uint tail;
+
+    atomic_bool input_done;
+    atomic_bool stopping;
+
+    /* Only used once a side has given up spinning. */
+    mtx_t lock;
+    cnd_t changed;
+    atomic_int sleepers;
+};
+
+/* Whether the reader has room for another line, or the dispatcher has a line
+   to take, or either has a reason to stop waiting. */
+IMCLI_DEF bool imcli_pipeline_ready(struct imcli_pipeline *pipeline, bool reader) {
+    unsigned head = atomic_load_explicit(&pipeline->head, memory_order_acquire);
+    unsigned tail = atomic_load_explicit(&pipeline->tail, memory_order_acquire);
+    if (reader) {
+        return head - tail != IMCLI_PIPELINE_SLOTS
+            || atomic_load(&pipeline->stopping);
+    }
+    return head != tail || atomic_load(&pipeline->input_done);
+}
+
+/* Waits a little, for whichever side it is to become ready. spins counts the
+   calls in one wait, starting at 0. */
+IMCLI_DEF void imcli_pipeline_wait(
+    struct imcli_pipeline *pipeline,
+    bool reader,
+    int *spins
+) {
+    if (*spins < IMCLI_PIPELINE_SPINS) {
+        *spins += 1;
+        thrd_yield();
+        return;
+    }
+    /* else sleep until woken */
+
+    mtx_lock(&pipeline->lock);
+    /* Counting ourselves before checking again pairs with the fence in
+       imcli_pipeline_wake, so that one of us always sees the other. */
+    atomic_fetch_add(&pipeline->sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!imcli_pipeline_ready(pipeline, reader)) {
+        cnd_wait(&pipeline->changed, &pipeline->lock);
+    }
+    atomic_fetch_sub(&pipeline->sleepers, 1);
+    mtx_unlock(&pipeline->lock);
+}
+
+/* Wakes either side, if it is asleep, after something it might be waiting on
+   has changed. While both are busy, this costs a fence and a load. */
+IMCLI_DEF void imcli_pipeline_wake(struct imcli_pipeline *pipeline) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pipeline->sleepers, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    mtx_lock(&pipeline->lock);
+    cnd_broadcast(&pipeline->changed);
+    mtx_unlock(&pipeline->lock);
+}
+
+IMCLI_DEF int imcli_pipeline_reader(void *data) {
+    struct imcli_pipeline *pipeline = data;
+    struct imcli_session *session = pipeline->session;
+
+    while (!atomic_load(&pipeline->stopping)) {
+        char_buffer line = read_line(session);
+        bool at_end = feof(session->input) || ferror(session->input);
+
+        struct imcli_pipeline_slot slot = {0};
+        if (memchr(line, '$', arrlen(line))) {
+            memcpy(arraddnptr(slot.line, arrlen(line)), line, arrlen(line));
+        } else {
+            slot.words = split_words(line);
+        }
+
+        /* Blank lines would be skipped by prompt anyway. */
+        if (slot.line || arrlen(slot.words) > 0) {
+            unsigned head = atomic_load_explicit(
+                &pipeline->head,
+                memory_order_relaxed
+            );
+            /* Wait for the dispatcher to make room. */
+            int spins = 0;
+            while (head - atomic_load_explicit(
+                &pipeline->tail,
+                memory_order_acquire
+            ) == IMCLI_PIPELINE_SLOTS) {
+                if (atomic_load(&pipeline->stopping)) {
+                    sbfree(&slot.words);
+                    arrfree(slot.line);
+                    return 0;
+                }
+                imcli_pipeline_wait(pipeline, true, &spins);
+            }
+
+            pipeline->slots[head % IMCLI_PIPELINE_SLOTS] = slot;
+            atomic_store_explicit(
+                &pipeline->head,
+                head + 1,
+                memory_order_release
+            );
+            imcli_pipeline_wake(pipeline);
+        }
+
+        if (at_end) break;
+    }
+
+    atomic_store_explicit(&pipeline->input_done, true, memory_order_release);
+    imcli_pipeline_wake(pipeline);
+    return 0;
+}
+
+/* Whether every command in the registry can run on lines from a pipeline;
+   see struct imcli_pipeline. */
+IMCLI_DEF bool imcli_pipeline_supports(struct imcli_registry *registry) {
+    int command_count = arrlen(registry->commands);
+    for (int i = 0; i < command_count; i++) {
+        struct imcli_command *command = &registry->commands[i];
+        if (command->payload_handler || command->stream_handler) return false;
+    }
+    return true;
+}
+
+/* Starts reading the session's input on a new thread, for lines to run
+   against the registry. Until the pipeline is stopped, that thread owns the
+   session's input side, so the caller should only use the session's output,
+   and its variables. Returns false if the registry has commands that need
+   the input themselves, or the thread couldn't be started; either way the
+   caller can read lines with prompt instead. */
+IMCLI_DEF bool imcli_pipeline_start(
+    struct imcli_pipeline *pipeline,
+    struct imcli_session *session,
+    struct imcli_registry *registry
+) {
+    if (!imcli_pipeline_supports(registry)) return false;
+
+    pipeline->session = session;
+    atomic_init(&pipeline->head, 0);
+    atomic_init(&pipeline->tail, 0);
+    atomic_init(&pipeline->input_done, false);
+    atomic_init(&pipeline->stopping, false);
+    atomic_init(&pipeline->sleepers, 0);
+
+    if (mtx_init(&pipeline->lock, mtx_plain) != thrd_success) return false;
+    if (cnd_init(&pipeline->changed) != thrd_success) {
+        mtx_destroy(&pipeline->lock);
+        return false;
+    }
+
+    if (thrd_create(
+        &pipeline->reader,
+        imcli_pipeline_reader,
+        pipeline
+    ) != thrd_success) {
+        cnd_destroy(&pipeline->changed);
+        mtx_destroy(&pipeline->lock);
+        return false;
+    }
+    return true;
+}
+
+/* Takes the next non-empty line, waiting for the reader if it hasn't got
+   there yet. Returns false once the input has run out and every line has been
+   taken. The words belong to the caller, same as with prompt. */
+IMCLI_DEF bool imcli_pipeline_next(
+    struct imcli_pipeline *pipeline,
+    string_buffer *words_out
+) {
+    while (true) {
+        unsigned tail = atomic_load_explicit(
+            &pipeline->tail,
+            memory_order_relaxed
+        );
+
+        int spins = 0;
+        while (tail == atomic_load_explicit(
+            &pipeline->head,
+            memory_order_acquire
+        )) {
+            if (atomic_load_explicit(
+                &pipeline->input_done,
+                memory_order_acquire
+            )) {
+                /* The reader might have pushed one last line before
+                   finishing. */
+                if (tail == atomic_load_explicit(
+                    &pipeline->head,
+                    memory_order_acquire
+                )) {
+                    return false;
+                }
+                break;
+            }
+            imcli_pipeline_wait(pipeline, false, &spins);
+        }
+
+        struct imcli_pipeline_slot slot =
+            pipeline->slots[tail % IMCLI_PIPELINE_SLOTS];
+        atomic_store_explicit(&pipeline->tail, tail + 1, memory_order_release);
+        imcli_pipeline_wake(pipeline);
+
+        if (!slot.line) {
+            *words_out = slot.words;
+            return true;
+        }
+        /* else split it here, now that the lines before it have run */
+
+        string_buffer words = imcli_split_line(pipeline->session, slot.line);
+        arrfree(slot.line);
+        if (arrlen(words) > 0) {
+            *words_out = words;
+            return true;
+        }
+        /* else it was only empty variables, so skip it like a blank line */
+        arrfree(words);
+    }
+}
+
+/* Stops the reader and frees any lines it read that were never taken. If the
+   reader is in the middle of reading a line, this waits for that line. */
+IMCLI_DEF void imcli_pipeline_stop(struct imcli_pipeline *pipeline) {
+    atomic_store(&pipeline->stopping, true);
+    imcli_pipeline_wake(pipeline);
+    thrd_join(pipeline->reader, NULL);
+
+    cnd_destroy(&pipeline->changed);
+    mtx_destroy(&pipeline->lock);
+
+    unsigned head = atomic_load(&pipeline->head);
+    for (unsigned i = atomic_load(&pipeline->tail); i != head; i++) {
+        sbfree(&pipeline->slots[i % IMCLI_PIPELINE_SLOTS].words);
+        arrfree(pipeline->slots[i % IMCLI_PIPELINE_SLOTS].line);
+    }
+}
+
+#endif
+
+/* Besides lines of text, commands can arrive as binary frames, for programs
+   that would otherwise build a line only for it to be split up again. All
+   numbers are 32 bit little endian:
+
+       frame length, not counting itself
+       command index in the registry, or IMCLI_FRAME_BY_KEYWORD
+       argument count
+       for each argument: its length, then its bytes
+
+   With a command index, the arguments go straight to the handler, without
+   matching any keywords. With IMCLI_FRAME_BY_KEYWORD, the arguments are the
+   whole line's words, keywords included, and get dispatched like text. */
+#define IMCLI_FRAME_BY_KEYWORD 0xffffffffu
+
+/* Bigger frames are treated as garbage rather than allocated. */
+#ifndef IMCLI_FRAME_LIMIT
+#define IMCLI_FRAME_LIMIT (64u << 20)
+#endif
+
+IMCLI_DEF uint32_t imcli_get_u32(const char *data) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8
+        | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+IMCLI_DEF void imcli_put_u32(char_buffer *out, uint32_t value) {
+    char *spot = arraddnptr(*out, 4);
+    spot[0] = (char)(value & 0xff);
+    spot[1] = (char)(value >> 8 & 0xff);
+    spot[2] = (char)(value >> 16 & 0xff);
+    spot[3] = (char)(value >> 24 & 0xff);
+}
+
+/* Appends a frame to out, for clients that want to send one. */
+IMCLI_DEF void imcli_encode_frame(
+    char_buffer *out,
+    uint32_t command,
+    int argc,
+    char **argv
+) {
+    int length_at = arrlen(*out);
+    imcli_put_u32(out, 0);
+
+    imcli_put_u32(out, command);
+    imcli_put_u32(out, argc);
+    for (int i = 0; i < argc; i++) {
+        uint32_t len = strlen(argv[i]);
+        imcli_put_u32(out, len);
+        if (len) memcpy(arraddnptr(*out, len), argv[i], len);
+    }
+
+    /* Now that we know how long it is. */
+    uint32_t length = arrlen(*out) - length_at - 4;
+    char_buffer length_bytes = NULL;
+    imcli_put_u32(&length_bytes, length);
+    memcpy(&(*out)[length_at], length_bytes, 4);
+    arrfree(length_bytes);
+}
+
+/* Decodes the body of one frame, everything after its length. Returns false
+   if it doesn't fit together. Empty arguments are kept, like `""` on a
+   command line, since a frame can say exactly what it means. */
+IMCLI_DEF bool imcli_decode_frame_body(
+    const char *body,
+    uint32_t length,
+    uint32_t *command_out,
+    string_buffer *words_out
+) {
+    if (length < 8) return false;
+
+    uint32_t command = imcli_get_u32(body);
+    uint32_t arg_count = imcli_get_u32(body + 4);
+
+    /* Every argument needs at least its length. */
+    if (arg_count > (length - 8) / 4) return false;
+
+    string_buffer words = NULL;
+    arrsetcap(words, arg_count);
+
+    uint32_t at = 8;
+    for (uint32_t i = 0; i < arg_count; i++) {
+        if (length - at < 4) {
+            sbfree(&words);
+            return false;
+        }
+        uint32_t len = imcli_get_u32(body + at);
+        at += 4;
+        if (len > length - at) {
+            sbfree(&words);
+            return false;
+        }
+
+        char_buffer word = NULL;
+        arrsetcap(word, len + 1);
+        if (len > 0) memcpy(arraddnptr(word, len), body + at, len);
+        arrpush(word, '\0');
+        arrpop(word);
+        arrpush(words, word);
+        at += len;
+    }
+
+    *command_out = command;
+    *words_out = words;
+    return true;
+}
+
+/* Takes a whole frame out of the bytes given to imcli_feed, the same way
+   imcli_take_line takes lines; a session should be fed one or the other.
+   Returns 1 for a frame, 0 if more bytes are needed, or -1 if the bytes
+   aren't frames, after which the stream can't be trusted any more. */
+IMCLI_DEF int imcli_take_frame(
+    struct imcli_session *session,
+    uint32_t *command_out,
+    string_buffer *words_out
+) {
+    int start = session->pending_start;
+    int available = arrlen(session->pending) - start;
+
+    if (available < 4) return 0;
+    uint32_t length = imcli_get_u32(&session->pending[start]);
+    if (length > IMCLI_FRAME_LIMIT) return -1;
+    if ((uint32_t)available - 4 < length) return 0;
+
+    if (!imcli_decode_frame_body(
+        &session->pending[start + 4],
+        length,
+        command_out,
+        words_out
+    )) {
+        return -1;
+    }
+
+    session->pending_start = start + 4 + length;
+    if (session->pending_scanned < session->pending_start) {
+        session->pending_scanned = session->pending_start;
+    }
+
+    if (session->pending_start == arrlen(session->pending)) {
+        arrsetlen(session->pending, 0);
+        session->pending_start = 0;
+        session->pending_scanned = 0;
+    }
+
+    return 1;
+}
+
+/* Reads one frame from the session's input, which can be a pipe, a file or a
+   socket opened with fdopen. Returns 1 for a frame, 0 at the end of the
+   input, or -1 if what was read isn't a frame. */
+IMCLI_DEF int imcli_read_frame(
+    struct imcli_session *session,
+    uint32_t *command_out,
+    string_buffer *words_out
+) {
+    char length_bytes[4];
+    size_t got = fread(length_bytes, 1, 4, session->input);
+    if (got == 0) return 0;
+    if (got < 4) return -1;
+
+    uint32_t length = imcli_get_u32(length_bytes);
+    if (length > IMCLI_FRAME_LIMIT) return -1;
+
+    /* The body goes in the line buffer, which is reused anyway. */
+    arrsetlen(session->line, length);
+    if (fread(session->line, 1, length, session->input) != length) return -1;
+
+    bool ok = imcli_decode_frame_body(
+        session->line,
+        length,
+        command_out,
+        words_out
+    );
+    arrsetlen(session->line, 0);
+
+    return ok ? 1 : -1;
+}
+
+/* Runs a decoded frame. Frames naming a command with a plain handler skip
+   straight to it; anything else, like keyword frames, commands that stream
+   or take payloads, or an answer to a command's question, is dispatched the
+   same as a line of text would be, so text and frames share every handler. */
+IMCLI_DEF bool imcli_dispatch_frame(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    uint32_t command_index,
+    string_buffer *words
+) {
+    if (command_index == IMCLI_FRAME_BY_KEYWORD || session->continuation) {
+        return imcli_dispatch(session, registry, words);
+    }
+
+    if (command_index >= (uint32_t)arrlen(registry->commands)) {
+        char number[16];
+        snprintf(number, sizeof(number), "%u", (unsigned)command_index);
+        imcli_message_about(session, "error",
+            imcli_about(number),
+            "Unknown command number %s.\n", number);
+        return true;
+    }
+
+    struct imcli_command *command = &registry->commands[command_index];
+
+    bool plain = command->handler && !command->payload_handler
+        && !(command->flags & IMCLI_BACKGROUND);
+    bool complain = (command->flags & IMCLI_NO_ARGS) && arrlen(*words) > 0;
+
+    if (!plain || complain) {
+        /* Put the keywords back on the front, and let dispatch sort it out. */
+        string_buffer keywords = split_words_n(
+            command->keywords,
+            strlen(command->keywords)
+        );
+        int keyword_count = arrlen(keywords);
+        arrinsn(*words, 0, keyword_count);
+        memcpy(*words, keywords, keyword_count * sizeof(*keywords));
+        arrfree(keywords);
+
+        return imcli_dispatch(session, registry, words);
+    }
+
+    return command->handler(session, words, command->userdata);
+}
+
+/* A registry image holds everything about a registry except its handlers:
+   keywords, help messages and flags. Every reference inside it is an offset
+   from the start of the image, so it can be written to a file or to shared
+   memory, and used from wherever it ends up mapped. */
+#define IMCLI_IMAGE_VERSION 1
+#define IMCLI_IMAGE_NONE ((uint64_t)-1)
+
+struct imcli_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t command_count;
+    uint64_t size;
+};
+
+struct imcli_image_command {
+    /* Offsets of null terminated strings, or IMCLI_IMAGE_NONE. */
+    uint64_t keywords;
+    uint64_t help_message;
+    uint64_t detailed_help_message;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+/* What an image leaves out: the parts of a command that only make sense
+   inside one process. */
+struct imcli_binding {
+    imcli_handler handler;
+    void *userdata;
+};
+
+IMCLI_DEF uint64_t imcli_image_string(
+    char *image,
+    size_t *cursor,
+    const char *str
+) {
+    if (!str) return IMCLI_IMAGE_NONE;
+
+    size_t offset = *cursor;
+    size_t len = strlen(str) + 1;
+    if (image) memcpy(&image[offset], str, len);
+    *cursor += len;
+
+    return offset;
+}
+
+/* Writes an image of the registry into the buffer, if it is big enough, and
+   returns the size the image needs either way. Calling this with a NULL
+   buffer is how to find out the size. */
+IMCLI_DEF size_t imcli_registry_image(
+    struct imcli_registry *registry,
+    void *buffer,
+    size_t buffer_size
+) {
+    int command_count = arrlen(registry->commands);
+
+    size_t size = sizeof(struct imcli_image_header);
+    size += command_count * sizeof(struct imcli_image_command);
+    for (int i = 0; i < command_count; i++) {
+        struct imcli_command *command = &registry->commands[i];
+        size += strlen(command->keywords) + 1;
+        size += strlen(command->help_message) + 1;
+        if (command->detailed_help_message) {
+            size += strlen(command->detailed_help_message) + 1;
+        }
+    }
+
+    if (!buffer || buffer_size < size) return size;
+    /* else write it */
+
+    char *image = (char *)buffer;
+
+    struct imcli_image_header header = {0};
+    memcpy(header.magic, "imclireg", 8);
+    header.version = IMCLI_IMAGE_VERSION;
+    header.command_count = command_count;
+    header.size = size;
+    memcpy(image, &header, sizeof(header));
+
+    struct imcli_image_command *entries =
+        (struct imcli_image_command *)&image[sizeof(header)];
+    size_t cursor = sizeof(header) + command_count * sizeof(*entries);
+
+    for (int i = 0; i < command_count; i++) {
+        struct imcli_command *command = &registry->commands[i];
+        struct imcli_image_command entry = {0};
+        entry.keywords = imcli_image_string(image, &cursor, command->keywords);
+        entry.help_message = imcli_image_string(
+            image,
+            &cursor,
+            command->help_message
+        );
+        entry.detailed_help_message = imcli_image_string(
+            image,
+            &cursor,
+            command->detailed_help_message
+        );
+        entry.flags = command->flags;
+        memcpy(&entries[i], &entry, sizeof(entry));
+    }
+
+    return size;
+}
+
+IMCLI_DEF char *imcli_image_lookup(
+    const char *image,
+    size_t size,
+    uint64_t offset
+) {
+    if (offset == IMCLI_IMAGE_NONE) return NULL;
+    if (offset >= size) return NULL;
+    /* Make sure the string ends inside the image. */
+    if (!memchr(&image[offset], '\0', size - offset)) return NULL;
+    return (char *)&image[offset];
+}
+
+/* Fills in a registry whose strings all point into the image, giving each
+   command the handler at the same index in bindings, so bindings has to be
+   in the order the commands were registered in. Only the array of commands
+   is allocated; the image has to stay mapped for as long as the registry is
+   used, and must not be written to. Returns false, leaving the registry
+   empty, if the image is damaged or doesn't have binding_count commands. */
+IMCLI_DEF bool imcli_registry_from_image(
+    struct imcli_registry *registry,
+    const void *image_data,
+    size_t size,
+    struct imcli_binding *bindings,
+    int binding_count
+) {
+    const char *image = (const char *)image_data;
+    registry->commands = NULL;
+
+    struct imcli_image_header header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, image, sizeof(header));
+
+    if (memcmp(header.magic, "imclireg", 8) != 0) return false;
+    if (header.version != IMCLI_IMAGE_VERSION) return false;
+    if (header.size != size) return false;
+    if (header.command_count != (uint32_t)binding_count) return false;
+    if (header.command_count > (size - sizeof(header))
+        / sizeof(struct imcli_image_command)) return false;
+
+    const struct imcli_image_command *entries =
+        (const struct imcli_image_command *)&image[sizeof(header)];
+
+    arrsetcap(registry->commands, binding_count);
+    for (int i = 0; i < binding_count; i++) {
+        struct imcli_image_command entry;
+        memcpy(&entry, &entries[i], sizeof(entry));
+
+        struct imcli_command command = {0};
+        command.keywords = imcli_image_lookup(image, size, entry.keywords);
+        command.help_message = imcli_image_lookup(
+            image,
+            size,
+            entry.help_message
+        );
+        command.detailed_help_message = imcli_image_lookup(
+            image,
+            size,
+            entry.detailed_help_message
+        );
+        command.flags = entry.flags;
+        command.handler = bindings[i].handler;
+        command.userdata = bindings[i].userdata;
+
+        if (!command.keywords || !command.help_message) {
+            arrfree(registry->commands);
+            return false;
+        }
+
+        arrpush(registry->commands, command);
+    }
+
+    return true;
+}
+
+#ifdef IMCLI_SHARED_MEMORY
+
+/* Writes the registry's image to a read-only POSIX shared memory object with
+   the given name, like "/my_cli_registry", replacing any image that was
+   published there before. Other processes can then use imcli_registry_attach
+   instead of each building and keeping their own copy of every keyword and
+   help message. Returns the mapped image, or NULL on failure; either way the
+   caller can keep using its own registry.
+
+   Processes that attached to an earlier image keep it. One that attaches
+   while this is still writing gets NULL from imcli_registry_attach, since the
+   image's magic only goes in once everything else is there, and can build its
+   own registry or try again. */
+IMCLI_DEF void *imcli_registry_publish(
+    struct imcli_registry *registry,
+    char *name,
+    size_t *size_out
+) {
+    size_t size = imcli_registry_image(registry, NULL, 0);
+
+    /* The old object stays mapped in any process using it, but from here on
+       the name refers to the new one, which starts out empty. */
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) return NULL;
+
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    void *image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    /* Written everywhere but the magic, then the magic. */
+    char_buffer copy = NULL;
+    arrsetlen(copy, size);
+    imcli_registry_image(registry, copy, size);
+    memcpy((char *)image + 8, copy + 8, size - 8);
+    IMCLI_RELEASE_FENCE();
+    memcpy(image, copy, 8);
+    arrfree(copy);
+
+    mprotect(image, size, PROT_READ);
+
+    *size_out = size;
+    return image;
+}
+
+/* Maps an image that another process published, read-only. Returns NULL if
+   there isn't one, or it is still being written. */
+IMCLI_DEF void *imcli_registry_attach(char *name, size_t *size_out) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *image = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) return NULL;
+
+    if (info.st_size < 8 || memcmp(image, "imclireg", 8) != 0) {
+        munmap(image, info.st_size);
+        return NULL;
+    }
+    IMCLI_ACQUIRE_FENCE();
+
+    *size_out = info.st_size;
+    return image;
+}
+
+IMCLI_DEF void imcli_registry_detach(void *image, size_t size) {
+    munmap(image, size);
+}
+
+#endif
+
+/* A compiled script is a script that has already been split into words and
+   matched against a registry, so that replaying it only runs handlers. Each
+   non-empty line becomes an op naming the command it runs, and pointing at
+   its words in a shared table, with the text of every word in one string
+   table after that. Like registry images, it only uses offsets, so it can be
+   cached in a file. */
+#define IMCLI_SCRIPT_VERSION 3
+/* The line isn't a plain command, e.g. help, so replay dispatches it. */
+#define IMCLI_SCRIPT_DISPATCH 0xffffffffu
+/* The line uses `$`, `;` or `|`, which mean something different each time it
+   runs, so its one word is the whole line, which replay splits, with the
+   session's variables, and runs with imcli_dispatch_line. */
+#define IMCLI_SCRIPT_LINE 0xfffffffeu
+/* The line has no `<<TERM` block after it. */
+#define IMCLI_SCRIPT_NO_PAYLOAD 0xffffffffu
+
+struct imcli_script_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t op_count;
+    uint64_t size;
+    /* Scripts compiled against a different set of commands can't be
+       replayed, since command numbers would mean something else. */
+    uint64_t registry_hash;
+    uint64_t source_hash;
+    uint32_t word_count;
+    uint32_t reserved;
+};
+
+struct imcli_script_op {
+    uint32_t command;
+    uint32_t first_word;
+    uint32_t word_count;
+    /* Words at the start of the line that matched the command's keywords,
+       and aren't passed to its handler. */
+    uint32_t keyword_count;
+    /* The word holding the block that followed the line, which its payload
+       reads during replay, or IMCLI_SCRIPT_NO_PAYLOAD. */
+    uint32_t payload_word;
+};
+
+struct imcli_script_word {
+    uint32_t offset;
+    uint32_t length;
+};
+
+/* Identifies the registry's commands, in order, along with their keywords,
+   help and flags. Returns 0, which no registry hashes to, if there wasn't the
+   memory to work it out; no script is valid against that. */
+IMCLI_DEF uint64_t imcli_registry_hash(struct imcli_registry *registry) {
+    size_t size = imcli_registry_image(registry, NULL, 0);
+    char *image = (char *)malloc(size);
+    if (!image) return 0;
+    imcli_registry_image(registry, image, size);
+
+    uint64_t hash = stbds_hash_bytes(image, size, 0);
+    if (hash == 0) hash = 1;
+
+    free(image);
+    return hash;
+}
+
+/* Whether running the command changes what later lines of a script mean, by
+   defining or removing aliases or variables, so that those lines can't be
+   matched to commands ahead of time. */
+IMCLI_DEF bool imcli_changes_later_lines(struct imcli_command *command) {
+    return command->handler == imcli_alias_command
+        || command->handler == imcli_unalias_command
+        || command->handler == imcli_set_command
+        || command->handler == imcli_unset_command;
+}
+
+/* Like imcli_changes_later_lines, for a line with `;` or `|` in it, which can
+   run any number of commands, or `$` in it, which can make a variable's
+   value the command. */
+IMCLI_DEF bool imcli_line_changes_later_lines(
+    struct imcli_registry *registry,
+    const char *line,
+    int line_len
+) {
+    string_buffer words = imcli_split_separators(split_words_n(line, line_len));
+
+    bool changes = false;
+    int word_count = arrlen(words);
+    int stage_start = 0;
+    for (int i = 0; i <= word_count && !changes; i++) {
+        bool end = i == word_count
+            || imcli_is_separator(words[i], ';')
+            || imcli_is_separator(words[i], '|');
+        if (!end) continue;
+
+        if (i > stage_start && words[stage_start][0] == '$') changes = true;
+
+        string_buffer stage = NULL;
+        for (int j = stage_start; j < i; j++) arrpush(stage, words[j]);
+        struct imcli_command *command = imcli_find_command(registry, stage);
+        if (command && imcli_changes_later_lines(command)) changes = true;
+        arrfree(stage);
+
+        stage_start = i + 1;
+    }
+
+    sbfree(&words);
+    return changes;
+}
+
+/* Compiles a script, one command per line, against the registry. Lines with
+   variables, `;` or `|` are kept whole, and run as a prompt would run them,
+   and a `<<TERM` block is kept with the line it follows. Once a line defines
+   or removes an alias or a variable, every line after it is left for replay
+   to dispatch, since what it runs can't be known until then.
+   The result is a stb array of bytes that imcli_replay_script can run any
+   number of times, and can be saved with fwrite. */
+IMCLI_DEF char *imcli_compile_script(
+    struct imcli_registry *registry,
+    char *script,
+    size_t script_len
+) {
+    struct imcli_script_op *ops = NULL;
+    struct imcli_script_word *words_table = NULL;
+    char *strings = NULL;
+
+    /* Set once a line changes what later lines mean. */
+    bool dynamic = false;
+
+    size_t line_start = 0;
+    while (line_start < script_len) {
+        size_t line_end = line_start;
+        while (line_end < script_len && script[line_end] != '\n') line_end++;
+
+        char *line = &script[line_start];
+        int line_len = line_end - line_start;
+        line_start = line_end + 1;
+
+        string_buffer words = split_words_n(line, line_len);
+
+        int word_count = arrlen(words);
+        if (word_count == 0) continue;
+
+        struct imcli_script_op op;
+        op.command = IMCLI_SCRIPT_DISPATCH;
+        op.first_word = arrlen(words_table);
+        op.word_count = word_count;
+        op.keyword_count = 0;
+        op.payload_word = IMCLI_SCRIPT_NO_PAYLOAD;
+
+        /* The block runs up to the terminator's line, or the end of the
+           script, just as a payload reads it from the input. */
+        bool has_payload = imcli_heredoc_command(registry, words) != NULL;
+        size_t payload_start = line_start < script_len ? line_start : script_len;
+        size_t payload_end = payload_start;
+        if (has_payload) {
+            char *terminator = &words[word_count - 1][2];
+            size_t terminator_len = strlen(terminator);
+
+            payload_end = script_len;
+            while (line_start < script_len) {
+                size_t end = line_start;
+                while (end < script_len && script[end] != '\n') end++;
+
+                bool found = end - line_start == terminator_len
+                    && memcmp(&script[line_start], terminator, terminator_len) == 0;
+                if (found) payload_end = line_start;
+                line_start = end + 1;
+                if (found) break;
+            }
+        }
+
+        bool whole_line = memchr(line, '$', line_len)
+            || memchr(line, ';', line_len)
+            || memchr(line, '|', line_len);
+        if (whole_line) {
+            if (imcli_line_changes_later_lines(registry, line, line_len)) {
+                dynamic = true;
+            }
+
+            sbfree(&words);
+            char_buffer text = NULL;
+            memcpy(arraddnptr(text, line_len), line, line_len);
+            arrpush(words, text);
+
+            word_count = 1;
+            op.command = IMCLI_SCRIPT_LINE;
+            op.word_count = word_count;
+        }
+
+        struct imcli_command *command = NULL;
+        if (!whole_line) command = imcli_find_command(registry, words);
+        if (command && !dynamic && imcli_changes_later_lines(command)) {
+            /* This line still runs its command, but nothing after it. */
+            dynamic = true;
+            command = NULL;
+        }
+        if (command && !dynamic) {
+            int keyword_count = count_keyword_matches(words, command->keywords);
+            bool complain = (command->flags & IMCLI_NO_ARGS)
+                && keyword_count < word_count;
+            /* The complaint comes from dispatching, so leave that to replay;
+               so do background commands, which need a job list, and
+               commands that only stream or take payloads. */
+            bool plain = command->handler && !command->payload_handler
+                && !(command->flags & IMCLI_BACKGROUND);
+            if (!complain && plain) {
+                op.command = (uint32_t)(command - registry->commands);
+                op.keyword_count = keyword_count;
+            }
+        }
+
+        for (int i = 0; i < word_count; i++) {
+            struct imcli_script_word word;
+            word.offset = arrlen(strings);
+            word.length = arrlen(words[i]);
+            memcpy(arraddnptr(strings, word.length), words[i], word.length);
+            arrpush(strings, '\0');
+            arrpush(words_table, word);
+        }
+
+        if (has_payload) {
+            struct imcli_script_word block;
+            block.offset = arrlen(strings);
+            block.length = payload_end - payload_start;
+            if (block.length) {
+                memcpy(arraddnptr(strings, block.length),
+                    &script[payload_start], block.length);
+            }
+            arrpush(strings, '\0');
+
+            op.payload_word = arrlen(words_table);
+            arrpush(words_table, block);
+        }
+
+        arrpush(ops, op);
+        sbfree(&words);
+    }
+
+    struct imcli_script_header header = {0};
+    memcpy(header.magic, "imclibc1", 8);
+    header.version = IMCLI_SCRIPT_VERSION;
+    header.op_count = arrlen(ops);
+    header.registry_hash = imcli_registry_hash(registry);
+    header.source_hash = stbds_hash_bytes(script, script_len, 0);
+    header.word_count = arrlen(words_table);
+
+    size_t ops_size = arrlen(ops) * sizeof(*ops);
+    size_t words_size = arrlen(words_table) * sizeof(*words_table);
+    header.size = sizeof(header) + ops_size + words_size + arrlen(strings);
+
+    char *compiled = NULL;
+    arrsetcap(compiled, header.size);
+    memcpy(arraddnptr(compiled, sizeof(header)), &header, sizeof(header));
+    if (ops_size) memcpy(arraddnptr(compiled, ops_size), ops, ops_size);
+    if (words_size) {
+        memcpy(arraddnptr(compiled, words_size), words_table, words_size);
+    }
+    if (arrlen(strings)) {
+        memcpy(arraddnptr(compiled, arrlen(strings)), strings, arrlen(strings));
+    }
+
+    arrfree(ops);
+    arrfree(words_table);
+    arrfree(strings);
+
+    return compiled;
+}
+
+/* Checks that a compiled script fits together, and was compiled against this
+   registry. Every offset is checked here, so replay doesn't have to. */
+IMCLI_DEF bool imcli_script_is_valid(
+    struct imcli_registry *registry,
+    uint64_t registry_hash,
+    const char *compiled,
+    size_t size
+) {
+    struct imcli_script_header header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, compiled, sizeof(header));
+
+    if (memcmp(header.magic, "imclibc1", 8) != 0) return false;
+    if (header.version != IMCLI_SCRIPT_VERSION) return false;
+    if (header.size != size) return false;
+    if (registry_hash == 0 || header.registry_hash != registry_hash) {
+        return false;
+    }
+
+    uint64_t tables_size = (uint64_t)header.op_count
+        * sizeof(struct imcli_script_op)
+        + (uint64_t)header.word_count * sizeof(struct imcli_script_word);
+    if (tables_size > size - sizeof(header)) return false;
+
+    const char *ops = compiled + sizeof(header);
+    const char *words = ops + header.op_count * sizeof(struct imcli_script_op);
+    const char *strings = words
+        + header.word_count * sizeof(struct imcli_script_word);
+    size_t strings_size = size - (strings - compiled);
+
+    for (uint32_t i = 0; i < header.op_count; i++) {
+        struct imcli_script_op op;
+        memcpy(&op, ops + i * sizeof(op), sizeof(op));
+
+        if (op.command == IMCLI_SCRIPT_LINE) {
+            if (op.word_count != 1) return false;
+        } else if (op.command != IMCLI_SCRIPT_DISPATCH
+            && op.command >= (uint32_t)arrlen(registry->commands)) return false;
+        if (op.first_word > header.word_count) return false;
+        if (op.word_count > header.word_count - op.first_word) return false;
+        if (op.keyword_count > op.word_count) return false;
+        if (op.payload_word != IMCLI_SCRIPT_NO_PAYLOAD
+            && op.payload_word >= header.word_count) return false;
+    }
+
+    for (uint32_t i = 0; i < header.word_count; i++) {
+        struct imcli_script_word word;
+        memcpy(&word, words + i * sizeof(word), sizeof(word));
+
+        if (word.offset > strings_size) return false;
+        if (word.length >= strings_size - word.offset) return false;
+    }
+
+    return true;
+}
+
+/* Copies an op's words, from the given one on, out of the string table. */
+IMCLI_DEF string_buffer imcli_script_words(
+    const char *words_table,
+    const char *strings,
+    struct imcli_script_op op,
+    uint32_t first
+) {
+    string_buffer words = NULL;
+    arrsetcap(words, op.word_count - first);
+
+    for (uint32_t w = first; w < op.word_count; w++) {
+        struct imcli_script_word word;
+        memcpy(
+            &word,
+            words_table + (op.first_word + w) * sizeof(word),
+            sizeof(word)
+        );
+
+        char_buffer text = NULL;
+        arrsetcap(text, word.length + 1);
+        memcpy(arraddnptr(text, word.length), &strings[word.offset], word.length);
+        arrpush(text, '\0');
+        arrpop(text);
+        arrpush(words, text);
+    }
+
+    return words;
+}
+
+/* How a replay went: every line ran, a command ended the session part way
+   through, or nothing ran because the script doesn't fit this registry and
+   needs compiling again. */
+enum imcli_replay_status {
+    IMCLI_REPLAY_DONE,
+    IMCLI_REPLAY_ENDED,
+    IMCLI_REPLAY_INVALID,
+};
+
+/* Runs a compiled script, straight from the op list: the words are already
+   split, and each command was already found, so this only copies each line's
+   arguments and calls its handler. */
+IMCLI_DEF enum imcli_replay_status imcli_replay_script(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    const char *compiled,
+    size_t size
+) {
+    if (!imcli_script_is_valid(
+        registry,
+        imcli_registry_hash(registry),
+        compiled,
+        size
+    )) {
+        return IMCLI_REPLAY_INVALID;
+    }
+
+    struct imcli_script_header header;
+    memcpy(&header, compiled, sizeof(header));
+
+    const char *ops = compiled + sizeof(header);
+    const char *words_table = ops
+        + header.op_count * sizeof(struct imcli_script_op);
+    const char *strings = words_table
+        + header.word_count * sizeof(struct imcli_script_word);
+
+    for (uint32_t i = 0; i < header.op_count; i++) {
+        struct imcli_script_op op;
+        memcpy(&op, ops + i * sizeof(op), sizeof(op));
+
+        /* A command waiting for an answer wants the whole line. */
+        bool dispatch = op.command == IMCLI_SCRIPT_DISPATCH
+            || (session->continuation && op.command != IMCLI_SCRIPT_LINE);
+
+        struct imcli_command *command = NULL;
+        if (!dispatch && op.command != IMCLI_SCRIPT_LINE) {
+            command = &registry->commands[op.command];
+
+            /* Aliases aren't part of what a compiled script is checked
+               against, so one defined since it was compiled still gets its
+               say. */
+            struct imcli_script_word first;
+            memcpy(
+                &first,
+                words_table + op.first_word * sizeof(first),
+                sizeof(first)
+            );
+            if (registry->aliases && registry->aliases->definitions
+                && shgeti(
+                    registry->aliases->definitions,
+                    &strings[first.offset]
+                ) >= 0) {
+                dispatch = true;
+                command = NULL;
+            }
+        }
+
+        if (op.payload_word != IMCLI_SCRIPT_NO_PAYLOAD) {
+            struct imcli_script_word block;
+            memcpy(
+                &block,
+                words_table + op.payload_word * sizeof(block),
+                sizeof(block)
+            );
+            session->script_payload = &strings[block.offset];
+            session->script_payload_size = block.length;
+        }
+
+        bool keep_going;
+        if (op.command == IMCLI_SCRIPT_LINE) {
+            struct imcli_script_word word;
+            memcpy(
+                &word,
+                words_table + op.first_word * sizeof(word),
+                sizeof(word)
+            );
+
+            string_buffer words = imcli_split_words_with_variables(
+                session,
+                (char *)&strings[word.offset],
+                word.length
+            );
+            keep_going = imcli_dispatch_line(session, registry, &words);
+            sbfree(&words);
+        } else if (dispatch) {
+            string_buffer words = imcli_script_words(
+                words_table,
+                strings,
+                op,
+                0
+            );
+            keep_going = imcli_dispatch(session, registry, &words);
+            sbfree(&words);
+        } else if (command->batch_handler) {
+            /* Hand the whole run of this command over at once. */
+            string_buffer *arg_sets = NULL;
+            uint32_t end = i;
+            while (end < header.op_count) {
+                struct imcli_script_op next;
+                memcpy(&next, ops + end * sizeof(next), sizeof(next));
+                if (next.command != op.command) break;
+
+                arrpush(arg_sets, imcli_script_words(
+                    words_table,
+                    strings,
+                    next,
+                    next.keyword_count
+                ));
+                end += 1;
+            }
+
+            keep_going = command->batch_handler(
+                session,
+                arg_sets,
+                arrlen(arg_sets),
+                command->userdata
+            );
+
+            for (int j = 0; j < arrlen(arg_sets); j++) sbfree(&arg_sets[j]);
+            arrfree(arg_sets);
+
+            i = end - 1;
+        } else {
+            string_buffer words = imcli_script_words(
+                words_table,
+                strings,
+                op,
+                op.keyword_count
+            );
+            keep_going = command->handler(session, &words, command->userdata);
+            sbfree(&words);
+        }
+
+        /* A block the line didn't get to is skipped, not read later. */
+        session->script_payload = NULL;
+
+        if (!keep_going) return IMCLI_REPLAY_ENDED;
+    }
+
+    return IMCLI_REPLAY_DONE;
+}
+
+/* Runs a script through a compiled copy cached in cache_dir, compiling and
+   saving it first if there isn't a usable one. The file is named after a hash
+   of the script and the registry, so an edited script, or a program with
+   different commands, just gets a different file. Only comes back with
+   IMCLI_REPLAY_INVALID if even a fresh compile can't be replayed, which means
+   there wasn't the memory to hash the registry. */
+IMCLI_DEF enum imcli_replay_status imcli_run_script_cached(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    char *script,
+    size_t script_len,
+    char *cache_dir
+) {
+    uint64_t registry_hash = imcli_registry_hash(registry);
+    uint64_t source_hash = stbds_hash_bytes(script, script_len, 0);
+
+    char path[4096];
+    snprintf(
+        path,
+        sizeof(path),
+        "%s/%016llx%016llx.imclibc",
+        cache_dir,
+        (unsigned long long)source_hash,
+        (unsigned long long)registry_hash
+    );
+
+    char *compiled = NULL;
+
+    FILE *cached = fopen(path, "rb");
+    if (cached) {
+        char chunk[4096];
+        size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), cached)) > 0) {
+            memcpy(arraddnptr(compiled, got), chunk, got);
+        }
+        fclose(cached);
+
+        struct imcli_script_header header;
+        bool usable = imcli_script_is_valid(
+            registry,
+            registry_hash,
+            compiled,
+            arrlen(compiled)
+        );
+        if (usable) {
+            memcpy(&header, compiled, sizeof(header));
+            usable = header.source_hash == source_hash;
+        }
+        if (!usable) arrsetlen(compiled, 0);
+    }
+
+    if (arrlen(compiled) == 0) {
+        arrfree(compiled);
+        compiled = imcli_compile_script(registry, script, script_len);
+
+        /* Written under a name of its own, and then renamed into place, so
+           that another process reading the cache never sees half a file. If
+           the cache can't be written, the script still runs. */
+#ifdef IMCLI_FD_SINKS
+        unsigned long writer = (unsigned long)getpid();
+#else
+        unsigned long writer = (unsigned long)time(NULL);
+#endif
+        char temp_path[4096 + 32];
+        snprintf(temp_path, sizeof(temp_path), "%s.%lx.tmp", path, writer);
+
+        FILE *out = fopen(temp_path, "wb");
+        if (out) {
+            size_t size = arrlen(compiled);
+            bool written = fwrite(compiled, 1, size, out) == size;
+            written = fclose(out) == 0 && written;
+
+            /* Windows won't rename over a file that is already there. */
+            if (written && rename(temp_path, path) != 0) {
+                remove(path);
+                written = rename(temp_path, path) == 0;
+            }
+            if (!written) remove(temp_path);
+        }
+    }
+
+    enum imcli_replay_status status = imcli_replay_script(
+        session,
+        registry,
+        compiled,
+        arrlen(compiled)
+    );
+    if (status == IMCLI_REPLAY_INVALID) {
+        /* Don't leave a script that can never replay in the cache. */
+        remove(path);
+        imcli_message(session, "error", "Couldn't run the script.\n");
+    }
+
+    arrfree(compiled);
+    return status;
+}
+
+#ifdef IMCLI_THREADS
+
+/* One parallel-safe command in a batch, with everything a worker needs to
+   run it. Its output goes into memory, and is copied to the batch's session
+   once the whole run is done. */
+struct imcli_batch_job {
+    struct imcli_registry *registry;
+    string_buffer *words;
+    bool json;
+    char_buffer output;
+    bool keep_going;
+};
+
+/* One worker's share of a run's jobs: jobs[head] up to jobs[tail] are still
+   to be run. The worker takes its own from the tail, and workers that have
+   run out of their own steal from the head. */
+struct imcli_batch_deque {
+    struct imcli_batch_pool *pool;
+    int index;
+
+    mtx_t lock;
+    struct imcli_batch_job **jobs;
+    int head;
+    int tail;
+};
+
+/* Threads kept around for running the parallel parts of batches, so that a
+   batch doesn't start and join threads for every run of parallel commands in
+   it. The thread running the batch works too, as worker 0. A pool runs one
+   batch at a time. A zeroed pool has no workers, and batches given one run
+   every line on the calling thread. */
+struct imcli_batch_pool {
+    thrd_t *threads;
+    struct imcli_batch_deque *deques;
+    int worker_count;
+
+    mtx_t lock;
+    /* Signalled when a run starts, or the pool stops. */
+    cnd_t work_ready;
+    /* Signalled when the last job of a run finishes. */
+    cnd_t work_done;
+    unsigned run_count;
+    bool stopping;
+    atomic_int unfinished;
+};
+
+IMCLI_DEF void imcli_batch_job_run(struct imcli_batch_job *job) {
+    struct imcli_session job_session = imcli_session_new(NULL, NULL);
+    job_session.json = job->json;
+    imcli_session_set_sink(&job_session, imcli_sink_memory(&job->output));
+
+    job->keep_going = imcli_dispatch_expanded(
+        &job_session,
+        job->registry,
+        job->words
+    );
+
+    imcli_session_free(&job_session);
+}
+
+/* Takes the next job for a worker: the newest of its own, or else the oldest
+   one some other worker hasn't got to yet. Returns NULL once there are none
+   left anywhere. */
+IMCLI_DEF struct imcli_batch_job *imcli_batch_take(
+    struct imcli_batch_pool *pool,
+    int index
+) {
+    for (int k = 0; k < pool->worker_count; k++) {
+        struct imcli_batch_deque *deque =
+            &pool->deques[(index + k) % pool->worker_count];
+        struct imcli_batch_job *job = NULL;
+
+        mtx_lock(&deque->lock);
+        if (deque->head < deque->tail) {
+            if (k == 0) job = deque->jobs[--deque->tail];
+            else job = deque->jobs[deque->head++];
+        }
+        mtx_unlock(&deque->lock);
+
+        if (job) return job;
+    }
+    return NULL;
+}
+
+/* Runs jobs until there are none left to take, so a slow job only holds up
+   the worker running it. */
+IMCLI_DEF void imcli_batch_work(struct imcli_batch_pool *pool, int index) {
+    struct imcli_batch_job *job;
+    while ((job = imcli_batch_take(pool, index))) {
+        imcli_batch_job_run(job);
+
+        if (atomic_fetch_sub(&pool->unfinished, 1) == 1) {
+            mtx_lock(&pool->lock);
+            cnd_broadcast(&pool->work_done);
+            mtx_unlock(&pool->lock);
+        }
+    }
+}
+
+IMCLI_DEF int imcli_batch_thread(void *data) {
+    struct imcli_batch_deque *own = data;
+    struct imcli_batch_pool *pool = own->pool;
+
+    unsigned seen = 0;
+    while (true) {
+        mtx_lock(&pool->lock);
+        while (pool->run_count == seen && !pool->stopping) {
+            cnd_wait(&pool->work_ready, &pool->lock);
+        }
+        bool stopping = pool->stopping;
+        seen = pool->run_count;
+        mtx_unlock(&pool->lock);
+
+        if (stopping) return 0;
+        imcli_batch_work(pool, own->index);
+    }
+}
+
+/* Starts thread_count - 1 threads, which wait for batches given the pool;
+   the thread running a batch makes up the rest. Returns false if the pool
+   couldn't be set up at all. If only some of the threads could be started,
+   the pool just has fewer workers. */
+IMCLI_DEF bool imcli_batch_pool_start(
+    struct imcli_batch_pool *pool,
+    int thread_count
+) {
+    pool->threads = NULL;
+    pool->deques = NULL;
+    pool->worker_count = 0;
+    pool->run_count = 0;
+    pool->stopping = false;
+    atomic_init(&pool->unfinished, 0);
+    if (thread_count < 1) thread_count = 1;
+
+    if (mtx_init(&pool->lock, mtx_plain) != thrd_success) return false;
+    if (cnd_init(&pool->work_ready) != thrd_success) {
+        mtx_destroy(&pool->lock);
+        return false;
+    }
+    if (cnd_init(&pool->work_done) != thrd_success) {
+        cnd_destroy(&pool->work_ready);
+        mtx_destroy(&pool->lock);
+        return false;
+    }
+
+    /* The threads point into this, so it has to be its full size before any
+       of them start. */
+    arrsetlen(pool->deques, thread_count);
+    int deque_count = 0;
+    for (; deque_count < thread_count; deque_count++) {
+        struct imcli_batch_deque *deque = &pool->deques[deque_count];
+        deque->pool = pool;
+        deque->index = deque_count;
+        deque->jobs = NULL;
+        deque->head = 0;
+        deque->tail = 0;
+        if (mtx_init(&deque->lock, mtx_plain) != thrd_success) break;
+    }
+
+    for (int t = 1; t < deque_count; t++) {
+        thrd_t thread;
+        if (thrd_create(
+            &thread,
+            imcli_batch_thread,
+            &pool->deques[t]
+        ) != thrd_success) break;
+        arrpush(pool->threads, thread);
+    }
+
+    /* Workers that didn't start never get any jobs. */
+    pool->worker_count = 1 + arrlen(pool->threads);
+    arrsetlen(pool->deques, deque_count);
+    return true;
+}
+
+/* Stops and joins the pool's threads, and frees the pool. */
+IMCLI_DEF void imcli_batch_pool_stop(struct imcli_batch_pool *pool) {
+    if (!pool->deques) return;
+
+    mtx_lock(&pool->lock);
+    pool->stopping = true;
+    cnd_broadcast(&pool->work_ready);
+    mtx_unlock(&pool->lock);
+
+    for (int t = 0; t < arrlen(pool->threads); t++) {
+        thrd_join(pool->threads[t], NULL);
+    }
+    arrfree(pool->threads);
+
+    for (int d = 0; d < arrlen(pool->deques); d++) {
+        mtx_destroy(&pool->deques[d].lock);
+        arrfree(pool->deques[d].jobs);
+    }
+    arrfree(pool->deques);
+    pool->worker_count = 0;
+
+    cnd_destroy(&pool->work_done);
+    cnd_destroy(&pool->work_ready);
+    mtx_destroy(&pool->lock);
+}
+
+/* Runs every job on the pool's workers, and returns once they are all done.
+   Each worker starts with a block of neighbouring jobs of its own. */
+IMCLI_DEF void imcli_batch_pool_run(
+    struct imcli_batch_pool *pool,
+    struct imcli_batch_job *jobs,
+    int job_count
+) {
+    atomic_store(&pool->unfinished, job_count);
+
+    int worker_count = pool->worker_count;
+    for (int w = 0; w < worker_count; w++) {
+        struct imcli_batch_deque *deque = &pool->deques[w];
+        int first = (int)((long long)job_count * w / worker_count);
+        int end = (int)((long long)job_count * (w + 1) / worker_count);
+
+        mtx_lock(&deque->lock);
+        arrsetlen(deque->jobs, 0);
+        for (int j = first; j < end; j++) arrpush(deque->jobs, &jobs[j]);
+        deque->head = 0;
+        deque->tail = end - first;
+        mtx_unlock(&deque->lock);
+    }
+
+    mtx_lock(&pool->lock);
+    pool->run_count += 1;
+    cnd_broadcast(&pool->work_ready);
+    mtx_unlock(&pool->lock);
+
+    imcli_batch_work(pool, 0);
+
+    mtx_lock(&pool->lock);
+    while (atomic_load(&pool->unfinished) > 0) {
+        cnd_wait(&pool->work_done, &pool->lock);
+    }
+    mtx_unlock(&pool->lock);
+}
+
+/* Expands aliases in lines, in order, up to and including lines[last], on
+   the thread running the session, so that batch workers never touch them.
+   *expanded counts the lines already done, so none is expanded twice. Lines
+   only get looked at ahead of running within a run of grouped or parallel
+   commands, and those don't change aliases. */
+IMCLI_DEF void imcli_expand_batch(
+    struct imcli_registry *registry,
+    string_buffer *lines,
+    int *expanded,
+    int last
+) {
+    for (; *expanded <= last; *expanded += 1) {
+        if (registry->aliases) {
+            imcli_apply_aliases(registry->aliases, &lines[*expanded]);
+        }
+    }
+}
+
+/* Runs a whole batch of lines, like a script, using the pool's workers for
+   runs of consecutive IMCLI_PARALLEL_SAFE commands. Each of those commands
+   writes into memory of its own, and that output is copied to the session's
+   output in script order, so the output is the same as if every line had
+   been run one at a time. Every other command runs on the calling thread,
+   between the parallel runs. With a NULL or zeroed pool, every line runs on
+   the calling thread.
+
+   A line ending in `<<TERM`, for a command with a payload handler, gets the
+   lines after it, up to the terminator, as its payload, each with its words
+   joined by single spaces.
+
+   The lines are freed as they are used. Returns false if a command ended the
+   session, in which case the lines after it aren't run. */
+IMCLI_DEF bool imcli_run_batch(
+    struct imcli_session *session,
+    struct imcli_registry *registry,
+    string_buffer *lines,
+    int line_count,
+    struct imcli_batch_pool *pool
+) {
+    bool keep_going = true;
+    struct imcli_batch_job *jobs = NULL;
+    int worker_count = pool ? pool->worker_count : 0;
+
+    int expanded = 0;
+    int i = 0;
+    while (i < line_count && keep_going) {
+        /* An answer to a command's question goes to it as it is. */
+        if (session->continuation) {
+            keep_going = imcli_dispatch_expanded(session, registry, &lines[i]);
+            i += 1;
+            if (expanded < i) expanded = i;
+            continue;
+        }
+
+        imcli_expand_batch(registry, lines, &expanded, i);
+
+        if (imcli_heredoc_command(registry, lines[i])) {
+            /* The lines up to the terminator are its block, not commands, so
+               put them back together for its payload. */
+            char *terminator = &arrlast(lines[i])[2];
+            char_buffer block = NULL;
+
+            int end = i + 1;
+            for (; end < line_count; end++) {
+                if (arrlen(lines[end]) == 1
+                    && strcmp(lines[end][0], terminator) == 0) break;
+
+                char_buffer text = join_words(lines[end]);
+                int len = arrlen(text);
+                if (len) memcpy(arraddnptr(block, len), text, len);
+                arrpush(block, '\n');
+                arrfree(text);
+            }
+
+            session->script_payload = block ? block : "";
+            session->script_payload_size = arrlen(block);
+            keep_going = imcli_dispatch_expanded(session, registry, &lines[i]);
+            session->script_payload = NULL;
+            arrfree(block);
+
+            i = end < line_count ? end + 1 : end;
+            if (expanded < i) expanded = i;
+            continue;
+        }
+
+        /* A batch handler should group lines by what they stand for. */
+        struct imcli_command *first = imcli_find_command(registry, lines[i]);
+        if (first && first->batch_handler) {
+            for (int end = i + 1; end < line_count; end++) {
+                imcli_expand_batch(registry, lines, &expanded, end);
+                if (imcli_find_command(registry, lines[end]) != first) break;
+            }
+        }
+
+        int grouped = imcli_dispatch_grouped(
+            session,
+            registry,
+            &lines[i],
+            line_count - i,
+            &keep_going
+        );
+        if (grouped) {
+            i += grouped;
+            continue;
+        }
+
+        int run_end = i;
+        while (run_end < line_count) {
+            imcli_expand_batch(registry, lines, &expanded, run_end);
+            struct imcli_command *command = imcli_find_command(
+                registry,
+                lines[run_end]
+            );
+            if (!command || !(command->flags & IMCLI_PARALLEL_SAFE)) break;
+            /* Better to run those together, as above. */
+            if (command->batch_handler) break;
+            run_end += 1;
+        }
+
+        if (run_end - i < 2 || worker_count < 2) {
+            /* Nothing to run alongside, so don't bother buffering. */
+            if (run_end == i) run_end = i + 1;
+            for (; i < run_end && keep_going; i++) {
+                keep_going = imcli_dispatch_expanded(
+                    session,
+                    registry,
+                    &lines[i]
+                );
+            }
+            continue;
+        }
+        /* else run them all at once */
+
+        int job_count = run_end - i;
+        arrsetlen(jobs, job_count);
+        for (int j = 0; j < job_count; j++) {
+            struct imcli_batch_job *job = &jobs[j];
+            job->registry = registry;
+            job->words = &lines[i + j];
+            job->json = session->json;
+            job->output = NULL;
+            job->keep_going = true;
+        }
+
+        imcli_batch_pool_run(pool, jobs, job_count);
+
+        /* Output is copied up to the first command that ended the session,
+           as though the ones after it had never run. */
+        for (int j = 0; j < job_count; j++) {
+            if (keep_going) {
+                imcli_write(session, jobs[j].output, arrlen(jobs[j].output));
+            }
+            arrfree(jobs[j].output);
+            keep_going = keep_going && jobs[j].keep_going;
+        }
+
+        i += job_count;
+    }
+
+    arrfree(jobs);
+
+    for (int j = 0; j < line_count; j++) sbfree(&lines[j]);
+
+    return keep_going;
+}
+
+#endif
+
+#if defined(IMCLI_PREFORK) || defined(IMCLI_SERVER)
+
+/* Sessions serving a socket write through a sink, but handlers written
+   before sinks existed write to session->output. This gives those sessions
+   an output file in memory, whose contents go on to the sink after each
+   line has run, behind whatever its commands wrote with imcli_write. */
+struct imcli_direct_output {
+    char *data;
+    size_t size;
+};
+
+/* Returns false if there wasn't the memory, in which case the session
+   shouldn't be served at all. */
+IMCLI_DEF bool imcli_direct_output_open(
+    struct imcli_session *session,
+    struct imcli_direct_output *direct
+) {
+    direct->data = NULL;
+    direct->size = 0;
+    session->output = open_memstream(&direct->data, &direct->size);
+    return session->output != NULL;
+}
+
+/* Passes on anything written to the output file since the last call. */
+IMCLI_DEF void imcli_direct_output_forward(
+    struct imcli_session *session,
+    struct imcli_direct_output *direct
+) {
+    fflush(session->output);
+    if (direct->size == 0) return;
+
+    imcli_write(session, direct->data, direct->size);
+
+    /* The size follows the position, so this empties it for the next
+       command. */
+    rewind(session->output);
+    fflush(session->output);
+}
+
+/* Anything not forwarded yet is dropped. */
+IMCLI_DEF void imcli_direct_output_close(
+    struct imcli_session *session,
+    struct imcli_direct_output *direct
+) {
+    fclose(session->output);
+    free(direct->data);
+    session->output = NULL;
+}
+
+#endif
+
+#ifdef IMCLI_PREFORK
+
+/* Runs a whole session over one connected socket, until the client hangs up
+   or a command ends the session. The socket is closed afterwards. The session
+   writes through a socket sink; anything handlers write to session->output
+   instead is sent after the rest of each line's output. */
+IMCLI_DEF void imcli_serve_fd(
+    struct imcli_registry *registry,
+    int fd,
+    const char *prompt_text
+) {
+    FILE *input = fdopen(fd, "r");
+    if (!input) {
+        close(fd);
+        return;
+    }
+
+    /* Output skips stdio, and goes out once per command, when the session
+       flushes before reading the next line. */
+    struct imcli_session session = imcli_session_new(input, NULL);
+    imcli_session_set_sink(&session, imcli_sink_socket(fd));
+
+    struct imcli_direct_output direct;
+    if (!imcli_direct_output_open(&session, &direct)) {
+        session.sink.write = NULL;
+        imcli_session_free(&session);
+        fclose(input);
+        return;
+    }
+
+    while (true) {
+        imcli_write(&session, prompt_text, strlen(prompt_text));
+        imcli_flush(&session);
+
+        /* Unlike prompt, this has to notice when the client goes away. */
+        char_buffer line = read_line(&session);
+        bool at_end = feof(input) || ferror(input);
+
+        string_buffer words = imcli_split_line(&session, line);
+
+        bool keep_going = true;
+        if (arrlen(words) > 0) {
+            keep_going = imcli_dispatch(&session, registry, &words);
+        }
+        imcli_direct_output_forward(&session, &direct);
+
+        sbfree(&words);
+
+        if (!keep_going || at_end) break;
+    }
+
+    imcli_direct_output_close(&session, &direct);
+    imcli_session_free(&session);
+    fclose(input);
+}
+
+/* Accepts connections one at a time, forever, or until accept fails. */
+IMCLI_DEF void imcli_prefork_worker(
+    struct imcli_registry *registry,
+    int listen_fd,
+    const char *prompt_text
+) {
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        imcli_serve_fd(registry, fd, prompt_text);
+    }
+}
+
+IMCLI_DEF pid_t imcli_prefork_spawn(
+    struct imcli_registry *registry,
+    int listen_fd,
+    const char *prompt_text
+) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        imcli_prefork_worker(registry, listen_fd, prompt_text);
+        _exit(0);
+    }
+    return pid;
+}
+
+/* Serves sessions on an already listening socket, from worker_count forked
+   processes that each accept connections in turn. Anything built before this
+   is called, like the registry and any stb_ds tables its commands use, is
+   built once and then shared by every worker, copy-on-write, so a new
+   session costs an accept rather than a process start, and each worker only
+   pays for the pages it actually writes to.
+
+   The calling process just replaces workers that exit. This only returns, with
+   false, if forking or waiting fails. */
+IMCLI_DEF bool imcli_prefork_serve(
+    struct imcli_registry *registry,
+    int listen_fd,
+    int worker_count,
+    const char *prompt_text
+) {
+    /* A client hanging up mid-write should end its session, not the
+       worker. */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Otherwise anything the parent had buffered would be written once by
+       every worker. */
+    fflush(NULL);
+
+    for (int i = 0; i < worker_count; i++) {
+        if (imcli_prefork_spawn(registry, listen_fd, prompt_text) < 0) {
+            return false;
+        }
+    }
+
+    while (true) {
+        pid_t finished = wait(NULL);
+        if (finished < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        if (imcli_prefork_spawn(registry, listen_fd, prompt_text) < 0) {
+            return false;
+        }
+    }
+}
+
+#endif
+
+#ifdef IMCLI_SERVER
+
+/* How much output a connection can have waiting to be sent before the server
+   stops reading its commands, so that a client that sends faster than it
+   reads can't make the server buffer without limit. */
+#ifndef IMCLI_SERVER_OUTPUT_LIMIT
+#define IMCLI_SERVER_OUTPUT_LIMIT (256 << 10)
+#endif
+
+/* How many bytes are read from a connection at a time. */
+#ifndef IMCLI_SERVER_READ_SIZE
+#define IMCLI_SERVER_READ_SIZE 16384
+#endif
+
+struct imcli_connection {
+    int fd;
+    /* Where this connection is in the server's list. */
+    int index;
+    struct imcli_session session;
+    struct imcli_direct_output direct;
+
+    /* Output the socket hasn't taken yet, from output_sent onwards. */
+    char_buffer output;
+    int output_sent;
+
+    /* The client has stopped sending, or a command ended the session; either
+       way the connection closes once its output is sent. */
+    bool hung_up;
+    bool ended;
+    /* Sending failed, so the connection is closed straight away. */
+    bool broken;
+};
+
+struct imcli_server {
+    struct imcli_registry *registry;
+    int listen_fd;
+    int epoll_fd;
+    const char *prompt_text;
+    struct imcli_connection **connections;
+};
+
+/* Sends as much waiting output as the socket will take without blocking. */
+IMCLI_DEF void imcli_connection_send(struct imcli_connection *connection) {
+    int len = arrlen(connection->output);
+    while (connection->output_sent < len) {
+        ssize_t sent = imcli_socket_send(
+            connection->fd,
+            &connection->output[connection->output_sent],
+            len - connection->output_sent
+        );
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) connection->broken = true;
+            break;
+        }
+        connection->output_sent += sent;
+    }
+
+    if (connection->output_sent == len) {
+        arrsetlen(connection->output, 0);
+        connection->output_sent = 0;
+    } else if (connection->output_sent > len / 2) {
+        arrdeln(connection->output, 0, connection->output_sent);
+        connection->output_sent = 0;
+    }
+}
+
+/* The sink each connection's session writes through: the same send as the
+   socket sink, except that whatever the socket won't take right away waits
+   in the connection, rather than blocking the whole server. */
+IMCLI_DEF bool imcli_connection_sink_write(
+    void *context,
+    const char *data,
+    size_t size
+) {
+    struct imcli_connection *connection = context;
+    memcpy(arraddnptr(connection->output, size), data, size);
+    imcli_connection_send(connection);
+    return !connection->broken;
+}
+
+/* Output written by commands but not yet sent, wherever it is. */
+IMCLI_DEF size_t imcli_connection_backlog(struct imcli_connection *connection) {
+    return arrlen(connection->output) - connection->output_sent
+        + arrlen(connection->session.sink_buffer);
+}
+
+IMCLI_DEF void imcli_server_write_prompt(
+    struct imcli_server *server,
+    struct imcli_connection *connection
+) {
+    if (server->prompt_text && !connection->session.json) {
+        imcli_write(&connection->session, server->prompt_text,
+            strlen(server->prompt_text));
+    }
+}
+
+/* Runs whole lines the client has sent, until there are none left, or until
+   the connection has too much output waiting, in which case the rest wait
+   until it has been sent. */
+IMCLI_DEF void imcli_connection_run(
+    struct imcli_server *server,
+    struct imcli_connection *connection
+) {
+    struct imcli_session *session = &connection->session;
+    while (!connection->ended && !connection->broken
+        && imcli_connection_backlog(connection) < IMCLI_SERVER_OUTPUT_LIMIT
+        && imcli_take_line(session)
+    ) {
+        string_buffer words = imcli_split_line(session, session->line);
+        if (arrlen(words) > 0) {
+            connection->ended = !imcli_dispatch_line(session, server->registry, &words);
+        }
+        imcli_direct_output_forward(session, &connection->direct);
+        sbfree(&words);
+
+        if (!connection->ended) imcli_server_write_prompt(server, connection);
+    }
+
+    /* Everything from this batch of lines goes out together. */
+    imcli_flush(session);
+}
+
+IMCLI_DEF void imcli_connection_close(
+    struct imcli_server *server,
+    struct imcli_connection *connection
+) {
+    /* Taking it out of the list moves the last connection into its place. */
+    struct imcli_connection *last = arrlast(server->connections);
+    last->index = connection->index;
+    arrdelswap(server->connections, connection->index);
+
+    /* The sink has nowhere left to write to. */
+    connection->session.sink.write = NULL;
+    imcli_direct_output_close(&connection->session, &connection->direct);
+    imcli_session_free(&connection->session);
+    arrfree(connection->output);
+    close(connection->fd);
+    free(connection);
+}
+
+/* Waits for input only while the connection's output is under the limit, and
+   for the socket to take more output only while some is waiting. Returns
+   false, having closed the connection, once it is finished. */
+IMCLI_DEF bool imcli_connection_watch(
+    struct imcli_server *server,
+    struct imcli_connection *connection
+) {
+    size_t backlog = arrlen(connection->output) - connection->output_sent;
+    bool reading = !connection->hung_up && !connection->ended
+        && imcli_connection_backlog(connection) < IMCLI_SERVER_OUTPUT_LIMIT;
+
+    if (connection->broken || (backlog == 0 && !reading)) {
+        imcli_connection_close(server, connection);
+        return false;
+    }
+
+    struct epoll_event event = {
+        .events = (reading ? EPOLLIN : 0) | (backlog > 0 ? EPOLLOUT : 0),
+        .data.ptr = connection,
+    };
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    return true;
+}
+
+IMCLI_DEF void imcli_server_accept(struct imcli_server *server) {
+    while (true) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            /* else EAGAIN, once there is nobody left waiting, or an error
+               that leaves the listening socket for the next wakeup. */
+            return;
+        }
+
+        struct imcli_connection *connection = calloc(1, sizeof(*connection));
+        if (!connection) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        connection->fd = fd;
+        connection->index = arrlen(server->connections);
+        connection->session = imcli_session_new(NULL, NULL);
+        struct imcli_sink sink = {
+            .write = imcli_connection_sink_write,
+            .context = connection,
+        };
+        imcli_session_set_sink(&connection->session, sink);
+        bool opened = imcli_direct_output_open(
+            &connection->session,
+            &connection->direct
+        );
+
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = connection,
+        };
+        if (!opened || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            if (opened) {
+                imcli_direct_output_close(
+                    &connection->session,
+                    &connection->direct
+                );
+            }
+            imcli_session_free(&connection->session);
+            close(fd);
+            free(connection);
+            continue;
+        }
+        arrput(server->connections, connection);
+
+        imcli_server_write_prompt(server, connection);
+        imcli_flush(&connection->session);
+        imcli_connection_watch(server, connection);
+    }
+}
+
+/* Reads whatever the client has sent, and runs any whole lines in it. */
+IMCLI_DEF void imcli_connection_read(struct imcli_connection *connection) {
+    char data[IMCLI_SERVER_READ_SIZE];
+    ssize_t count = read(connection->fd, data, sizeof(data));
+    if (count > 0) {
+        imcli_feed(&connection->session, data, count);
+    } else if (count == 0) {
+        connection->hung_up = true;
+        /* A last line with no newline still gets run, like read_line would
+           have returned it. */
+        struct imcli_session *session = &connection->session;
+        if (session->pending_start < arrlen(session->pending)) {
+            imcli_feed(session, "\n", 1);
+        }
+    } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+        connection->broken = true;
+    }
+}
+
+/* Makes a non-blocking Unix socket listening at path, replacing anything
+   already there, ready for imcli_server_run. Returns -1 if it can't. */
+IMCLI_DEF int imcli_server_listen(char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0
+        || listen(fd, SOMAXCONN) < 0
+        || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0
+    ) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Serves sessions on a listening socket, like imcli_prefork_serve, but all
+   from this one thread, with each connection's input going through imcli_feed
+   and imcli_take_line as it arrives. Sessions write through a sink that never
+   blocks; a connection with more than IMCLI_SERVER_OUTPUT_LIMIT bytes of
+   output waiting isn't read from again until the client has taken some of it.
+   As with imcli_serve_fd, output handlers write to session->output goes out
+   after the rest of each line's. Commands that block, including ones
+   waiting for more lines with a nested prompt rather than imcli_await_words,
+   hold up every connection.
+
+   This only returns, with false, if the socket can't be watched, or waiting
+   on it fails. */
+IMCLI_DEF bool imcli_server_run(
+    struct imcli_registry *registry,
+    int listen_fd,
+    const char *prompt_text
+) {
+    struct imcli_server server = {
+        .registry = registry,
+        .listen_fd = listen_fd,
+        .prompt_text = prompt_text,
+    };
+
+    server.epoll_fd = epoll_create1(0);
+    if (server.epoll_fd < 0) return false;
+
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = NULL};
+    bool ok = epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) == 0;
+
+    struct epoll_event events[64];
+    while (ok) {
+        int count = epoll_wait(server.epoll_fd, events, 64, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct imcli_connection *connection = events[i].data.ptr;
+            if (!connection) {
+                imcli_server_accept(&server);
+                continue;
+            }
+
+            if (events[i].events & EPOLLERR) connection->broken = true;
+            if (events[i].events & EPOLLOUT) imcli_connection_send(connection);
+            if (events[i].events & (EPOLLIN | EPOLLHUP)) {
+                if (!connection->hung_up && !connection->ended) {
+                    imcli_connection_read(connection);
+                }
+            }
+
+            /* Sending some output may have made room for lines that were
+               held back. */
+            imcli_connection_run(&server, connection);
+            imcli_connection_watch(&server, connection);
+        }
+    }
+
+    while (arrlen(server.connections) > 0) {
+        imcli_connection_close(&server, arrlast(server.connections));
+    }
+    arrfree(server.connections);
+    close(server.epoll_fd);
+    return ok;
+}
+
+#endif
+
 #endif
@@ -51,6 +51,27 @@ COMPILE-TIME OPTIONS
      define both, or neither. Note that at the moment, 'context' will always be NULL.
      @TODO add an array/hash initialization function that takes a memory context pointer.
 
+  #define STBDS_HM_LINEAR_LIMIT n
+
+     This flag only needs to be set in the file containing #define STB_DS_IMPLEMENTATION.
+
+     Hashmaps with at most this many entries (default 8) don't build a hash index;
+     lookups just compare against every key in the entry array, and the keys are never
+     hashed. Once a hashmap grows past this size it builds a normal index and stays
+     indexed. Define it to 0 to always index.
+
+  #define STBDS_THREADS
+  #define STBDS_BUILD_THREADS n
+  #define STBDS_BUILD_PARALLEL_MIN n
+
+     These flags only need to be set in the file containing #define STB_DS_IMPLEMENTATION.
+     imcli.h defines STBDS_THREADS itself when IMCLI_THREADS is defined.
+
+     With STBDS_THREADS, hmbuild/shbuild of at least STBDS_BUILD_PARALLEL_MIN items
+     (default 65536) hashes the keys on STBDS_BUILD_THREADS threads (default 4), using
+     C11 <threads.h>, before inserting them on the calling thread in their original
+     order. The resulting hashmap is exactly the same as without threads.
+
   #define STBDS_UNIT_TESTS
 
      Defines a function stbds_unit_tests() that checks the functioning of the data structures.
@@ -273,6 +294,62 @@ DOCUMENTATION
           If 'key' is in the hashmap, deletes its entry and returns 1.
           Otherwise returns 0.
 
+      hmreserve
+      shreserve
+        void hmreserve(T*, size_t n)
+        void shreserve(T*, size_t n)
+          Grows the hashmap so that it can hold n entries without rebuilding
+          its index or reallocating its storage.
+
+      hmbuild
+      shbuild
+        void hmbuild(T*, T* items, size_t n)
+        void shbuild(T*, T* items, size_t n)
+          Inserts the n structs in 'items' as if by calling hmputs/shputs on
+          each one in order, but reserves space for all of them up front, so
+          the index is built once at its final size. If several items share a
+          key, the last one wins. With STBDS_THREADS, large builds hash their
+          keys in parallel first; see COMPILE-TIME OPTIONS.
+
+      hmsnapshot
+      shsnapshot
+      shnsnapshot
+        size_t hmsnapshot(T*, void* buffer, size_t size)
+        size_t shsnapshot(T*, void* buffer, size_t size)
+        size_t shnsnapshot(T*, void* buffer, size_t size)
+          Writes the hashmap, including its hash index and any string keys,
+          into 'buffer' as a single position-independent image, and returns
+          the size of the image. If 'buffer' is NULL or 'size' is too small,
+          nothing is written, so call it once with NULL to size the buffer.
+          Values are copied byte for byte, so they must not hold pointers.
+
+      hmload
+      shload
+      shnload
+        void hmload(T*, void* image, size_t size)
+        void shload(T*, void* image, size_t size)
+        void shnload(T*, void* image, size_t size)
+          Overwrites the existing pointer with a hashmap loaded from an image
+          made by the matching *snapshot function, or with NULL if the image
+          is damaged or was made by an incompatible build of stb_ds. The image
+          is only read during the call, so it can be a read-only file mapping,
+          and can be unmapped or freed afterwards. Loaded string keys live in
+          the hashmap's arena, as if it had been made with sh_new_arena.
+
+          Loading is a copy, not a view: the entries, the bucket storage and
+          the string keys are each copied to the heap in one block, so the
+          loaded map takes as much memory as the image again. A map can't be
+          used in place, since its array header and key pointers have to sit
+          in front of and inside the entries, and hmfree and lookups write
+          through them, while an image holds offsets and may be read-only.
+          What loading saves over hmbuild is placing every key in the index,
+          and copying string keys one at a time, but it still looks every key
+          up once to check the index before trusting it, since a later hmdel
+          would write through a bad slot. That check is most of the time a
+          load takes, so a load is only somewhat faster than hmbuild on the
+          same items; it is worth it mostly for string keys, or when getting
+          the items at all would mean parsing or computing them again.
+
     Function interface (actually macros) for strings only:
 
       sh_new_strdup
@@ -290,6 +367,36 @@ DOCUMENTATION
           Additionally, any key which is deleted and reinserted will
           be allocated multiple times in the string arena.
 
+    Function interface (actually macros) for counted strings only:
+
+      Counted string hashmaps are like string hashmaps, except that TK must
+      be 'stbds_string_view', a { char *str; size_t len; } pair, and keys are
+      passed as a pointer and a length. Keys do not need to be nul-terminated,
+      so a word can be looked up directly inside a larger buffer. Keys are
+      hashed using their length and compared with memcmp. sh_new_arena and
+      sh_new_strdup can be used on these hashmaps too; the copies they make
+      are nul-terminated.
+
+      shnput
+        TV shnput(T*, char* key, size_t len, TV value)
+          Inserts a <key,value> pair into the hashmap. If the key is already
+          present in the hashmap, updates its value.
+
+      shngeti
+      shnget
+      shngetp
+      shngetp_null
+        ptrdiff_t shngeti(T*, char* key, size_t len)
+        TV shnget(T*, char* key, size_t len)
+        T* shngetp(T*, char* key, size_t len)
+        T* shngetp_null(T*, char* key, size_t len)
+          Same as shgeti, shget, shgetp and shgetp_null.
+
+      shndel
+        int shndel(T*, char* key, size_t len)
+          If 'key' is in the hashmap, deletes its entry and returns 1.
+          Otherwise returns 0.
+
 NOTES
 
   * These data structures are realloc'd when they grow, and the macro
@@ -348,6 +455,9 @@ NOTES - HASH MAP
     across all platforms and versions of the library. However, you should not
     attempt to serialize the internal hash table, as the hash is not consistent
     between different platforms, and may change with future versions of the library.
+    The exception is hmsnapshot/hmload, whose images record enough about the build
+    that made them for hmload to refuse images it cannot use, so callers can fall
+    back to rebuilding the table.
 
   * Use sh_new_arena() for string hashmaps that you never delete from. Initialize
     with NULL if you're managing the memory for your strings, or your strings are
@@ -430,6 +540,10 @@ CREDITS
 #define hmfree      stbds_hmfree
 #define hmdefault   stbds_hmdefault
 #define hmdefaults  stbds_hmdefaults
+#define hmreserve   stbds_hmreserve
+#define hmbuild     stbds_hmbuild
+#define hmsnapshot  stbds_hmsnapshot
+#define hmload      stbds_hmload
 
 #define shput       stbds_shput
 #define shputi      stbds_shputi
@@ -445,11 +559,26 @@ CREDITS
 #define shfree      stbds_shfree
 #define shdefault   stbds_shdefault
 #define shdefaults  stbds_shdefaults
+#define shreserve   stbds_shreserve
+#define shbuild     stbds_shbuild
+#define shsnapshot  stbds_shsnapshot
+#define shload      stbds_shload
+#define shnsnapshot stbds_shnsnapshot
+#define shnload     stbds_shnload
 #define sh_new_arena  stbds_sh_new_arena
 #define sh_new_strdup stbds_sh_new_strdup
 
+#define shnput      stbds_shnput
+#define shnget      stbds_shnget
+#define shngeti     stbds_shngeti
+#define shngetp     stbds_shngetp
+#define shngetp_null stbds_shngetp_null
+#define shndel      stbds_shndel
+
 #define stralloc    stbds_stralloc
+#define strnalloc   stbds_strnalloc
 #define strreset    stbds_strreset
+#define strrewind   stbds_strrewind
 #endif
 
 #if defined(STBDS_REALLOC) && !defined(STBDS_FREE) || !defined(STBDS_REALLOC) && defined(STBDS_FREE)
@@ -479,9 +608,40 @@ extern size_t stbds_hash_bytes(void *p, size_t len, size_t seed);
 extern size_t stbds_hash_string(char *str, size_t seed);
 
 // this is a simple string arena allocator, initialize with e.g. 'stbds_string_arena my_arena={0}'.
+// stbds_strnalloc copies 'len' bytes that need not be nul-terminated, and nul-terminates the copy.
+// stbds_strreset frees every block; stbds_strrewind invalidates every string but keeps the blocks,
+// so an arena that is rewound once per cycle stops calling the allocator once it has warmed up.
 typedef struct stbds_string_arena stbds_string_arena;
 extern char * stbds_stralloc(stbds_string_arena *a, char *str);
+extern char * stbds_strnalloc(stbds_string_arena *a, char *str, size_t len);
 extern void   stbds_strreset(stbds_string_arena *a);
+extern void   stbds_strrewind(stbds_string_arena *a);
+
+// a separate arena for each thread that calls this; only available where the compiler
+// supports thread-local storage, which is when STBDS_THREAD_LOCAL is defined. call
+// stbds_strreset on it before the thread exits.
+#ifndef STBDS_THREAD_LOCAL
+#if defined(_MSC_VER)
+#define STBDS_THREAD_LOCAL  __declspec(thread)
+#elif defined(__cplusplus) && __cplusplus >= 201103L
+#define STBDS_THREAD_LOCAL  thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define STBDS_THREAD_LOCAL  _Thread_local
+#elif defined(__GNUC__) || defined(__clang__)
+#define STBDS_THREAD_LOCAL  __thread
+#endif
+#endif
+
+#ifdef STBDS_THREAD_LOCAL
+extern stbds_string_arena *stbds_thread_arena(void);
+#endif
+
+// key type for counted string hashmaps (shnput etc.)
+typedef struct
+{
+  char * str;
+  size_t len;
+} stbds_string_view;
 
 // have to #define STBDS_UNIT_TESTS to call this
 extern void stbds_unit_tests(void);
@@ -500,6 +660,10 @@ extern void * stbds_hmput_default(void *a, size_t elemsize);
 extern void * stbds_hmput_key(void *a, size_t elemsize, void *key, size_t keysize, int mode);
 extern void * stbds_hmdel_key(void *a, size_t elemsize, void *key, size_t keysize, size_t keyoffset, int mode);
 extern void * stbds_shmode_func(size_t elemsize, int mode);
+extern void * stbds_hmreserve_func(void *a, size_t elemsize, size_t n, size_t keysize, int mode);
+extern void * stbds_hmbuild_func(void *a, size_t elemsize, void *items, size_t n, size_t keysize, int mode);
+extern size_t stbds_hmsnapshot_func(void *a, size_t elemsize, void *buffer, size_t size, int mode);
+extern void * stbds_hmload_func(void *image, size_t size, size_t elemsize, size_t keysize, int mode);
 
 #ifdef __cplusplus
 }
@@ -592,6 +756,17 @@ extern void * stbds_shmode_func(size_t elemsize, int mode);
 #define stbds_hmdefaults(t, s) \
     ((t) = stbds_hmput_default_wrapper((t), sizeof *(t)), (t)[-1] = (s))
 
+#define stbds_hmreserve(t, n) \
+    ((t) = stbds_hmreserve_wrapper((t), sizeof *(t), (n), sizeof (t)->key, STBDS_HM_BINARY))
+
+#define stbds_hmbuild(t, items, n) \
+    ((t) = stbds_hmbuild_wrapper((t), sizeof *(t), (void*) (items), (n), sizeof (t)->key, STBDS_HM_BINARY))
+
+#define stbds_hmsnapshot(t, buffer, size) \
+    stbds_hmsnapshot_func((void*) (t), sizeof *(t), (buffer), (size), STBDS_HM_BINARY)
+#define stbds_hmload(t, image, size) \
+    ((t) = stbds_hmload_wrapper((t), (image), (size), sizeof *(t), sizeof (t)->key, STBDS_HM_BINARY))
+
 #define stbds_hmfree(p)        \
     ((void) ((p) != NULL ? stbds_hmfree_func((p)-1,sizeof*(p)),0 : 0),(p)=NULL)
 
@@ -646,6 +821,15 @@ extern void * stbds_shmode_func(size_t elemsize, int mode);
 #define stbds_shdefault(t, v)  stbds_hmdefault(t,v)
 #define stbds_shdefaults(t, s) stbds_hmdefaults(t,s)
 
+#define stbds_shreserve(t, n) \
+    ((t) = stbds_hmreserve_wrapper((t), sizeof *(t), (n), sizeof (t)->key, STBDS_HM_STRING))
+#define stbds_shbuild(t, items, n) \
+    ((t) = stbds_hmbuild_wrapper((t), sizeof *(t), (void*) (items), (n), sizeof (t)->key, STBDS_HM_STRING))
+#define stbds_shsnapshot(t, buffer, size) \
+    stbds_hmsnapshot_func((void*) (t), sizeof *(t), (buffer), (size), STBDS_HM_STRING)
+#define stbds_shload(t, image, size) \
+    ((t) = stbds_hmload_wrapper((t), (image), (size), sizeof *(t), sizeof (t)->key, STBDS_HM_STRING))
+
 #define stbds_shfree       stbds_hmfree
 #define stbds_shlenu       stbds_hmlenu
 
@@ -654,6 +838,28 @@ extern void * stbds_shmode_func(size_t elemsize, int mode);
 #define stbds_shgetp_null(t,k)  (stbds_shgeti(t,k) == -1 ? NULL : &(t)[stbds_temp((t)-1)])
 #define stbds_shlen        stbds_hmlen
 
+#define stbds_shnput(t, k, n, v) \
+    ((t) = stbds_hmput_key_wrapper((t), sizeof *(t), (void*) (k), (n), STBDS_HM_COUNTED),   \
+     (t)[stbds_temp((t)-1)].value = (v))
+
+#define stbds_shngeti(t, k, n) \
+    ((t) = stbds_hmget_key_wrapper((t), sizeof *(t), (void*) (k), (n), STBDS_HM_COUNTED), \
+      stbds_temp((t)-1))
+
+#define stbds_shngetp(t, k, n) \
+    ((void) stbds_shngeti(t,k,n), &(t)[stbds_temp((t)-1)])
+
+#define stbds_shndel(t, k, n) \
+    (((t) = stbds_hmdel_key_wrapper((t),sizeof *(t), (void*) (k), (n), STBDS_OFFSETOF((t),key), STBDS_HM_COUNTED)),(t)?stbds_temp((t)-1):0)
+
+#define stbds_shnsnapshot(t, buffer, size) \
+    stbds_hmsnapshot_func((void*) (t), sizeof *(t), (buffer), (size), STBDS_HM_COUNTED)
+#define stbds_shnload(t, image, size) \
+    ((t) = stbds_hmload_wrapper((t), (image), (size), sizeof *(t), sizeof (t)->key, STBDS_HM_COUNTED))
+
+#define stbds_shnget(t, k, n)  (stbds_shngetp(t,k,n)->value)
+#define stbds_shngetp_null(t,k,n)  (stbds_shngeti(t,k,n) == -1 ? NULL : &(t)[stbds_temp((t)-1)])
+
 typedef struct
 {
   size_t      length;
@@ -665,12 +871,14 @@ typedef struct
 typedef struct stbds_string_block
 {
   struct stbds_string_block *next;
+  size_t size;
   char storage[8];
 } stbds_string_block;
 
 struct stbds_string_arena
 {
   stbds_string_block *storage;
+  stbds_string_block *spare;  // blocks kept by stbds_strrewind, waiting to be reused
   size_t remaining;
   unsigned char block;
   unsigned char mode;  // this isn't used by the string arena itself
@@ -678,6 +886,7 @@ struct stbds_string_arena
 
 #define STBDS_HM_BINARY         0
 #define STBDS_HM_STRING         1
+#define STBDS_HM_COUNTED        2  // key is a stbds_string_view; keysize carries the length
 
 enum
 {
@@ -711,6 +920,15 @@ template<class T> static T * stbds_hmdel_key_wrapper(T *a, size_t elemsize, void
 template<class T> static T * stbds_shmode_func_wrapper(T *, size_t elemsize, int mode) {
   return (T*)stbds_shmode_func(elemsize, mode);
 }
+template<class T> static T * stbds_hmreserve_wrapper(T *a, size_t elemsize, size_t n, size_t keysize, int mode) {
+  return (T*)stbds_hmreserve_func((void*)a, elemsize, n, keysize, mode);
+}
+template<class T> static T * stbds_hmbuild_wrapper(T *a, size_t elemsize, void *items, size_t n, size_t keysize, int mode) {
+  return (T*)stbds_hmbuild_func((void*)a, elemsize, items, n, keysize, mode);
+}
+template<class T> static T * stbds_hmload_wrapper(T *, void *image, size_t size, size_t elemsize, size_t keysize, int mode) {
+  return (T*)stbds_hmload_func(image, size, elemsize, keysize, mode);
+}
 #else
 #define stbds_arrgrowf_wrapper            stbds_arrgrowf
 #define stbds_hmget_key_wrapper           stbds_hmget_key
@@ -719,6 +937,9 @@ template<class T> static T * stbds_shmode_func_wrapper(T *, size_t elemsize, int
 #define stbds_hmput_key_wrapper           stbds_hmput_key
 #define stbds_hmdel_key_wrapper           stbds_hmdel_key
 #define stbds_shmode_func_wrapper(t,e,m)  stbds_shmode_func(e,m)
+#define stbds_hmreserve_wrapper           stbds_hmreserve_func
+#define stbds_hmbuild_wrapper             stbds_hmbuild_func
+#define stbds_hmload_wrapper(t,i,s,e,k,m) stbds_hmload_func(i,s,e,k,m)
 #endif
 
 #endif // INCLUDE_STB_DS_H
@@ -732,6 +953,9 @@ template<class T> static T * stbds_shmode_func_wrapper(T *, size_t elemsize, int
 #ifdef STB_DS_IMPLEMENTATION
 #include <assert.h>
 #include <string.h>
+#ifdef STBDS_THREADS
+#include <threads.h>
+#endif
 
 #ifndef STBDS_ASSERT
 #define STBDS_ASSERT_WAS_UNDEFINED
@@ -881,6 +1105,43 @@ static size_t stbds_log2(size_t slot_count)
   return n;
 }
 
+static size_t stbds_next_seed(void)
+{
+  size_t seed = stbds_hash_seed;
+  size_t a,b,temp;
+  // LCG
+  // in 32-bit, a =          2147001325   b =  715136305
+  // in 64-bit, a = 2862933555777941757   b = 3037000493
+  stbds_load_32_or_64(a,temp, 2147001325, 0x27bb2ee6, 0x87b0b0fd);
+  stbds_load_32_or_64(b,temp,  715136305,          0, 0xb504f32d);
+  stbds_hash_seed = stbds_hash_seed  * a + b;
+  return seed;
+}
+
+#ifndef STBDS_HM_LINEAR_LIMIT
+#define STBDS_HM_LINEAR_LIMIT  8
+#endif
+
+// an index with no slots, for hashmaps small enough to search linearly; it still
+// holds the temp key, seed and string arena, so the rest of the code can rely on it
+static stbds_hash_index *stbds_make_linear_index(void)
+{
+  stbds_hash_index *t = (stbds_hash_index *) STBDS_REALLOC(NULL,0,sizeof(stbds_hash_index));
+  memset(t, 0, sizeof(*t));
+  t->used_count_threshold = STBDS_HM_LINEAR_LIMIT;
+  t->seed = stbds_next_seed();
+  return t;
+}
+
+// smallest slot count whose grow threshold (see stbds_make_hash_index) stays above n
+static size_t stbds_hm_slot_count_for(size_t n)
+{
+  size_t slot_count = STBDS_BUCKET_LENGTH;
+  while (slot_count - (slot_count>>2) <= n)
+    slot_count *= 2;
+  return slot_count;
+}
+
 static stbds_hash_index *stbds_make_hash_index(size_t slot_count, stbds_hash_index *ot)
 {
   stbds_hash_index *t;
@@ -939,15 +1200,8 @@ static stbds_hash_index *stbds_make_hash_index(size_t slot_count, stbds_hash_ind
     // reuse old seed so we can reuse old hashes so below "copy out old data" doesn't do any hashing
     t->seed = ot->seed;
   } else {
-    size_t a,b,temp;
     memset(&t->string, 0, sizeof(t->string));
-    t->seed = stbds_hash_seed;
-    // LCG
-    // in 32-bit, a =          2147001325   b =  715136305
-    // in 64-bit, a = 2862933555777941757   b = 3037000493
-    stbds_load_32_or_64(a,temp, 2147001325, 0x27bb2ee6, 0x87b0b0fd);
-    stbds_load_32_or_64(b,temp,  715136305,          0, 0xb504f32d);
-    stbds_hash_seed = stbds_hash_seed  * a + b;
+    t->seed = stbds_next_seed();
   }
 
   {
@@ -1200,9 +1454,22 @@ size_t stbds_hash_bytes(void *p, size_t len, size_t seed)
 #endif
 
 
+static size_t stbds_hm_hash_key(void *key, size_t keysize, size_t seed, int mode)
+{
+  if (mode == STBDS_HM_COUNTED)
+    return stbds_hash_bytes(key, keysize, seed);
+  else if (mode >= STBDS_HM_STRING)
+    return stbds_hash_string((char*)key, seed);
+  else
+    return stbds_hash_bytes(key, keysize, seed);
+}
+
 static int stbds_is_key_equal(void *a, size_t elemsize, void *key, size_t keysize, size_t keyoffset, int mode, size_t i)
 {
-  if (mode >= STBDS_HM_STRING)
+  if (mode == STBDS_HM_COUNTED) {
+    stbds_string_view *v = (stbds_string_view *) ((char *) a + elemsize*i + keyoffset);
+    return v->len == keysize && 0==memcmp(key, v->str, keysize);
+  } else if (mode >= STBDS_HM_STRING)
     return 0==strcmp((char *) key, * (char **) ((char *) a + elemsize*i + keyoffset));
   else
     return 0==memcmp(key, (char *) a + elemsize*i + keyoffset, keysize);
@@ -1233,7 +1500,7 @@ static ptrdiff_t stbds_hm_find_slot(void *a, size_t elemsize, void *key, size_t
 {
   void *raw_a = STBDS_HASH_TO_ARR(a,elemsize);
   stbds_hash_index *table = stbds_hash_table(raw_a);
-  size_t hash = mode >= STBDS_HM_STRING ? stbds_hash_string((char*)key,table->seed) : stbds_hash_bytes(key, keysize,table->seed);
+  size_t hash = stbds_hm_hash_key(key, keysize, table->seed, mode);
   size_t step = STBDS_BUCKET_LENGTH;
   size_t limit,i;
   size_t pos;
@@ -1278,6 +1545,54 @@ static ptrdiff_t stbds_hm_find_slot(void *a, size_t elemsize, void *key, size_t
   /* NOTREACHED */
 }
 
+static ptrdiff_t stbds_hm_find_linear(void *a, size_t elemsize, void *key, size_t keysize, size_t keyoffset, int mode)
+{
+  size_t i, count = stbds_header(STBDS_HASH_TO_ARR(a,elemsize))->length - 1;
+  for (i=0; i < count; ++i)
+    if (stbds_is_key_equal(a, elemsize, key, keysize, keyoffset, mode, i))
+      return (ptrdiff_t) i;
+  return -1;
+}
+
+// builds a real index over the entries of a hashmap that has been searched linearly until now
+static stbds_hash_index *stbds_hm_index_entries(void *a, size_t elemsize, size_t keysize, size_t slot_count, stbds_hash_index *ot, int mode)
+{
+  stbds_hash_index *t = stbds_make_hash_index(slot_count, ot);
+  size_t i, count = stbds_header(STBDS_HASH_TO_ARR(a,elemsize))->length - 1;
+  for (i=0; i < count; ++i) {
+    char *entry = (char *) a + elemsize*i;
+    size_t hash, pos, step = STBDS_BUCKET_LENGTH;
+    if (mode == STBDS_HM_COUNTED)
+      hash = stbds_hm_hash_key(((stbds_string_view *) entry)->str, ((stbds_string_view *) entry)->len, t->seed, mode);
+    else
+      hash = stbds_hm_hash_key(mode >= STBDS_HM_STRING ? *(char **) entry : entry, keysize, t->seed, mode);
+    if (hash < 2) hash += 2;
+    pos = stbds_probe_position(hash, t->slot_count, t->slot_count_log2);
+    STBDS_STATS(++stbds_rehash_items);
+    // same probe order as the copy in stbds_make_hash_index, so lookups find it
+    for (;;) {
+      stbds_hash_bucket *bucket = &t->storage[pos >> STBDS_BUCKET_SHIFT];
+      size_t z, limit = pos & STBDS_BUCKET_MASK;
+      STBDS_STATS(++stbds_rehash_probes);
+      for (z=limit; z < STBDS_BUCKET_LENGTH; ++z)
+        if (bucket->hash[z] == STBDS_HASH_EMPTY)
+          goto found;
+      for (z=0; z < limit; ++z)
+        if (bucket->hash[z] == STBDS_HASH_EMPTY)
+          goto found;
+      pos += step;                  // quadratic probing
+      step += STBDS_BUCKET_LENGTH;
+      pos &= (t->slot_count-1);
+      continue;
+     found:
+      bucket->hash[z] = hash;
+      bucket->index[z] = (ptrdiff_t) i;
+      break;
+    }
+  }
+  return t;
+}
+
 void * stbds_hmget_key_ts(void *a, size_t elemsize, void *key, size_t keysize, ptrdiff_t *temp, int mode)
 {
   size_t keyoffset = 0;
@@ -1296,6 +1611,8 @@ void * stbds_hmget_key_ts(void *a, size_t elemsize, void *key, size_t keysize, p
     table = (stbds_hash_index *) stbds_header(raw_a)->hash_table;
     if (table == 0) {
       *temp = -1;
+    } else if (table->slot_count == 0) {
+      *temp = stbds_hm_find_linear(a, elemsize, key, keysize, keyoffset, mode);
     } else {
       ptrdiff_t slot = stbds_hm_find_slot(a, elemsize, key, keysize, keyoffset, mode);
       if (slot < 0) {
@@ -1333,8 +1650,41 @@ void * stbds_hmput_default(void *a, size_t elemsize)
 }
 
 static char *stbds_strdup(char *str);
+static char *stbds_strndup(char *str, size_t len);
 
-void *stbds_hmput_key(void *a, size_t elemsize, void *key, size_t keysize, int mode)
+// appends a new entry for 'key' to the raw array 'a' and stores the key according to the string mode;
+// the caller has already recorded it in the index, if there is one
+static void *stbds_hm_append_key(void *a, size_t elemsize, void *key, size_t keysize, int mode, stbds_hash_index *table)
+{
+  ptrdiff_t i = (ptrdiff_t) stbds_arrlen(a);
+  // we want to do stbds_arraddn(1), but we can't use the macros since we don't have something of the right type
+  if ((size_t) i+1 > stbds_arrcap(a))
+    *(void **) &a = stbds_arrgrowf(a, elemsize, 1, 0);
+
+  STBDS_ASSERT((size_t) i+1 <= stbds_arrcap(a));
+  stbds_header(a)->length = i+1;
+  stbds_temp(a) = i-1;
+
+  if (mode == STBDS_HM_COUNTED) {
+    stbds_string_view *v = (stbds_string_view *) ((char *) a + elemsize*i);
+    switch (table->string.mode) {
+       case STBDS_SH_STRDUP: v->str = stbds_strndup((char*) key, keysize); break;
+       case STBDS_SH_ARENA:  v->str = stbds_strnalloc(&table->string, (char*) key, keysize); break;
+       default:              v->str = (char *) key; break;
+    }
+    v->len = keysize;
+    stbds_temp_key(a) = v->str;
+  } else switch (table->string.mode) {
+     case STBDS_SH_STRDUP:  stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = stbds_strdup((char*) key); break;
+     case STBDS_SH_ARENA:   stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = stbds_stralloc(&table->string, (char*)key); break;
+     case STBDS_SH_DEFAULT: stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = (char *) key; break;
+     default:                memcpy((char *) a + elemsize*i, key, keysize); break;
+  }
+  return a;
+}
+
+// known_hash, if not NULL, is the key's hash with the hashmap's seed, already worked out
+static void *stbds_hmput_key_hashed(void *a, size_t elemsize, void *key, size_t keysize, int mode, size_t *known_hash)
 {
   size_t keyoffset=0;
   void *raw_a;
@@ -1354,23 +1704,40 @@ void *stbds_hmput_key(void *a, size_t elemsize, void *key, size_t keysize, int m
 
   table = (stbds_hash_index *) stbds_header(a)->hash_table;
 
-  if (table == NULL || table->used_count >= table->used_count_threshold) {
-    stbds_hash_index *nt;
-    size_t slot_count;
+  if (table == NULL) {
+    // start out searching linearly; the index is built once the hashmap outgrows STBDS_HM_LINEAR_LIMIT
+    table = stbds_make_linear_index();
+    table->string.mode = mode >= STBDS_HM_STRING ? STBDS_SH_DEFAULT : 0;
+    stbds_header(a)->hash_table = table;
+  }
 
-    slot_count = (table == NULL) ? STBDS_BUCKET_LENGTH : table->slot_count*2;
-    nt = stbds_make_hash_index(slot_count, table);
-    if (table)
-      STBDS_FREE(NULL, table);
+  if (table->used_count >= table->used_count_threshold) {
+    stbds_hash_index *nt;
+    if (table->slot_count == 0)
+      nt = stbds_hm_index_entries(raw_a, elemsize, keysize, stbds_hm_slot_count_for(table->used_count+1), table, mode);
     else
-      nt->string.mode = mode >= STBDS_HM_STRING ? STBDS_SH_DEFAULT : 0;
+      nt = stbds_make_hash_index(table->slot_count*2, table);
+    STBDS_FREE(NULL, table);
     stbds_header(a)->hash_table = table = nt;
     STBDS_STATS(++stbds_hash_grow);
   }
 
+  if (table->slot_count == 0) {
+    ptrdiff_t found = stbds_hm_find_linear(raw_a, elemsize, key, keysize, keyoffset, mode);
+    if (found >= 0) {
+      stbds_temp(a) = found;
+      if (mode >= STBDS_HM_STRING)
+        stbds_temp_key(a) = * (char **) ((char *) raw_a + elemsize*found + keyoffset);
+      return raw_a;
+    }
+    ++table->used_count;
+    a = stbds_hm_append_key(a, elemsize, key, keysize, mode, table);
+    return STBDS_ARR_TO_HASH(a,elemsize);
+  }
+
   // we iterate hash table explicitly because we want to track if we saw a tombstone
   {
-    size_t hash = mode >= STBDS_HM_STRING ? stbds_hash_string((char*)key,table->seed) : stbds_hash_bytes(key, keysize,table->seed);
+    size_t hash = known_hash ? *known_hash : stbds_hm_hash_key(key, keysize, table->seed, mode);
     size_t step = STBDS_BUCKET_LENGTH;
     size_t pos;
     ptrdiff_t tombstone = -1;
@@ -1433,42 +1800,176 @@ void *stbds_hmput_key(void *a, size_t elemsize, void *key, size_t keysize, int m
     }
     ++table->used_count;
 
-    {
-      ptrdiff_t i = (ptrdiff_t) stbds_arrlen(a);
-      // we want to do stbds_arraddn(1), but we can't use the macros since we don't have something of the right type
-      if ((size_t) i+1 > stbds_arrcap(a))
-        *(void **) &a = stbds_arrgrowf(a, elemsize, 1, 0);
-      raw_a = STBDS_ARR_TO_HASH(a,elemsize);
-
-      STBDS_ASSERT((size_t) i+1 <= stbds_arrcap(a));
-      stbds_header(a)->length = i+1;
-      bucket = &table->storage[pos >> STBDS_BUCKET_SHIFT];
-      bucket->hash[pos & STBDS_BUCKET_MASK] = hash;
-      bucket->index[pos & STBDS_BUCKET_MASK] = i-1;
-      stbds_temp(a) = i-1;
-
-      switch (table->string.mode) {
-         case STBDS_SH_STRDUP:  stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = stbds_strdup((char*) key); break;
-         case STBDS_SH_ARENA:   stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = stbds_stralloc(&table->string, (char*)key); break;
-         case STBDS_SH_DEFAULT: stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = (char *) key; break;
-         default:                memcpy((char *) a + elemsize*i, key, keysize); break;
-      }
-    }
+    bucket = &table->storage[pos >> STBDS_BUCKET_SHIFT];
+    bucket->hash[pos & STBDS_BUCKET_MASK] = hash;
+    bucket->index[pos & STBDS_BUCKET_MASK] = stbds_arrlen(a)-1;
+    a = stbds_hm_append_key(a, elemsize, key, keysize, mode, table);
     return STBDS_ARR_TO_HASH(a,elemsize);
   }
 }
 
+void *stbds_hmput_key(void *a, size_t elemsize, void *key, size_t keysize, int mode)
+{
+  return stbds_hmput_key_hashed(a, elemsize, key, keysize, mode, NULL);
+}
+
 void * stbds_shmode_func(size_t elemsize, int mode)
 {
   void *a = stbds_arrgrowf(0, elemsize, 0, 1);
   stbds_hash_index *h;
   memset(a, 0, elemsize);
   stbds_header(a)->length = 1;
-  stbds_header(a)->hash_table = h = (stbds_hash_index *) stbds_make_hash_index(STBDS_BUCKET_LENGTH, NULL);
+  stbds_header(a)->hash_table = h = stbds_make_linear_index();
   h->string.mode = (unsigned char) mode;
   return STBDS_ARR_TO_HASH(a,elemsize);
 }
 
+void * stbds_hmreserve_func(void *a, size_t elemsize, size_t n, size_t keysize, int mode)
+{
+  stbds_hash_index *table;
+  size_t slot_count;
+
+  if (a == NULL) {
+    a = stbds_arrgrowf(0, elemsize, 0, 1);
+    memset(a, 0, elemsize);
+    stbds_header(a)->length += 1;
+  } else {
+    a = STBDS_HASH_TO_ARR(a,elemsize);
+  }
+
+  // one extra for the default element
+  a = stbds_arrgrowf(a, elemsize, 0, n+1);
+
+  table = stbds_hash_table(a);
+  if (table == NULL) {
+    table = stbds_make_linear_index();
+    table->string.mode = mode >= STBDS_HM_STRING ? STBDS_SH_DEFAULT : 0;
+    stbds_header(a)->hash_table = table;
+  }
+
+  // small enough to stay linear
+  if (table->slot_count == 0 && n <= table->used_count_threshold)
+    return STBDS_ARR_TO_HASH(a,elemsize);
+
+  slot_count = stbds_hm_slot_count_for(n);
+  if (table->slot_count < slot_count) {
+    stbds_hash_index *nt;
+    if (table->slot_count == 0)
+      nt = stbds_hm_index_entries(STBDS_ARR_TO_HASH(a,elemsize), elemsize, keysize, slot_count, table, mode);
+    else
+      nt = stbds_make_hash_index(slot_count, table);
+    STBDS_FREE(NULL, table);
+    stbds_header(a)->hash_table = nt;
+    STBDS_STATS(++stbds_hash_grow);
+  }
+  return STBDS_ARR_TO_HASH(a,elemsize);
+}
+
+#ifdef STBDS_THREADS
+#ifndef STBDS_BUILD_THREADS
+#define STBDS_BUILD_THREADS  4
+#endif
+#ifndef STBDS_BUILD_PARALLEL_MIN
+#define STBDS_BUILD_PARALLEL_MIN  65536
+#endif
+
+typedef struct
+{
+  char *items;
+  size_t elemsize, keysize, seed;
+  size_t begin, end;
+  int mode;
+  size_t *hashes;
+} stbds_hash_chunk;
+
+static int stbds_hash_chunk_run(void *data)
+{
+  stbds_hash_chunk *c = (stbds_hash_chunk *) data;
+  size_t i;
+  for (i=c->begin; i < c->end; ++i) {
+    char *item = c->items + c->elemsize*i;
+    c->hashes[i] = stbds_hm_hash_key(c->mode >= STBDS_HM_STRING ? *(char **) item : item, c->keysize, c->seed, c->mode);
+  }
+  return 0;
+}
+
+// hashes every item's key on STBDS_BUILD_THREADS threads, including this one; each hash only
+// depends on its key and the seed, so the result is the same however the work is split up.
+// returns NULL if there's no memory for the hashes, so the caller hashes as it inserts instead
+static size_t *stbds_hash_items_parallel(void *items, size_t elemsize, size_t n, size_t keysize, size_t seed, int mode)
+{
+  stbds_hash_chunk chunks[STBDS_BUILD_THREADS];
+  thrd_t threads[STBDS_BUILD_THREADS];
+  int started[STBDS_BUILD_THREADS];
+  size_t t, per_thread = (n + STBDS_BUILD_THREADS-1) / STBDS_BUILD_THREADS;
+  size_t *hashes = (size_t *) STBDS_REALLOC(NULL, 0, n * sizeof(size_t));
+  if (hashes == NULL)
+    return NULL;
+
+  for (t=0; t < STBDS_BUILD_THREADS; ++t) {
+    chunks[t].items = (char *) items;
+    chunks[t].elemsize = elemsize;
+    chunks[t].keysize = keysize;
+    chunks[t].seed = seed;
+    chunks[t].mode = mode;
+    chunks[t].hashes = hashes;
+    chunks[t].begin = t*per_thread < n ? t*per_thread : n;
+    chunks[t].end = (t+1)*per_thread < n ? (t+1)*per_thread : n;
+  }
+
+  // the last chunk runs here; any chunk whose thread can't be started does too
+  for (t=0; t+1 < STBDS_BUILD_THREADS; ++t)
+    started[t] = thrd_create(&threads[t], stbds_hash_chunk_run, &chunks[t]) == thrd_success;
+  stbds_hash_chunk_run(&chunks[STBDS_BUILD_THREADS-1]);
+  for (t=0; t+1 < STBDS_BUILD_THREADS; ++t) {
+    if (started[t])
+      thrd_join(threads[t], NULL);
+    else
+      stbds_hash_chunk_run(&chunks[t]);
+  }
+  return hashes;
+}
+#endif
+
+void * stbds_hmbuild_func(void *a, size_t elemsize, void *items, size_t n, size_t keysize, int mode)
+{
+  size_t i, count = 0;
+  size_t *hashes = NULL;
+  if (a != NULL)
+    count = stbds_header(STBDS_HASH_TO_ARR(a,elemsize))->length - 1;
+
+  // size everything for the final count, so no insert below has to grow or rehash
+  a = stbds_hmreserve_func(a, elemsize, count + n, keysize, mode);
+
+  #ifdef STBDS_THREADS
+  {
+    // hashing is the part that doesn't depend on what's already inserted, so only that is
+    // spread out; inserting stays in order on this thread, so the result is deterministic.
+    // the seed can't change below, since rebuilding an index keeps it
+    stbds_hash_index *table = stbds_hash_table(STBDS_HASH_TO_ARR(a,elemsize));
+    if (table->slot_count != 0 && n >= STBDS_BUILD_PARALLEL_MIN)
+      hashes = stbds_hash_items_parallel(items, elemsize, n, keysize, table->seed, mode);
+  }
+  #endif
+
+  for (i=0; i < n; ++i) {
+    char *item = (char *) items + elemsize*i;
+    char *dest;
+    a = stbds_hmput_key_hashed(a, elemsize, mode >= STBDS_HM_STRING ? *(char **) item : item, keysize, mode, hashes ? &hashes[i] : NULL);
+    dest = (char *) a + elemsize*stbds_temp(STBDS_HASH_TO_ARR(a,elemsize));
+    if (mode >= STBDS_HM_STRING) {
+      // keep the key that hmput_key stored, which may be a copy owned by the hashmap
+      char *key = *(char **) dest;
+      memmove(dest, item, elemsize);
+      *(char **) dest = key;
+    } else {
+      memmove(dest, item, elemsize);
+    }
+  }
+  STBDS_FREE(NULL, hashes);
+  return a;
+}
+
 void * stbds_hmdel_key(void *a, size_t elemsize, void *key, size_t keysize, size_t keyoffset, int mode)
 {
   if (a == NULL) {
@@ -1480,6 +1981,20 @@ void * stbds_hmdel_key(void *a, size_t elemsize, void *key, size_t keysize, size
     stbds_temp(raw_a) = 0;
     if (table == 0) {
       return a;
+    } else if (table->slot_count == 0) {
+      ptrdiff_t old_index = stbds_hm_find_linear(a, elemsize, key, keysize, keyoffset, mode);
+      ptrdiff_t final_index = (ptrdiff_t) stbds_arrlen(raw_a)-1-1;
+      if (old_index < 0)
+        return a;
+      if (mode >= STBDS_HM_STRING && table->string.mode == STBDS_SH_STRDUP)
+        STBDS_FREE(NULL, *(char**) ((char *) a+elemsize*old_index));
+      // swap delete; there is no index to fix up
+      if (old_index != final_index)
+        memmove((char*) a + elemsize*old_index, (char*) a + elemsize*final_index, elemsize);
+      stbds_header(raw_a)->length -= 1;
+      --table->used_count;
+      stbds_temp(raw_a) = 1;
+      return a;
     } else {
       ptrdiff_t slot;
       slot = stbds_hm_find_slot(a, elemsize, key, keysize, keyoffset, mode);
@@ -1499,7 +2014,7 @@ void * stbds_hmdel_key(void *a, size_t elemsize, void *key, size_t keysize, size
         b->hash[i] = STBDS_HASH_DELETED;
         b->index[i] = STBDS_INDEX_DELETED;
 
-        if (mode == STBDS_HM_STRING && table->string.mode == STBDS_SH_STRDUP)
+        if (mode >= STBDS_HM_STRING && table->string.mode == STBDS_SH_STRDUP)
           STBDS_FREE(NULL, *(char**) ((char *) a+elemsize*old_index));
 
         // if indices are the same, memcpy is a no-op, but back-pointer-fixup will fail, so skip
@@ -1508,7 +2023,10 @@ void * stbds_hmdel_key(void *a, size_t elemsize, void *key, size_t keysize, size
           memmove((char*) a + elemsize*old_index, (char*) a + elemsize*final_index, elemsize);
 
           // now find the slot for the last element
-          if (mode == STBDS_HM_STRING)
+          if (mode == STBDS_HM_COUNTED) {
+            stbds_string_view *v = (stbds_string_view *) ((char *) a+elemsize*old_index + keyoffset);
+            slot = stbds_hm_find_slot(a, elemsize, v->str, v->len, keyoffset, mode);
+          } else if (mode == STBDS_HM_STRING)
             slot = stbds_hm_find_slot(a, elemsize, *(char**) ((char *) a+elemsize*old_index + keyoffset), keysize, keyoffset, mode);
           else
             slot = stbds_hm_find_slot(a, elemsize,  (char* ) a+elemsize*old_index + keyoffset, keysize, keyoffset, mode);
@@ -1547,6 +2065,14 @@ static char *stbds_strdup(char *str)
   return p;
 }
 
+static char *stbds_strndup(char *str, size_t len)
+{
+  char *p = (char*) STBDS_REALLOC(NULL, 0, len+1);
+  memmove(p, str, len);
+  p[len] = 0;
+  return p;
+}
+
 #ifndef STBDS_STRING_ARENA_BLOCKSIZE_MIN
 #define STBDS_STRING_ARENA_BLOCKSIZE_MIN  512u
 #endif
@@ -1555,13 +2081,32 @@ static char *stbds_strdup(char *str)
 #endif
 
 char *stbds_stralloc(stbds_string_arena *a, char *str)
+{
+  return stbds_strnalloc(a, str, strlen(str));
+}
+
+char *stbds_strnalloc(stbds_string_arena *a, char *str, size_t n)
 {
   char *p;
-  size_t len = strlen(str)+1;
+  size_t len = n+1;
   if (len > a->remaining) {
-    // compute the next blocksize
+    stbds_string_block **spare = &a->spare;
     size_t blocksize = a->block;
 
+    // reuse the first block kept by stbds_strrewind that is big enough
+    while (*spare && (*spare)->size < len)
+      spare = &(*spare)->next;
+    if (*spare) {
+      stbds_string_block *sb = *spare;
+      *spare = sb->next;
+      sb->next = a->storage;
+      a->storage = sb;
+      a->remaining = sb->size;
+      goto have_space;
+    }
+
+    // compute the next blocksize
+
     // size is 512, 512, 1024, 1024, 2048, 2048, 4096, 4096, etc., so that
     // there are log(SIZE) allocations to free when we destroy the table
     blocksize = (size_t) (STBDS_STRING_ARENA_BLOCKSIZE_MIN) << (blocksize>>1);
@@ -1576,7 +2121,9 @@ char *stbds_stralloc(stbds_string_arena *a, char *str)
       // increasing, so e.g. if somebody only calls this with 1000-long strings,
       // eventually the arena will start doubling and handling those as well
       stbds_string_block *sb = (stbds_string_block *) STBDS_REALLOC(NULL, 0, sizeof(*sb)-8 + len);
-      memmove(sb->storage, str, len);
+      sb->size = len;
+      memmove(sb->storage, str, n);
+      sb->storage[n] = 0;
       if (a->storage) {
         // insert it after the first element, so that we don't waste the space there
         sb->next = a->storage->next;
@@ -1589,23 +2136,27 @@ char *stbds_stralloc(stbds_string_arena *a, char *str)
       return sb->storage;
     } else {
       stbds_string_block *sb = (stbds_string_block *) STBDS_REALLOC(NULL, 0, sizeof(*sb)-8 + blocksize);
+      sb->size = blocksize;
       sb->next = a->storage;
       a->storage = sb;
       a->remaining = blocksize;
     }
   }
 
+have_space:
   STBDS_ASSERT(len <= a->remaining);
   p = a->storage->storage + a->remaining - len;
   a->remaining -= len;
-  memmove(p, str, len);
+  memmove(p, str, n);
+  p[n] = 0;
   return p;
 }
 
 void stbds_strreset(stbds_string_arena *a)
 {
   stbds_string_block *x,*y;
-  x = a->storage;
+  stbds_strrewind(a);
+  x = a->spare;
   while (x) {
     y = x->next;
     STBDS_FREE(NULL, x);
@@ -1614,6 +2165,291 @@ void stbds_strreset(stbds_string_arena *a)
   memset(a, 0, sizeof(*a));
 }
 
+void stbds_strrewind(stbds_string_arena *a)
+{
+  // keep the block size progression in a->block, so new blocks stay as large as before
+  while (a->storage) {
+    stbds_string_block *x = a->storage;
+    a->storage = x->next;
+    x->next = a->spare;
+    a->spare = x;
+  }
+  a->remaining = 0;
+}
+
+#ifdef STBDS_THREAD_LOCAL
+static STBDS_THREAD_LOCAL stbds_string_arena stbds_thread_string_arena;
+
+stbds_string_arena *stbds_thread_arena(void)
+{
+  return &stbds_thread_string_arena;
+}
+#endif
+
+//
+// hashmap snapshots
+//
+// image layout: header, then the entry array (including the default entry at index 0),
+// the buckets, and the string keys, each section starting on a cache line. pointers to
+// string keys are stored as offsets into the string section, or (size_t) -1 for NULL.
+//
+
+typedef struct
+{
+  char   magic[8];
+  size_t check;           // catches images from builds with a different size_t or byte order
+  size_t flags;           // hash function options that change stored hashes
+  size_t bucket_length;
+  size_t elemsize;
+  size_t mode;
+  size_t length;          // entries, including the default entry
+  size_t slot_count;      // 0 for hashmaps that are still searched linearly
+  size_t used_count;
+  size_t tombstone_count;
+  size_t seed;
+  size_t entries_offset;
+  size_t buckets_offset;
+  size_t strings_offset;
+  size_t strings_size;
+  size_t total_size;
+} stbds_snapshot_header;
+
+static const char stbds_snapshot_magic[8] = { 's','t','b','d','s','h','m','1' };
+
+#ifdef STBDS_SIPHASH_2_4
+#define STBDS_SNAPSHOT_FLAGS  1
+#else
+#define STBDS_SNAPSHOT_FLAGS  0
+#endif
+
+static char **stbds_snapshot_key(void *raw_a, size_t elemsize, size_t i)
+{
+  return (char **) ((char *) raw_a + elemsize*i);
+}
+
+static size_t stbds_snapshot_key_length(void *raw_a, size_t elemsize, size_t i, int mode)
+{
+  if (mode == STBDS_HM_COUNTED)
+    return ((stbds_string_view *) ((char *) raw_a + elemsize*i))->len;
+  return strlen(*stbds_snapshot_key(raw_a, elemsize, i));
+}
+
+size_t stbds_hmsnapshot_func(void *a, size_t elemsize, void *buffer, size_t size, int mode)
+{
+  stbds_snapshot_header h;
+  stbds_hash_index *table = NULL;
+  void *raw_a = NULL;
+  size_t i;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, stbds_snapshot_magic, sizeof(h.magic));
+  h.check = (size_t) 0x01020304;
+  h.flags = STBDS_SNAPSHOT_FLAGS;
+  h.bucket_length = STBDS_BUCKET_LENGTH;
+  h.elemsize = elemsize;
+  h.mode = (size_t) mode;
+  if (a != NULL) {
+    raw_a = STBDS_HASH_TO_ARR(a,elemsize);
+    table = stbds_hash_table(raw_a);
+    h.length = stbds_header(raw_a)->length;
+  }
+  if (table) {
+    h.slot_count = table->slot_count;
+    h.used_count = table->used_count;
+    h.tombstone_count = table->tombstone_count;
+    h.seed = table->seed;
+  }
+  if (mode >= STBDS_HM_STRING)
+    for (i=0; i < h.length; ++i)
+      if (*stbds_snapshot_key(raw_a, elemsize, i))
+        h.strings_size += stbds_snapshot_key_length(raw_a, elemsize, i, mode) + 1;
+
+  h.entries_offset = STBDS_ALIGN_FWD(sizeof(h), STBDS_CACHE_LINE_SIZE);
+  h.buckets_offset = STBDS_ALIGN_FWD(h.entries_offset + h.length*elemsize, STBDS_CACHE_LINE_SIZE);
+  h.strings_offset = h.buckets_offset + (h.slot_count >> STBDS_BUCKET_SHIFT) * sizeof(stbds_hash_bucket);
+  h.total_size = h.strings_offset + h.strings_size;
+
+  if (buffer == NULL || size < h.total_size)
+    return h.total_size;
+
+  memset(buffer, 0, h.total_size);
+  memcpy(buffer, &h, sizeof(h));
+  if (h.length)
+    memcpy((char *) buffer + h.entries_offset, raw_a, h.length*elemsize);
+  if (h.slot_count)
+    memcpy((char *) buffer + h.buckets_offset, table->storage, (h.slot_count >> STBDS_BUCKET_SHIFT) * sizeof(stbds_hash_bucket));
+
+  if (mode >= STBDS_HM_STRING) {
+    size_t offset = 0;
+    for (i=0; i < h.length; ++i) {
+      char *key = *stbds_snapshot_key(raw_a, elemsize, i);
+      size_t stored = (size_t) -1;
+      if (key) {
+        size_t len = stbds_snapshot_key_length(raw_a, elemsize, i, mode);
+        memcpy((char *) buffer + h.strings_offset + offset, key, len);  // nul is already there from the memset
+        stored = offset;
+        offset += len + 1;
+      }
+      memcpy((char *) buffer + h.entries_offset + elemsize*i, &stored, sizeof(stored));
+    }
+  }
+  return h.total_size;
+}
+
+// a+b and a*b, failing instead of wrapping around
+static int stbds_size_add(size_t a, size_t b, size_t *result)
+{
+  if (a > (size_t) -1 - b) return 0;
+  *result = a + b;
+  return 1;
+}
+
+static int stbds_size_mul(size_t a, size_t b, size_t *result)
+{
+  if (b != 0 && a > (size_t) -1 / b) return 0;
+  *result = a * b;
+  return 1;
+}
+
+// every bucket slot must be empty, a tombstone, or the only reference to an
+// entry, and every entry must be found again where its slot says it is;
+// otherwise a later hmdel could index the storage with a bogus slot
+static int stbds_hm_index_is_valid(void *a, size_t elemsize, size_t keysize, int mode)
+{
+  stbds_hash_index *table = stbds_hash_table(a);
+  size_t count = stbds_header(a)->length - 1, used = 0, tombstones = 0, empty = 0, i;
+  char *seen = (char *) STBDS_REALLOC(NULL, NULL, count ? count : 1);
+  int valid = 1;
+
+  memset(seen, 0, count ? count : 1);
+  for (i=0; valid && i < table->slot_count; ++i) {
+    stbds_hash_bucket *b = &table->storage[i >> STBDS_BUCKET_SHIFT];
+    size_t hash = b->hash[i & STBDS_BUCKET_MASK];
+    ptrdiff_t index = b->index[i & STBDS_BUCKET_MASK];
+    if (index == STBDS_INDEX_EMPTY && hash == STBDS_HASH_EMPTY) {
+      ++empty;
+    } else if (index == STBDS_INDEX_DELETED && hash == STBDS_HASH_DELETED) {
+      ++tombstones;
+    } else if (index >= 0 && (size_t) index < count && hash >= 2 && !seen[index]) {
+      seen[index] = 1;
+      ++used;
+    } else {
+      valid = 0;
+    }
+  }
+  STBDS_FREE(NULL, seen);
+  if (!valid || used != table->used_count || tombstones != table->tombstone_count || empty == 0)
+    return 0;
+  if (used > table->used_count_threshold || tombstones > table->tombstone_count_threshold)
+    return 0;
+
+  // the lookups below hash each key once; that is still far cheaper than
+  // inserting them again, and it catches duplicate keys and stale hashes
+  a = STBDS_ARR_TO_HASH(a,elemsize);
+  for (i=0; i < count; ++i) {
+    char *entry = (char *) a + elemsize*i;
+    ptrdiff_t slot;
+    if (mode == STBDS_HM_COUNTED) {
+      stbds_string_view *v = (stbds_string_view *) entry;
+      slot = stbds_hm_find_slot(a, elemsize, v->str, v->len, 0, mode);
+    } else if (mode >= STBDS_HM_STRING) {
+      slot = stbds_hm_find_slot(a, elemsize, *(char **) entry, keysize, 0, mode);
+    } else {
+      slot = stbds_hm_find_slot(a, elemsize, entry, keysize, 0, mode);
+    }
+    if (slot < 0 || table->storage[slot >> STBDS_BUCKET_SHIFT].index[slot & STBDS_BUCKET_MASK] != (ptrdiff_t) i)
+      return 0;
+  }
+  return 1;
+}
+
+// copies the image into a new map; see the hmload docs for why it isn't a view,
+// and why every key is looked up once before the map is handed out
+void * stbds_hmload_func(void *image, size_t size, size_t elemsize, size_t keysize, int mode)
+{
+  stbds_snapshot_header h;
+  stbds_hash_index *table;
+  void *a;
+  size_t i, entries_size, entries_end, buckets_size, buckets_end, strings_end;
+
+  // reject anything we can't use as-is; the caller is expected to rebuild instead
+  if (image == NULL || size < sizeof(h))
+    return NULL;
+  memcpy(&h, image, sizeof(h));
+  if (memcmp(h.magic, stbds_snapshot_magic, sizeof(h.magic)) != 0 || h.check != (size_t) 0x01020304)
+    return NULL;
+  if (h.flags != STBDS_SNAPSHOT_FLAGS || h.bucket_length != STBDS_BUCKET_LENGTH)
+    return NULL;
+  if (h.elemsize != elemsize || h.mode != (size_t) mode || h.length == 0 || h.total_size > size)
+    return NULL;
+  if (h.used_count != h.length-1 || (h.slot_count == 0 && h.tombstone_count != 0))
+    return NULL;
+  if (h.slot_count != 0 && (h.slot_count < STBDS_BUCKET_LENGTH || (h.slot_count & (h.slot_count-1)) != 0))
+    return NULL;
+
+  // every offset and size comes from the image, so none of this math may wrap
+  if (!stbds_size_mul(h.length, elemsize, &entries_size) || !stbds_size_add(h.entries_offset, entries_size, &entries_end))
+    return NULL;
+  if (!stbds_size_mul(h.slot_count >> STBDS_BUCKET_SHIFT, sizeof(stbds_hash_bucket), &buckets_size) || !stbds_size_add(h.buckets_offset, buckets_size, &buckets_end))
+    return NULL;
+  if (!stbds_size_add(h.strings_offset, h.strings_size, &strings_end))
+    return NULL;
+  if (h.entries_offset < sizeof(h) || entries_end > h.buckets_offset || buckets_end != h.strings_offset || strings_end != h.total_size)
+    return NULL;
+
+  a = stbds_arrgrowf(0, elemsize, 0, h.length);
+  memcpy(a, (char *) image + h.entries_offset, h.length*elemsize);
+  stbds_header(a)->length = h.length;
+
+  if (h.slot_count == 0) {
+    table = stbds_make_linear_index();
+  } else {
+    table = stbds_make_hash_index(h.slot_count, NULL);
+    memcpy(table->storage, (char *) image + h.buckets_offset, buckets_size);
+  }
+  table->used_count = h.used_count;
+  table->tombstone_count = h.tombstone_count;
+  table->seed = h.seed;
+  stbds_header(a)->hash_table = table;
+
+  if (mode >= STBDS_HM_STRING) {
+    // all the keys go into one arena block, so loading costs a single allocation
+    char *strings = NULL;
+    table->string.mode = STBDS_SH_ARENA;
+    if (h.strings_size) {
+      stbds_string_block *sb = (stbds_string_block *) STBDS_REALLOC(NULL, 0, sizeof(*sb)-8 + h.strings_size);
+      sb->next = NULL;
+      sb->size = h.strings_size;
+      memcpy(sb->storage, (char *) image + h.strings_offset, h.strings_size);
+      table->string.storage = sb;
+      table->string.remaining = 0;
+      strings = sb->storage;
+    }
+    for (i=0; i < h.length; ++i) {
+      size_t stored;
+      char **key = stbds_snapshot_key(a, elemsize, i);
+      memcpy(&stored, key, sizeof(stored));
+      // only the default entry may have no key, and a key with its nul must
+      // fit inside the string block
+      if (stored == (size_t) -1 && i == 0) {
+        *key = NULL;
+      } else if (stored < h.strings_size && strings[h.strings_size-1] == 0
+                 && (mode != STBDS_HM_COUNTED || ((stbds_string_view *) key)->len < h.strings_size - stored)) {
+        *key = strings + stored;
+      } else {
+        stbds_hmfree_func(a, elemsize);
+        return NULL;
+      }
+    }
+  }
+
+  if (h.slot_count != 0 && !stbds_hm_index_is_valid(a, elemsize, keysize, mode)) {
+    stbds_hmfree_func(a, elemsize);
+    return NULL;
+  }
+  return STBDS_ARR_TO_HASH(a,elemsize);
+}
+
 #endif
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1654,7 +2490,7 @@ void stbds_unit_tests(void)
   const int testsize = 100000;
   const int testsize2 = testsize/20;
   int *arr=NULL;
-  struct { int   key;        int value; }  *intmap  = NULL;
+  struct { int   key;        int value; }  *intmap  = NULL, *intitems = NULL;
   struct { char *key;        int value; }  *strmap  = NULL, s;
   struct { stbds_struct key; int value; }  *map     = NULL;
   stbds_struct                             *map2    = NULL;
@@ -1734,10 +2570,160 @@ void stbds_unit_tests(void)
   #endif
   #endif
 
+  arrsetlen(intitems, testsize);
+  for (i=0; i < testsize; ++i) {
+    intitems[i].key = i >> 1;
+    intitems[i].value = i;
+  }
+  hmbuild(intmap, intitems, testsize);
+  STBDS_ASSERT(hmlen(intmap) == testsize/2);
+  for (i=0; i < testsize/2; ++i)
+    STBDS_ASSERT(hmget(intmap, i) == i*2+1); // last duplicate wins
+  hmfree(intmap);
+
+  #ifdef STBDS_THREADS
+  {
+    // big enough to hash on several threads; must come out exactly as hmput would make it
+    size_t big = STBDS_BUILD_PARALLEL_MIN + 3;
+    struct { int key; int value; } *serial = NULL;
+    arrsetlen(intitems, big);
+    for (i=0; i < (int) big; ++i) {
+      intitems[i].key = (i * 7919) % (int) (big/2);
+      intitems[i].value = i;
+    }
+    hmbuild(intmap, intitems, big);
+    for (i=0; i < (int) big; ++i)
+      hmput(serial, intitems[i].key, intitems[i].value);
+    STBDS_ASSERT(hmlen(intmap) == hmlen(serial));
+    for (i=0; i < hmlen(serial); ++i) {
+      STBDS_ASSERT(intmap[i].key == serial[i].key);
+      STBDS_ASSERT(intmap[i].value == serial[i].value);
+      STBDS_ASSERT(hmget(intmap, serial[i].key) == serial[i].value);
+    }
+    hmfree(serial);
+    hmfree(intmap);
+  }
+  #endif
+  arrfree(intitems);
+
+  for (i=0; i < 12; ++i) {
+    // crosses STBDS_HM_LINEAR_LIMIT, so the index is built in the middle
+    hmput(intmap, i, i);
+    for (j=0; j <= i; ++j)
+      STBDS_ASSERT(hmget(intmap, j) == j);
+    j = i+1;
+    STBDS_ASSERT(hmgeti(intmap, j) == -1);
+  }
+  i = 3;
+  STBDS_ASSERT(hmdel(intmap, i) == 1);
+  STBDS_ASSERT(hmdel(intmap, i) == 0);
+  STBDS_ASSERT(hmgeti(intmap, i) == -1);
+  i = 11;
+  STBDS_ASSERT(hmget(intmap, i) == 11);
+  hmfree(intmap);
+  for (i=0; i < 4; ++i)
+    hmput(intmap, i, i);
+  i = 0;
+  STBDS_ASSERT(hmdel(intmap, i) == 1);
+  STBDS_ASSERT(hmdel(intmap, i) == 0);
+  STBDS_ASSERT(hmlen(intmap) == 3);
+  i = 3;
+  STBDS_ASSERT(hmget(intmap, i) == 3);
+  hmreserve(intmap, 20);
+  i = 2;
+  STBDS_ASSERT(hmget(intmap, i) == 2);
+  hmfree(intmap);
+
+  {
+    void *image;
+    size_t size;
+    for (i=0; i < testsize; i += 3)
+      hmput(intmap, i, i*2);
+    hmdefault(intmap, -7);
+    size = hmsnapshot(intmap, NULL, 0);
+    image = malloc(size);
+    STBDS_ASSERT(hmsnapshot(intmap, image, size) == size);
+    hmfree(intmap);
+    hmload(intmap, image, size);
+    for (i=0; i < testsize; ++i)
+      STBDS_ASSERT(hmget(intmap, i) == (i % 3 ? -7 : i*2));
+    hmfree(intmap);
+    hmload(intmap, image, size-1);
+    STBDS_ASSERT(intmap == NULL);
+    {
+      // damaged images must be refused rather than trusted
+      stbds_snapshot_header *h = (stbds_snapshot_header *) image;
+      stbds_hash_bucket *buckets = (stbds_hash_bucket *) ((char *) image + h->buckets_offset);
+      size_t length = h->length, slot = 0;
+      ptrdiff_t index;
+      h->length = (size_t) -1 / sizeof(*intmap) + 2;
+      hmload(intmap, image, size);
+      STBDS_ASSERT(intmap == NULL);
+      h->length = length;
+      while (buckets[slot >> STBDS_BUCKET_SHIFT].index[slot & STBDS_BUCKET_MASK] < 0)
+        ++slot;
+      index = buckets[slot >> STBDS_BUCKET_SHIFT].index[slot & STBDS_BUCKET_MASK];
+      buckets[slot >> STBDS_BUCKET_SHIFT].index[slot & STBDS_BUCKET_MASK] = (ptrdiff_t) length;
+      hmload(intmap, image, size);
+      STBDS_ASSERT(intmap == NULL);
+      buckets[slot >> STBDS_BUCKET_SHIFT].index[slot & STBDS_BUCKET_MASK] = index ? 0 : 1;
+      hmload(intmap, image, size);
+      STBDS_ASSERT(intmap == NULL);
+      buckets[slot >> STBDS_BUCKET_SHIFT].index[slot & STBDS_BUCKET_MASK] = index;
+      buckets[slot >> STBDS_BUCKET_SHIFT].hash[slot & STBDS_BUCKET_MASK] ^= 4;
+      hmload(intmap, image, size);
+      STBDS_ASSERT(intmap == NULL);
+      buckets[slot >> STBDS_BUCKET_SHIFT].hash[slot & STBDS_BUCKET_MASK] ^= 4;
+      hmload(intmap, image, size);
+      i = 3;
+      STBDS_ASSERT(hmget(intmap, i) == 6);
+      hmfree(intmap);
+    }
+    free(image);
+  }
+
+  hmreserve(intmap, testsize);
+  for (i=0; i < testsize; ++i)
+    hmput(intmap, i, i*7);
+  for (i=0; i < testsize; ++i)
+    STBDS_ASSERT(hmget(intmap, i) == i*7);
+  hmfree(intmap);
+
+  {
+    struct { char *key; int value; } items[3] = { { "a", 1 }, { "b", 2 }, { "a", 3 } };
+    sh_new_strdup(strmap);
+    shbuild(strmap, items, 3);
+    STBDS_ASSERT(shlen(strmap) == 2);
+    STBDS_ASSERT(shget(strmap, "a") == 3);
+    STBDS_ASSERT(shget(strmap, "b") == 2);
+    STBDS_ASSERT(shgetp(strmap, "a")->key != items[0].key);
+    shfree(strmap);
+  }
+
   for (i=0; i < testsize; ++i)
     stralloc(&sa, strkey(i));
   strreset(&sa);
 
+  {
+    char *first, *big;
+    first = stralloc(&sa, "hello");
+    big = strnalloc(&sa, buffer, sizeof(buffer)-1);
+    STBDS_ASSERT(big[sizeof(buffer)-1] == 0);
+    for (j=0; j < 4; ++j) {
+      strrewind(&sa);
+      STBDS_ASSERT(stralloc(&sa, "world") == first); // blocks are reused, not reallocated
+      STBDS_ASSERT(strnalloc(&sa, "abcdef", 3)[3] == 0);
+      for (i=0; i < testsize2; ++i)
+        stralloc(&sa, strkey(i));
+    }
+    strreset(&sa);
+  }
+
+  #ifdef STBDS_THREAD_LOCAL
+  STBDS_ASSERT(strcmp(stralloc(stbds_thread_arena(), "thread"), "thread") == 0);
+  strreset(stbds_thread_arena());
+  #endif
+
   {
     s.key = "a", s.value = 1;
     shputs(strmap, s);
@@ -1793,6 +2779,77 @@ void stbds_unit_tests(void)
     shfree(strmap);
   }
 
+  for (j=0; j < 2; ++j) {
+    // snapshots of small (linear) and large (indexed) string hashmaps
+    void *image;
+    size_t size, count = j ? testsize2 : 4;
+    sh_new_strdup(strmap);
+    for (i=0; i < (int) count; ++i)
+      shput(strmap, strkey(i), i);
+    size = shsnapshot(strmap, NULL, 0);
+    image = malloc(size);
+    shsnapshot(strmap, image, size);
+    shfree(strmap);
+    shload(strmap, image, size);
+    free(image);
+    STBDS_ASSERT(shlen(strmap) == (ptrdiff_t) count);
+    for (i=0; i < (int) count; ++i)
+      STBDS_ASSERT(shget(strmap, strkey(i)) == i);
+    STBDS_ASSERT(shgeti(strmap, "missing") == -1);
+    shput(strmap, "added", 1);
+    STBDS_ASSERT(shget(strmap, "added") == 1);
+    shfree(strmap);
+  }
+
+  for (j=0; j < 3; ++j) {
+    struct { stbds_string_view key; int value; } *cmap = NULL;
+    char line[] = "set key value key";
+    if (j == 1)
+      sh_new_strdup(cmap);
+    else if (j == 2)
+      sh_new_arena(cmap);
+    shnput(cmap, line+0,  3, 1);
+    shnput(cmap, line+4,  3, 2);
+    shnput(cmap, line+8,  5, 3);
+    shnput(cmap, line+14, 3, 4); // same key as line+4
+    STBDS_ASSERT(shlen(cmap) == 3);
+    STBDS_ASSERT(shnget(cmap, "key", 3) == 4);
+    STBDS_ASSERT(shngeti(cmap, "ke", 2) == -1);
+    STBDS_ASSERT(shngeti(cmap, "keys", 4) == -1);
+    STBDS_ASSERT(shngetp_null(cmap, "value", 5)->value == 3);
+    if (j != 0)
+      STBDS_ASSERT(shngetp(cmap, "set", 3)->key.str[3] == 0);
+    STBDS_ASSERT(shndel(cmap, "set", 3) == 1);
+    STBDS_ASSERT(shndel(cmap, "set", 3) == 0);
+    STBDS_ASSERT(shnget(cmap, "value", 5) == 3);
+    {
+      void *image;
+      size_t size = shnsnapshot(cmap, NULL, 0);
+      image = malloc(size);
+      shnsnapshot(cmap, image, size);
+      shfree(cmap);
+      shnload(cmap, image, size);
+      {
+        // a key length running past the string block must be refused
+        stbds_snapshot_header *h = (stbds_snapshot_header *) image;
+        stbds_string_view *v = (stbds_string_view *) ((char *) image + h->entries_offset + sizeof(*cmap));
+        v->len = h->strings_size;
+        STBDS_ASSERT(stbds_hmload_func(image, size, sizeof(*cmap), sizeof(cmap->key), STBDS_HM_COUNTED) == NULL);
+      }
+      free(image);
+      STBDS_ASSERT(shlen(cmap) == 2);
+      STBDS_ASSERT(shnget(cmap, "key", 3) == 4);
+      STBDS_ASSERT(shnget(cmap, "value", 5) == 3);
+    }
+    if (j != 0) {
+      for (i=0; i < testsize2; ++i)
+        shnput(cmap, strkey(i), strlen(strkey(i)), i);
+      for (i=0; i < testsize2; ++i)
+        STBDS_ASSERT(shnget(cmap, strkey(i), strlen(strkey(i))) == i);
+    }
+    shfree(cmap);
+  }
+
   {
     struct { char *key; char value; } *hash = NULL;
     char name[4] = "jen";
@@ -0,0 +1,103 @@
+/* Checks that a C++20 coroutine command can ask a question with co_await, get
+   the answer from the session's next line, and clean up if the session ends
+   before it is answered.
+
+       c++ -std=c++20 -o await_test tests/await.cpp && ./await_test
+
+   Exits with 0 if everything passed. */
+
+#include <string.h>
+
+#include "../imcli.h"
+
+#define STB_DS_IMPLEMENTATION
+#include "../stb_ds.h"
+
+static int abandoned = 0;
+
+static imcli_task confirm(imcli_session *session, string_buffer args) {
+    while (true) {
+        imcli_printf(session, "Delete %s? ", args[0]);
+        string_buffer answer = co_await imcli_next_words(session);
+
+        if (!answer) {
+            abandoned += 1;
+            sbfree(&args);
+            co_return false;
+        }
+
+        bool yes = arrlen(answer) > 0 && strcmp(answer[0], "yes") == 0;
+        bool no = arrlen(answer) > 0 && strcmp(answer[0], "no") == 0;
+        sbfree(&answer);
+
+        if (yes || no) {
+            imcli_printf(session, yes ? "deleted %s\n" : "kept %s\n", args[0]);
+            sbfree(&args);
+            co_return true;
+        }
+    }
+}
+
+static bool delete_command(
+    imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)userdata;
+    return imcli_task_run(confirm(session, imcli_copy_words(*args)));
+}
+
+static bool run(
+    imcli_session *session,
+    imcli_registry *registry,
+    const char *text
+) {
+    char_buffer line = NULL;
+    memcpy(arraddnptr(line, strlen(text)), text, strlen(text));
+    string_buffer words = split_words(line);
+    arrfree(line);
+
+    bool keep_going = imcli_dispatch(session, registry, &words);
+    sbfree(&words);
+    return keep_going;
+}
+
+int main(void) {
+    int failures = 0;
+
+    imcli_registry registry = {};
+    imcli_register(&registry, imcli_command{
+        .keywords = "delete",
+        .help_message = "delete <name>\n",
+        .handler = delete_command,
+    });
+
+    char_buffer out = NULL;
+    imcli_session session = imcli_session_new(NULL, NULL);
+    imcli_session_set_sink(&session, imcli_sink_memory(&out));
+
+    run(&session, &registry, "delete notes.txt");
+    run(&session, &registry, "maybe");
+    run(&session, &registry, "yes");
+    run(&session, &registry, "delete todo.txt");
+    imcli_session_free(&session);
+
+    arrpush(out, '\0');
+    const char *expected =
+        "Delete notes.txt? Delete notes.txt? deleted notes.txt\n"
+        "Delete todo.txt? ";
+    if (strcmp(out, expected) != 0) {
+        printf("FAIL: wrote '%s'\n", out);
+        failures += 1;
+    }
+    if (abandoned != 1) {
+        printf("FAIL: the unanswered question wasn't cleaned up\n");
+        failures += 1;
+    }
+
+    arrfree(out);
+    imcli_registry_free(&registry);
+
+    if (failures == 0) printf("ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,265 @@
+/* Checks that frames decode to exactly the words they were encoded from,
+   empty ones included, whether they're taken from bytes fed to a session in
+   pieces or read from its input; that frames which don't add up are refused;
+   and that a frame runs the same handler its line of text would.
+
+       cc -std=c11 -o frames_test tests/frames.c && ./frames_test
+
+   Exits with 0 if everything passed. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+
+#include "../imcli.h"
+
+#define STB_DS_IMPLEMENTATION
+#include "../stb_ds.h"
+
+static bool say_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)userdata;
+    imcli_printf(session, "said %d:", (int)arrlen(*args));
+    for (int i = 0; i < arrlen(*args); i++) {
+        imcli_printf(session, " [%s]", (*args)[i]);
+    }
+    imcli_printf(session, "\n");
+    return true;
+}
+
+static int failures = 0;
+
+static void expect_words(
+    char *what,
+    uint32_t command,
+    string_buffer words,
+    uint32_t expected_command,
+    int argc,
+    char **argv
+) {
+    bool same = command == expected_command && arrlen(words) == argc;
+    for (int i = 0; same && i < argc; i++) {
+        same = strlen(words[i]) == strlen(argv[i])
+            && strcmp(words[i], argv[i]) == 0;
+    }
+    if (!same) {
+        printf("FAIL: %s came back as command %u with %d words\n",
+            what, (unsigned)command, (int)arrlen(words));
+        failures += 1;
+    }
+}
+
+/* Encodes a frame, then gets it back every way a session can. */
+static void round_trip(char *what, uint32_t command, int argc, char **argv) {
+    char_buffer frame = NULL;
+    imcli_encode_frame(&frame, command, argc, argv);
+
+    uint32_t decoded_command = 0;
+    string_buffer words = NULL;
+    if (!imcli_decode_frame_body(
+        frame + 4,
+        arrlen(frame) - 4,
+        &decoded_command,
+        &words
+    )) {
+        printf("FAIL: %s didn't decode\n", what);
+        failures += 1;
+    } else {
+        expect_words(what, decoded_command, words, command, argc, argv);
+    }
+    sbfree(&words);
+
+    /* One byte at a time, so every partial frame gets seen. */
+    struct imcli_session session = imcli_session_new(NULL, NULL);
+    int result = 0;
+    for (int i = 0; i < arrlen(frame); i++) {
+        if (result != 0) {
+            printf("FAIL: %s was taken before it was all there\n", what);
+            failures += 1;
+            break;
+        }
+        imcli_feed(&session, &frame[i], 1);
+        result = imcli_take_frame(&session, &decoded_command, &words);
+    }
+    if (result != 1) {
+        printf("FAIL: %s wasn't taken from fed bytes\n", what);
+        failures += 1;
+    } else {
+        expect_words(what, decoded_command, words, command, argc, argv);
+        if (arrlen(session.pending) != 0) {
+            printf("FAIL: %s left bytes behind\n", what);
+            failures += 1;
+        }
+    }
+    sbfree(&words);
+    imcli_session_free(&session);
+
+    FILE *input = fmemopen(frame, arrlen(frame), "r");
+    session = imcli_session_new(input, NULL);
+    if (imcli_read_frame(&session, &decoded_command, &words) != 1) {
+        printf("FAIL: %s wasn't read from the input\n", what);
+        failures += 1;
+    } else {
+        expect_words(what, decoded_command, words, command, argc, argv);
+    }
+    sbfree(&words);
+    if (imcli_read_frame(&session, &decoded_command, &words) != 0) {
+        printf("FAIL: reading past %s didn't find the end\n", what);
+        failures += 1;
+    }
+    imcli_session_free(&session);
+    fclose(input);
+
+    arrfree(frame);
+}
+
+static void expect_refused(char *what, char_buffer frame) {
+    uint32_t command = 0;
+    string_buffer words = NULL;
+    if (imcli_decode_frame_body(frame + 4, arrlen(frame) - 4, &command, &words)) {
+        printf("FAIL: %s was decoded\n", what);
+        failures += 1;
+        sbfree(&words);
+    }
+}
+
+/* Runs a frame, and returns what it wrote. */
+static char_buffer run_frame(
+    struct imcli_registry *registry,
+    uint32_t command,
+    int argc,
+    char **argv
+) {
+    char_buffer out = NULL;
+    char_buffer frame = NULL;
+    imcli_encode_frame(&frame, command, argc, argv);
+
+    struct imcli_session session = imcli_session_new(NULL, NULL);
+    imcli_session_set_sink(&session, imcli_sink_memory(&out));
+    imcli_feed(&session, frame, arrlen(frame));
+
+    uint32_t decoded_command;
+    string_buffer words = NULL;
+    if (imcli_take_frame(&session, &decoded_command, &words) == 1) {
+        imcli_dispatch_frame(&session, registry, decoded_command, &words);
+    }
+    sbfree(&words);
+    imcli_session_free(&session);
+    arrfree(frame);
+
+    arrpush(out, '\0');
+    return out;
+}
+
+static void expect_output(
+    char *what,
+    char_buffer out,
+    char *expected
+) {
+    if (strcmp(out, expected) != 0) {
+        printf("FAIL: %s wrote '%s', expected '%s'\n", what, out, expected);
+        failures += 1;
+    }
+    arrfree(out);
+}
+
+int main(void) {
+    round_trip("no arguments", 0, 0, NULL);
+    round_trip("one argument", 3, 1, (char *[]){"hello"});
+    round_trip("an empty argument", 1, 1, (char *[]){""});
+    round_trip("empty arguments around others", 2, 5,
+        (char *[]){"", "a", "", "b c", ""});
+    round_trip("a keyword frame", IMCLI_FRAME_BY_KEYWORD, 3,
+        (char *[]){"say", "", "x"});
+
+    /* Bytes that a line of text would have split or stopped at. */
+    round_trip("odd bytes", 7, 3, (char *[]){"a\nb", "\t \"", "\xff\x80"});
+
+    char big[5000];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    round_trip("a long argument", 4, 2, (char *[]){big, ""});
+
+    /* Two frames fed at once come out one after the other. */
+    char_buffer frames = NULL;
+    imcli_encode_frame(&frames, 1, 1, (char *[]){"first"});
+    imcli_encode_frame(&frames, 2, 2, (char *[]){"", "second"});
+    struct imcli_session session = imcli_session_new(NULL, NULL);
+    imcli_feed(&session, frames, arrlen(frames));
+    uint32_t command;
+    string_buffer words = NULL;
+    if (imcli_take_frame(&session, &command, &words) == 1) {
+        expect_words("the first of two frames", command, words,
+            1, 1, (char *[]){"first"});
+    } else {
+        printf("FAIL: the first of two frames wasn't taken\n");
+        failures += 1;
+    }
+    sbfree(&words);
+    if (imcli_take_frame(&session, &command, &words) == 1) {
+        expect_words("the second of two frames", command, words,
+            2, 2, (char *[]){"", "second"});
+    } else {
+        printf("FAIL: the second of two frames wasn't taken\n");
+        failures += 1;
+    }
+    sbfree(&words);
+    if (imcli_take_frame(&session, &command, &words) != 0) {
+        printf("FAIL: a third frame came out of two\n");
+        failures += 1;
+    }
+    imcli_session_free(&session);
+    arrfree(frames);
+
+    /* An argument running past the end of its frame. */
+    char_buffer frame = NULL;
+    imcli_put_u32(&frame, 16);
+    imcli_put_u32(&frame, 0);
+    imcli_put_u32(&frame, 1);
+    imcli_put_u32(&frame, 5);
+    memcpy(arraddnptr(frame, 4), "abcd", 4);
+    expect_refused("an argument longer than its frame", frame);
+    arrfree(frame);
+
+    /* More arguments than could fit. */
+    imcli_put_u32(&frame, 12);
+    imcli_put_u32(&frame, 0);
+    imcli_put_u32(&frame, 2);
+    imcli_put_u32(&frame, 0);
+    expect_refused("a frame short of arguments", frame);
+    arrfree(frame);
+
+    imcli_put_u32(&frame, 4);
+    imcli_put_u32(&frame, 0);
+    expect_refused("a frame without an argument count", frame);
+    arrfree(frame);
+
+    struct imcli_registry registry = {0};
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "say",
+        .help_message = "say\n",
+        .handler = say_command,
+    });
+
+    expect_output("a frame by index",
+        run_frame(&registry, 0, 3, (char *[]){"a", "", "b"}),
+        "said 3: [a] [] [b]\n");
+    expect_output("a frame by keyword",
+        run_frame(&registry, IMCLI_FRAME_BY_KEYWORD, 3,
+            (char *[]){"say", "", "b"}),
+        "said 2: [] [b]\n");
+    char_buffer out = run_frame(&registry, 9, 0, NULL);
+    if (!strstr(out, "Unknown command number 9.")) {
+        printf("FAIL: a frame for a missing command wrote '%s'\n", out);
+        failures += 1;
+    }
+    arrfree(out);
+
+    imcli_registry_free(&registry);
+
+    if (failures == 0) printf("ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+/* Checks that background jobs run, that `jobs` and `wait`, which look at the
+   job list, refuse to run as jobs themselves, that aliases are expanded
+   before a line becomes a job, while `alias` itself can't become one, and
+   that `&` can end a whole pipe, or the last of several commands.
+
+       cc -std=c11 -o jobs_test tests/jobs.c -lpthread && ./jobs_test
+
+   Exits with 0 if everything passed. */
+
+#define IMCLI_THREADS
+
+#include <string.h>
+
+#include "../imcli.h"
+
+#define STB_DS_IMPLEMENTATION
+#include "../stb_ds.h"
+
+static bool say_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)userdata;
+    char_buffer text = join_words(*args);
+    imcli_printf(session, "said %s\n", text);
+    arrfree(text);
+    return true;
+}
+
+/* Runs one line the way a prompt loop would, and returns what it wrote. */
+static char_buffer run(
+    struct imcli_registry *registry,
+    struct imcli_jobs *jobs,
+    char *text
+) {
+    char_buffer out = NULL;
+    struct imcli_session session = imcli_session_new(NULL, NULL);
+    imcli_session_set_sink(&session, imcli_sink_memory(&out));
+
+    char_buffer line = NULL;
+    memcpy(arraddnptr(line, strlen(text)), text, strlen(text));
+    string_buffer words = split_words(line);
+    arrfree(line);
+
+    imcli_dispatch_jobs(&session, registry, jobs, &words);
+    sbfree(&words);
+    imcli_session_free(&session);
+
+    arrpush(out, '\0');
+    return out;
+}
+
+static int failures = 0;
+
+static void expect(
+    struct imcli_registry *registry,
+    struct imcli_jobs *jobs,
+    char *line,
+    char *expected
+) {
+    char_buffer out = run(registry, jobs, line);
+    if (!strstr(out, expected)) {
+        printf("FAIL: '%s' wrote '%s', expected '%s'\n", line, out, expected);
+        failures += 1;
+    }
+    arrfree(out);
+}
+
+int main(void) {
+    struct imcli_registry registry = {0};
+    struct imcli_jobs jobs = {0};
+    struct imcli_aliases aliases = {0};
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "say",
+        .help_message = "say\n",
+        .handler = say_command,
+    });
+    imcli_register_job_commands(&registry, &jobs);
+    imcli_register_alias_commands(&registry, &aliases);
+
+    expect(&registry, &jobs, "say hello &", "[1] started");
+    expect(&registry, &jobs, "wait &", "'wait' can't run in the background.");
+    expect(&registry, &jobs, "jobs &", "'jobs' can't run in the background.");
+    if (arrlen(jobs.list) != 1) {
+        printf("FAIL: refused commands still started jobs\n");
+        failures += 1;
+    }
+
+    expect(&registry, &jobs, "jobs", "[1] ");
+    expect(&registry, &jobs, "wait", "said hello");
+    if (arrlen(jobs.list) != 0) {
+        printf("FAIL: wait left jobs behind\n");
+        failures += 1;
+    }
+
+    expect(&registry, &jobs, "alias greet say hi", "");
+    expect(&registry, &jobs, "greet there &", "[2] started");
+    expect(&registry, &jobs, "alias x y &", "'alias' can't run in the background.");
+    expect(&registry, &jobs, "unalias greet &",
+        "'unalias' can't run in the background.");
+    expect(&registry, &jobs, "wait", "said hi there");
+    expect(&registry, &jobs, "x", "Unknown command 'x'.");
+
+    /* `&` ends a list of commands, like `;`, and takes the whole pipe. */
+    expect(&registry, &jobs, "say first ; say second &", "said first");
+    expect(&registry, &jobs, "say a | say b &", "[4] started");
+    expect(&registry, &jobs, "say c | jobs &", "'jobs' can't run in the background.");
+    expect(&registry, &jobs, "wait 3", "said second");
+    expect(&registry, &jobs, "wait", "said b said a");
+    if (arrlen(jobs.list) != 0) {
+        printf("FAIL: refused pipes still started jobs\n");
+        failures += 1;
+    }
+
+    imcli_jobs_free(&jobs);
+    imcli_aliases_free(&aliases);
+    imcli_registry_free(&registry);
+
+    if (failures == 0) printf("ok\n");
+    return failures == 0 ? 0 : 1;
+}
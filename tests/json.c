@@ -0,0 +1,99 @@
+/* Checks that imcli_json_string escapes every control byte, quote and
+   backslash, wherever it falls in the eight bytes checked at once, and passes
+   everything else through untouched, including bytes from 0x80 up.
+
+       cc -std=c11 -o json_test tests/json.c && ./json_test
+
+   Exits with 0 if everything passed. */
+
+#include <string.h>
+
+#include "../imcli.h"
+
+#define STB_DS_IMPLEMENTATION
+#include "../stb_ds.h"
+
+static int failures = 0;
+
+static void expect_json(char *what, char *str, size_t len, char *expected) {
+    char_buffer out = NULL;
+    imcli_json_string(&out, str, len);
+    arrpush(out, '\0');
+    if (strcmp(out, expected) != 0) {
+        printf("FAIL: %s came out as %s, expected %s\n", what, out, expected);
+        failures += 1;
+    }
+    arrfree(out);
+}
+
+/* What one byte should turn into, the slow and obvious way. */
+static void escape_byte(char_buffer *out, unsigned char byte) {
+    char text[8];
+    switch (byte) {
+    case '"': strcpy(text, "\\\""); break;
+    case '\\': strcpy(text, "\\\\"); break;
+    case '\b': strcpy(text, "\\b"); break;
+    case '\t': strcpy(text, "\\t"); break;
+    case '\n': strcpy(text, "\\n"); break;
+    case '\f': strcpy(text, "\\f"); break;
+    case '\r': strcpy(text, "\\r"); break;
+    default:
+        if (byte < 0x20) {
+            snprintf(text, sizeof(text), "\\u%04x", byte);
+        } else {
+            text[0] = (char)byte;
+            text[1] = '\0';
+        }
+    }
+    memcpy(arraddnptr(*out, strlen(text)), text, strlen(text));
+}
+
+int main(void) {
+    expect_json("nothing", "", 0, "\"\"");
+    expect_json("plain text", "hello", 5, "\"hello\"");
+    expect_json("a quote and a backslash", "a\"b\\c", 5, "\"a\\\"b\\\\c\"");
+    expect_json("short escapes", "\b\t\n\f\r", 5, "\"\\b\\t\\n\\f\\r\"");
+    expect_json("a zero byte", "a\0b", 3, "\"a\\u0000b\"");
+    expect_json("other control bytes", "\x01\x1f\x0b", 3,
+        "\"\\u0001\\u001f\\u000b\"");
+    expect_json("delete", "\x7f", 1, "\"\x7f\"");
+    expect_json("UTF-8", "caf\xc3\xa9 \xe2\x82\xac", 9,
+        "\"caf\xc3\xa9 \xe2\x82\xac\"");
+    expect_json("high bytes", "\x80\xff\xa0\xbf\xc0\xdf\xe0\xfe", 8,
+        "\"\x80\xff\xa0\xbf\xc0\xdf\xe0\xfe\"");
+    expect_json("a long plain run", "abcdefghijklmnopqrstuvwxyz", 26,
+        "\"abcdefghijklmnopqrstuvwxyz\"");
+
+    /* Every byte, at every position in a run of plain and high bytes long
+       enough to be checked eight at a time on both sides of it. */
+    for (int byte = 0; byte < 256; byte++) {
+        for (int at = 0; at < 24; at++) {
+            char str[24];
+            for (int i = 0; i < 24; i++) str[i] = i % 3 ? 'x' : (char)0xe9;
+            str[at] = (char)byte;
+
+            char_buffer expected = NULL;
+            arrpush(expected, '"');
+            for (int i = 0; i < 24; i++) {
+                escape_byte(&expected, (unsigned char)str[i]);
+            }
+            arrpush(expected, '"');
+            arrpush(expected, '\0');
+
+            char_buffer out = NULL;
+            imcli_json_string(&out, str, sizeof(str));
+            arrpush(out, '\0');
+            if (arrlen(out) != arrlen(expected)
+                || memcmp(out, expected, arrlen(out)) != 0) {
+                printf("FAIL: byte 0x%02x at %d came out as %s\n",
+                    byte, at, out);
+                failures += 1;
+            }
+            arrfree(out);
+            arrfree(expected);
+        }
+    }
+
+    if (failures == 0) printf("ok\n");
+    return failures == 0 ? 0 : 1;
+}
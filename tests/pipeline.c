@@ -0,0 +1,190 @@
+/* Checks that lines read ahead by a pipeline come out, and write their
+   output, in the order they were read, even when there are more of them than
+   the pipeline has slots, and when some use variables set by the lines before
+   them; that a pipeline refuses registries with commands that read the input
+   themselves; and that `|` hands a command's output to the next one.
+
+       cc -std=c11 -o pipeline_test tests/pipeline.c -lpthread && ./pipeline_test
+
+   Exits with 0 if everything passed. */
+
+#define _POSIX_C_SOURCE 200809L
+#define IMCLI_THREADS
+
+#include <string.h>
+
+#include "../imcli.h"
+
+#define STB_DS_IMPLEMENTATION
+#include "../stb_ds.h"
+
+static bool say_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)userdata;
+    char_buffer text = join_words(*args);
+    imcli_printf(session, "said %s\n", text ? text : "");
+    arrfree(text);
+    return true;
+}
+
+static bool count_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)userdata;
+    imcli_printf(session, "%d words\n", (int)arrlen(*args));
+    return true;
+}
+
+static bool take_payload(
+    struct imcli_session *session,
+    string_buffer *args,
+    struct imcli_payload *payload,
+    void *userdata
+) {
+    (void)session;
+    (void)args;
+    (void)payload;
+    (void)userdata;
+    return true;
+}
+
+static int failures = 0;
+
+static void expect_same(char *what, char *got, char *expected) {
+    if (strcmp(got, expected) != 0) {
+        printf("FAIL: %s wrote\n%s\nexpected\n%s\n", what, got, expected);
+        failures += 1;
+    }
+}
+
+/* Runs every line of script through a pipeline, and returns what it wrote. */
+static char_buffer run_pipeline(struct imcli_registry *registry, char *script) {
+    char_buffer out = NULL;
+    FILE *input = fmemopen(script, strlen(script), "r");
+    struct imcli_session session = imcli_session_new(input, NULL);
+    imcli_session_set_sink(&session, imcli_sink_memory(&out));
+
+    struct imcli_pipeline pipeline;
+    if (!imcli_pipeline_start(&pipeline, &session, registry)) {
+        printf("FAIL: the pipeline didn't start\n");
+        failures += 1;
+    } else {
+        string_buffer words = NULL;
+        while (imcli_pipeline_next(&pipeline, &words)) {
+            imcli_dispatch_line(&session, registry, &words);
+            sbfree(&words);
+        }
+        imcli_pipeline_stop(&pipeline);
+    }
+
+    imcli_session_free(&session);
+    fclose(input);
+
+    arrpush(out, '\0');
+    return out;
+}
+
+/* Runs one line the way a prompt loop would, and returns what it wrote. */
+static char_buffer run_line(struct imcli_registry *registry, char *text) {
+    char_buffer out = NULL;
+    struct imcli_session session = imcli_session_new(NULL, NULL);
+    imcli_session_set_sink(&session, imcli_sink_memory(&out));
+
+    string_buffer words = split_words_n(text, strlen(text));
+    imcli_dispatch_line(&session, registry, &words);
+    sbfree(&words);
+    imcli_session_free(&session);
+
+    arrpush(out, '\0');
+    return out;
+}
+
+static void expect_line(
+    struct imcli_registry *registry,
+    char *line,
+    char *expected
+) {
+    char_buffer out = run_line(registry, line);
+    expect_same(line, out, expected);
+    arrfree(out);
+}
+
+int main(void) {
+    struct imcli_registry registry = {0};
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "say",
+        .help_message = "say\n",
+        .handler = say_command,
+    });
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "count",
+        .help_message = "count\n",
+        .handler = count_command,
+    });
+    imcli_register_variable_commands(&registry);
+
+    /* Enough lines to go round the slots a few times, with variables that
+       have to be split after the lines setting them have run. */
+    char_buffer script = NULL;
+    char_buffer expected = NULL;
+    char text[64];
+    for (int i = 0; i < 1000; i++) {
+        int len;
+        if (i % 100 == 50) {
+            len = snprintf(text, sizeof(text), "set n %d\nsay n is $n\n", i);
+            memcpy(arraddnptr(script, len), text, len);
+            len = snprintf(text, sizeof(text), "said n is %d\n", i);
+        } else {
+            len = snprintf(text, sizeof(text), "say line %d\n\n", i);
+            memcpy(arraddnptr(script, len), text, len);
+            len = snprintf(text, sizeof(text), "said line %d\n", i);
+        }
+        memcpy(arraddnptr(expected, len), text, len);
+    }
+    arrpush(script, '\0');
+    arrpush(expected, '\0');
+
+    char_buffer out = run_pipeline(&registry, script);
+    expect_same("the pipeline", out, expected);
+    arrfree(out);
+
+    out = run_pipeline(&registry, "say a ; say b | count\nsay c\n");
+    expect_same("separators in a pipeline", out, "said a\n2 words\nsaid c\n");
+    arrfree(out);
+
+    /* The output of each stage is the next one's arguments, and only the
+       last stage writes to the session. */
+    expect_line(&registry, "say a b c", "said a b c\n");
+    expect_line(&registry, "say a b c | count", "4 words\n");
+    expect_line(&registry, "say a | say b", "said b said a\n");
+    expect_line(&registry, "say a | say b | say c", "said c said b said a\n");
+    expect_line(&registry, "say a | say b ; say c", "said b said a\nsaid c\n");
+
+    struct imcli_registry payloads = {0};
+    imcli_register(&payloads, (struct imcli_command){
+        .keywords = "take",
+        .help_message = "take <<TERM\n",
+        .payload_handler = take_payload,
+    });
+    struct imcli_session session = imcli_session_new(stdin, NULL);
+    struct imcli_pipeline pipeline;
+    if (imcli_pipeline_start(&pipeline, &session, &payloads)) {
+        printf("FAIL: a pipeline started with a payload command\n");
+        failures += 1;
+        imcli_pipeline_stop(&pipeline);
+    }
+    imcli_session_free(&session);
+
+    arrfree(script);
+    arrfree(expected);
+    imcli_registry_free(&payloads);
+    imcli_registry_free(&registry);
+
+    if (failures == 0) printf("ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,227 @@
+/* Checks that a compiled script, replayed straight or through the cache, writes
+   exactly what running its lines as text does, including when lines define or
+   remove aliases and variables that change what later lines run, and when an
+   alias is defined between compiling a script and replaying it.
+
+       cc -std=c11 -o replay_test tests/replay.c && ./replay_test
+
+   Exits with 0 if everything passed. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../imcli.h"
+
+#define STB_DS_IMPLEMENTATION
+#include "../stb_ds.h"
+
+static bool say_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)userdata;
+    char_buffer text = join_words(*args);
+    imcli_printf(session, "said %s\n", text ? text : "");
+    arrfree(text);
+    return true;
+}
+
+static bool shout_command(
+    struct imcli_session *session,
+    string_buffer *args,
+    void *userdata
+) {
+    (void)userdata;
+    char_buffer text = join_words(*args);
+    imcli_printf(session, "SHOUTED %s\n", text ? text : "");
+    arrfree(text);
+    return true;
+}
+
+static struct imcli_registry registry;
+static struct imcli_aliases aliases;
+
+static int failures = 0;
+
+/* Every run starts without aliases, since they belong to the registry. */
+static char_buffer start(struct imcli_session *session) {
+    imcli_aliases_free(&aliases);
+    *session = imcli_session_new(NULL, NULL);
+    return NULL;
+}
+
+static char_buffer finish(struct imcli_session *session, char_buffer out) {
+    imcli_session_free(session);
+    arrpush(out, '\0');
+    return out;
+}
+
+/* Runs each line of the script the way a prompt loop would. */
+static char_buffer run_text(char *script) {
+    struct imcli_session session;
+    char_buffer out = start(&session);
+    imcli_session_set_sink(&session, imcli_sink_memory(&out));
+
+    char *line = script;
+    while (*line) {
+        char *end = strchr(line, '\n');
+        if (!end) end = line + strlen(line);
+
+        string_buffer words = imcli_split_words_with_variables(
+            &session,
+            line,
+            end - line
+        );
+        imcli_dispatch_line(&session, &registry, &words);
+        sbfree(&words);
+
+        line = *end ? end + 1 : end;
+    }
+
+    return finish(&session, out);
+}
+
+static char_buffer run_compiled(char *script) {
+    struct imcli_session session;
+    char_buffer out = start(&session);
+    imcli_session_set_sink(&session, imcli_sink_memory(&out));
+
+    char *compiled = imcli_compile_script(&registry, script, strlen(script));
+    if (imcli_replay_script(&session, &registry, compiled, arrlen(compiled))
+        != IMCLI_REPLAY_DONE) {
+        printf("FAIL: a freshly compiled script didn't replay\n");
+        arrpush(out, '!');
+    }
+    arrfree(compiled);
+
+    return finish(&session, out);
+}
+
+static char_buffer run_cached(char *script, char *cache_dir) {
+    struct imcli_session session;
+    char_buffer out = start(&session);
+    imcli_session_set_sink(&session, imcli_sink_memory(&out));
+
+    if (imcli_run_script_cached(
+        &session,
+        &registry,
+        script,
+        strlen(script),
+        cache_dir
+    ) != IMCLI_REPLAY_DONE) {
+        printf("FAIL: a cached script didn't replay\n");
+        arrpush(out, '!');
+    }
+
+    return finish(&session, out);
+}
+
+static void expect_same(char *script, char *how, char *got, char *expected) {
+    if (strcmp(got, expected) != 0) {
+        printf("FAIL: %s of\n%s\nwrote\n%s\ninstead of\n%s\n",
+            how, script, got, expected);
+        failures += 1;
+    }
+}
+
+static void expect_replays_same(char *script, char *cache_dir) {
+    char_buffer text = run_text(script);
+    char_buffer compiled = run_compiled(script);
+    expect_same(script, "replaying", compiled, text);
+
+    /* Once to compile and save it, then once from the saved file. */
+    char_buffer saved = run_cached(script, cache_dir);
+    expect_same(script, "the first cached run", saved, text);
+    char_buffer loaded = run_cached(script, cache_dir);
+    expect_same(script, "the second cached run", loaded, text);
+
+    arrfree(text);
+    arrfree(compiled);
+    arrfree(saved);
+    arrfree(loaded);
+}
+
+/* Removes the files run_cached left behind, and the directory, checking
+   that there was one for each script. */
+static void remove_cache(char *cache_dir, char **scripts, int script_count) {
+    uint64_t registry_hash = imcli_registry_hash(&registry);
+    for (int i = 0; i < script_count; i++) {
+        char path[4096];
+        snprintf(
+            path,
+            sizeof(path),
+            "%s/%016llx%016llx.imclibc",
+            cache_dir,
+            (unsigned long long)stbds_hash_bytes(
+                scripts[i],
+                strlen(scripts[i]),
+                0
+            ),
+            (unsigned long long)registry_hash
+        );
+        if (remove(path) != 0) {
+            printf("FAIL: nothing was cached for\n%s\n", scripts[i]);
+            failures += 1;
+        }
+    }
+    remove(cache_dir);
+}
+
+int main(void) {
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "say",
+        .help_message = "say\n",
+        .handler = say_command,
+    });
+    imcli_register(&registry, (struct imcli_command){
+        .keywords = "shout",
+        .help_message = "shout\n",
+        .handler = shout_command,
+    });
+    imcli_register_alias_commands(&registry, &aliases);
+    imcli_register_variable_commands(&registry);
+
+    char *scripts[] = {
+        "say one\nsay two three\n\nshout four\n",
+        "say one\nalias say shout\nsay two\nunalias say\nsay three\n",
+        "set c shout\n$c one\nset c say\n$c two\nunset c\nsay three $c\n",
+        "say one ; alias x say\nx two\nx three | say\n",
+        "alias s say first\ns second\nalias s shout\ns third\n",
+        "nope\nsay after an unknown command\n",
+    };
+    int script_count = sizeof(scripts) / sizeof(*scripts);
+
+    char cache_dir[64];
+    snprintf(cache_dir, sizeof(cache_dir), "/tmp/imcli_replay_test_%ld",
+        (long)time(NULL));
+    mkdir(cache_dir, 0700);
+
+    for (int i = 0; i < script_count; i++) {
+        expect_replays_same(scripts[i], cache_dir);
+    }
+    remove_cache(cache_dir, scripts, script_count);
+
+    /* An alias that didn't exist when the script was compiled. */
+    char *script = "say hi\n";
+    char *compiled = imcli_compile_script(&registry, script, strlen(script));
+    struct imcli_session session;
+    char_buffer out = start(&session);
+    imcli_session_set_sink(&session, imcli_sink_memory(&out));
+    imcli_exec_string(&session, &registry, "alias say shout");
+    imcli_replay_script(&session, &registry, compiled, arrlen(compiled));
+    out = finish(&session, out);
+    expect_same(script, "replaying after an alias", out, "SHOUTED hi\n");
+    arrfree(out);
+    arrfree(compiled);
+
+    imcli_aliases_free(&aliases);
+    imcli_registry_free(&registry);
+
+    if (failures == 0) printf("ok\n");
+    return failures == 0 ? 0 : 1;
+}